@@ -0,0 +1,82 @@
+/*
+ * bench/parse.c
+ * Copyright 2025 Bruce Hill
+ * Released under the MIT License
+ *
+ * A microbenchmark for BTUI's input parser. It feeds terminal input through
+ * the input buffer and parse_input() and reports how many events per second
+ * were decoded. The input is either a file of recorded terminal input (e.g.
+ * from `script -I`), or a synthetic mix of typing, modified arrow keys, SGR
+ * mouse drags and wheel turns, kitty keyboard protocol reports, and OSC/DCS
+ * replies.
+ *
+ * Build and run with:
+ *     cc -O2 -o bench/parse bench/parse.c && ./bench/parse [recording] [repetitions]
+ */
+
+#include "../btui.c"
+
+// A synthetic mix of input, roughly the proportions seen in an interactive
+// session:
+static const char *const synthetic_input[] = {
+    "hello world", "\r", "\x7f\x7f", "\033[A", "\033[1;5C", "\033[1;2D", "\033OP",
+    "\033[15;3~", "\033[<32;10;5M", "\033[<32;11;5M", "\033[<32;12;6M", "\033[<0;12;6m",
+    "\033[<64;40;20M", "\033[<65;40;20M", "\033[97;5u", "\033[13u", "\033[27;5;105~",
+    "\033ax", "\033]11;rgb:1a1a/1a1a/1a1a\033\\", "\033P1$r0m\033\\", "\033[?2026;2$y",
+};
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+static char *read_recording(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (!f) err(1, "%s", path);
+    size_t cap = 1 << 16;
+    char *buf = malloc(cap);
+    *len = 0;
+    for (size_t n; (n = fread(buf + *len, 1, cap - *len, f)) > 0;) {
+        *len += n;
+        if (*len == cap) buf = realloc(buf, (cap *= 2));
+    }
+    fclose(f);
+    return buf;
+}
+
+int main(int argc, char *argv[]) {
+    size_t len = 0;
+    char *input;
+    if (argc > 1) {
+        input = read_recording(argv[1], &len);
+    } else {
+        size_t cap = 1 << 20;
+        input = malloc(cap);
+        for (size_t i = 0; len + 64 < cap; i++) {
+            const char *s = synthetic_input[i % (sizeof(synthetic_input) / sizeof(synthetic_input[0]))];
+            memcpy(input + len, s, strlen(s));
+            len += strlen(s);
+        }
+    }
+    long repetitions = argc > 2 ? atol(argv[2]) : 100;
+
+    long events = 0;
+    double start = now_sec();
+    for (long r = 0; r < repetitions; r++) {
+        for (size_t pos = 0; pos < len;) {
+            // Top up the input buffer the way fill_input() would:
+            size_t room = BTUI_INPUT_BUFSIZE - (bt.input_end - bt.input_start);
+            for (; room > 0 && pos < len; room--)
+                bt.input[bt.input_end++ & (BTUI_INPUT_BUFSIZE - 1)] = input[pos++];
+            int x, y;
+            for (int key; (key = parse_input(&x, &y)) != PARSE_INCOMPLETE;)
+                events += (key != -1);
+        }
+    }
+    double elapsed = now_sec() - start;
+    double bytes = (double)len * (double)repetitions;
+    printf("%ld events in %.3fs: %.1fM events/s, %.1f MB/s\n", events, elapsed,
+           1e-6 * (double)events / elapsed, 1e-6 * bytes / elapsed);
+    return 0;
+}
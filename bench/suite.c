@@ -0,0 +1,327 @@
+/*
+ * bench/suite.c
+ * Copyright 2025 Bruce Hill
+ * Released under the MIT License
+ *
+ * Benchmarks for BTUI's rendering and input, run on the headless memory
+ * backend (see btui_init_headless()) so that no terminal is needed and the
+ * numbers don't depend on one. Each case reports the time per operation, the
+ * bytes of terminal output per operation, and the system calls per operation
+ * (reads, writes, polls and ioctls made by BTUI). The input case decodes a
+ * recording of terminal input (e.g. from `script -I`) if one is given, or a
+ * synthetic stream of mouse drags and bracketed pastes.
+ *
+ * Build and run with:
+ *     cc -O2 -o bench/suite bench/suite.c && ./bench/suite [recording] [size]
+ * where `size` is the screen size (WIDTHxHEIGHT, 200x60 by default).
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// BTUI's system calls are counted (while `counting` is set) by wrapping them:
+static long num_syscalls;
+static int counting;
+
+static ssize_t counted_read(int fd, void *buf, size_t n) {
+    num_syscalls += counting;
+    return read(fd, buf, n);
+}
+
+static ssize_t counted_readv(int fd, const struct iovec *iov, int iovcnt) {
+    num_syscalls += counting;
+    return readv(fd, iov, iovcnt);
+}
+
+static ssize_t counted_write(int fd, const void *buf, size_t n) {
+    num_syscalls += counting;
+    return write(fd, buf, n);
+}
+
+static ssize_t counted_writev(int fd, const struct iovec *iov, int iovcnt) {
+    num_syscalls += counting;
+    return writev(fd, iov, iovcnt);
+}
+
+static int counted_poll(struct pollfd *fds, nfds_t nfds, int timeout) {
+    num_syscalls += counting;
+    return poll(fds, nfds, timeout);
+}
+
+static int counted_ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *timeout,
+                         const sigset_t *sigmask) {
+    num_syscalls += counting;
+    return ppoll(fds, nfds, timeout, sigmask);
+}
+
+static int counted_ioctl(int fd, unsigned long request, void *arg) {
+    num_syscalls += counting;
+    return ioctl(fd, request, arg);
+}
+
+#define read counted_read
+#define readv counted_readv
+#define write counted_write
+#define writev counted_writev
+#define poll counted_poll
+#define ppoll counted_ppoll
+#define ioctl(fd, request, arg) counted_ioctl(fd, request, (void *)(arg))
+#include "../btui.c"
+#undef read
+#undef readv
+#undef write
+#undef writev
+#undef poll
+#undef ppoll
+#undef ioctl
+
+static int width = 200, height = 60;
+
+static int64_t bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Measurements for one case, started with begin_case() and reported with
+// end_case():
+static struct {
+    const char *name;
+    int64_t start;
+} bench_case;
+
+static void begin_case(const char *name) {
+    btui_reset_captured_output();
+    bench_case.name = name;
+    num_syscalls = 0;
+    counting = 1;
+    bench_case.start = bench_now();
+}
+
+static void end_case(long ops) {
+    int64_t elapsed = bench_now() - bench_case.start;
+    counting = 0;
+    size_t bytes = 0;
+    btui_captured_output(&bytes);
+    printf("%-24s %9ld ops %12.0f ns/op %10.1f bytes/op %8.2f syscalls/op\n", bench_case.name, ops,
+           (double)elapsed / (double)ops, (double)bytes / (double)ops,
+           (double)num_syscalls / (double)ops);
+}
+
+// Every cell of the screen gets a new background color each frame:
+static void bench_fill_box(void) {
+    btui_set_buffered(1);
+    begin_case("fill_box (full screen)");
+    long frames = 200;
+    for (long i = 0; i < frames; i++) {
+        btui_set_style(BTUI_COLOR_DEFAULT, BTUI_COLOR_256((unsigned)(i % 216 + 16)), 0);
+        btui_fill_box(0, 0, width, height);
+        btui_flush();
+    }
+    end_case(frames);
+    btui_set_buffered(0);
+}
+
+// A grid of boxes whose colors change every frame:
+static void bench_linebox_grid(void) {
+    btui_set_buffered(1);
+    begin_case("draw_linebox grid");
+    long frames = 200;
+    for (long i = 0; i < frames; i++) {
+        for (int y = 1; y + 5 < height; y += 6) {
+            for (int x = 1; x + 10 < width; x += 12) {
+                btui_set_style(BTUI_COLOR_256((unsigned)((i + x + y) % 216 + 16)), BTUI_COLOR_DEFAULT, 0);
+                btui_draw_linebox(x, y, 8, 3);
+            }
+        }
+        btui_flush();
+    }
+    end_case(frames);
+    btui_set_buffered(0);
+}
+
+// A table where every cell has its own colors and attributes, all changing
+// from frame to frame:
+static void bench_styled_table(int buffered) {
+    btui_set_buffered(buffered);
+    begin_case(buffered ? "style+write table (buf)" : "style+write table");
+    long frames = 100;
+    char text[16];
+    for (long i = 0; i < frames; i++) {
+        btui_begin_frame();
+        for (int y = 0; y < height; y++) {
+            btui_move_cursor(0, y);
+            for (int x = 0; x + 10 <= width; x += 10) {
+                unsigned c = (unsigned)(i * 7 + x * 3 + y * 5);
+                btui_set_style(BTUI_COLOR_RGB(c & 0xFF, (c >> 2) & 0xFF, (c >> 4) & 0xFF),
+                               BTUI_COLOR_256(c % 24 + 232), (c & 1) ? BTUI_BOLD : BTUI_ITALIC);
+                snprintf(text, sizeof(text), "%9u ", c);
+                btui_puts(text);
+            }
+        }
+        btui_end_frame();
+    }
+    end_case(frames);
+    btui_set_style(BTUI_COLOR_DEFAULT, BTUI_COLOR_DEFAULT, BTUI_NORMAL);
+    btui_set_buffered(0);
+}
+
+// A frame of long lines of text, copied into the output buffer by
+// btui_puts() or sent from the caller's memory by btui_puts_span():
+static void bench_text_rows(int spans) {
+    char *lines = malloc((size_t)(height * (width + 1)));
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++)
+            lines[y * (width + 1) + x] = (char)('a' + (x + y) % 26);
+        lines[y * (width + 1) + width] = '\0';
+    }
+    begin_case(spans ? "text rows (puts_span)" : "text rows (puts)");
+    long frames = 1000;
+    for (long i = 0; i < frames; i++) {
+        btui_begin_frame();
+        for (int y = 0; y < height; y++) {
+            btui_move_cursor(0, y);
+            const char *line = &lines[((y + i) % height) * (width + 1)];
+            if (spans) btui_puts_span(line);
+            else btui_puts(line);
+        }
+        btui_end_frame();
+    }
+    end_case(frames);
+    free(lines);
+}
+
+// A log that gains a line at the bottom every frame:
+static void bench_log_tail(void) {
+    btui_set_buffered(1);
+    char line[64];
+    for (int y = 0; y < height; y++) {
+        btui_move_cursor(0, y);
+        snprintf(line, sizeof(line), "[%06d] starting worker %d", y, y % 7);
+        btui_puts(line);
+    }
+    btui_flush();
+    begin_case("btui_scroll log tail");
+    long frames = 1000;
+    for (long i = 0; i < frames; i++) {
+        btui_scroll(0, height - 1, 1);
+        btui_move_cursor(0, height - 1);
+        snprintf(line, sizeof(line), "[%06ld] request %ld handled in %ldms", i + height, i * 31 % 997, i % 50);
+        btui_puts(line);
+        btui_flush();
+    }
+    end_case(frames);
+    btui_set_buffered(0);
+}
+
+// Typing a query (and backspacing over it) against a million file paths:
+static void bench_picker_filter(void) {
+    static const char *const dirs[] = {"src", "lib", "include", "test", "docs", "build", "vendor"};
+    static const char *const names[] = {"main", "util", "parser", "render", "input", "config"};
+    static const char *const exts[] = {".c", ".h", ".md", ".tm", ".txt"};
+    int matcher = btui_new_matcher();
+    char path[128];
+    uint32_t seed = 1;
+    for (int i = 0; i < 1000000; i++) {
+        int len = 0;
+        for (int depth = 0; depth < 3; depth++) {
+            seed = seed * 1103515245 + 12345;
+            len += snprintf(path + len, sizeof(path) - (size_t)len, "%s/", dirs[(seed >> 16) % 7]);
+        }
+        seed = seed * 1103515245 + 12345;
+        len += snprintf(path + len, sizeof(path) - (size_t)len, "%s%d%s", names[(seed >> 16) % 6],
+                        i % 1000, exts[(seed >> 8) % 5]);
+        btui_matcher_add(matcher, path, (size_t)len);
+    }
+    static const char *const queries[] = {"", "s", "sr", "src", "src/", "src/p", "src/pa", "src/par",
+                                          "src/pa", "src/p", "src/", "src/r", "src/re"};
+    int num_queries = (int)(sizeof(queries) / sizeof(queries[0]));
+    for (int fuzzy = 0; fuzzy <= 1; fuzzy++) {
+        begin_case(fuzzy ? "picker fuzzy (1M lines)" : "picker filter (1M lines)");
+        for (int i = 0; i < num_queries; i++)
+            btui_match(matcher, queries[i], fuzzy ? BTUI_MATCH_FUZZY : 0, 1000);
+        end_case(num_queries);
+    }
+    btui_free_matcher(matcher);
+}
+
+// Decode a stream of terminal input, injecting as much as the pipe takes and
+// then reading keys until it runs dry:
+static void bench_input(const char *name, const char *input, size_t len) {
+    btui_set_mode(BTUI_MODE_TUI);
+    btui_reset_captured_output();
+    begin_case(name);
+    long events = 0;
+    for (size_t pos = 0; pos < len;) {
+        counting = 0;
+        int n = btui_inject_input(input + pos, len - pos);
+        counting = 1;
+        if (n > 0) pos += (size_t)n;
+        int x, y;
+        for (int key; (key = btui_getkey_ns(0, &x, &y)) != -1;) {
+            events += btui_key_count();
+            if (key == PASTE_EVENT) btui_get_paste(NULL);
+        }
+    }
+    end_case(events);
+    btui_set_mode(BTUI_MODE_DISABLED);
+}
+
+static char *read_recording(const char *path, size_t *len) {
+    FILE *f = fopen(path, "rb");
+    if (!f) err(1, "%s", path);
+    size_t cap = 1 << 16;
+    char *buf = malloc(cap);
+    *len = 0;
+    for (size_t n; (n = fread(buf + *len, 1, cap - *len, f)) > 0;) {
+        *len += n;
+        if (*len == cap) buf = realloc(buf, (cap *= 2));
+    }
+    fclose(f);
+    return buf;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 2 && sscanf(argv[2], "%dx%d", &width, &height) != 2) errx(1, "Bad size: %s", argv[2]);
+    if (btui_init_headless(width, height, BTUI_HEADLESS_MEMORY) != 0) err(1, "Couldn't start BTUI");
+    btui_set_mode(BTUI_MODE_TUI);
+
+    bench_fill_box();
+    bench_linebox_grid();
+    bench_styled_table(0);
+    bench_styled_table(1);
+    bench_text_rows(0);
+    bench_text_rows(1);
+    bench_log_tail();
+    bench_picker_filter();
+
+    size_t len = 0, cap = 1 << 20;
+    if (argc > 1) {
+        char *input = read_recording(argv[1], &len);
+        bench_input("getkey (recording)", input, len);
+        free(input);
+    } else {
+        char *input = malloc(cap);
+        for (int i = 0; len + 64 < cap; i++) {
+            int x = 10 + i % 100, y = 5 + (i / 100) % 40;
+            len += (size_t)snprintf(input + len, cap - len, "\033[<32;%d;%dM", x, y);
+        }
+        bench_input("getkey (mouse drags)", input, len);
+        len = 0;
+        while (len + 4096 < cap) {
+            len += (size_t)snprintf(input + len, cap - len, "\033[200~");
+            for (int line = 0; line < 40; line++)
+                len += (size_t)snprintf(input + len, cap - len, "pasted line %d of some text\n", line);
+            len += (size_t)snprintf(input + len, cap - len, "\033[201~x");
+        }
+        bench_input("getkey (pastes)", input, len);
+        free(input);
+    }
+    btui_disable();
+    return 0;
+}
@@ -9,17 +9,44 @@
 #ifndef __BTUI_H__
 #define __BTUI_H__
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // For posix_openpt() and the other pseudo-terminal functions
+#endif
+
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+// Vector instructions for finding bytes in btui_match(): MATCH_SIMD_WIDTH
+// bytes are compared at a time, giving MATCH_MASK_BITS bits per byte
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define MATCH_SIMD_WIDTH 32
+#define MATCH_MASK_BITS 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define MATCH_SIMD_WIDTH 16
+#define MATCH_MASK_BITS 1
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define MATCH_SIMD_WIDTH 16
+#define MATCH_MASK_BITS 4
+#endif
+
 #define BTUI_VERSION 5
 
 // Terminal escape sequences:
@@ -29,20 +56,112 @@
 #define T_MOUSE_CELL "1002"
 #define T_MOUSE_SGR "1006"
 #define T_ALT_SCREEN "1049"
+#define T_SYNC_OUTPUT "2026"
+#define T_BRACKETED_PASTE "2004"
 #define T_ON(opt) "\033[?" opt "h"
 #define T_OFF(opt) "\033[?" opt "l"
 
+// Amount of output to buffer before writing it to the terminal
+#ifndef BTUI_OUTPUT_BUFSIZE
+#define BTUI_OUTPUT_BUFSIZE 65536
+#endif
+
+// Text passed to btui_puts_span() that is at least this long is sent straight
+// from the caller's memory instead of being copied into the output buffer, and
+// at most this many such spans are held back at once:
+#ifndef BTUI_MIN_SPAN
+#define BTUI_MIN_SPAN 256
+#endif
+#ifndef BTUI_MAX_SPANS
+#define BTUI_MAX_SPANS 64
+#endif
+
+// Size of the buffer for terminal input (must be a power of two)
+#ifndef BTUI_INPUT_BUFSIZE
+#define BTUI_INPUT_BUFSIZE 4096
+#endif
+
+// Maximum time in milliseconds to wait for the rest of an escape sequence when
+// using btui_getkey_ns()
+#ifndef BTUI_ESCAPE_TIMEOUT
+#define BTUI_ESCAPE_TIMEOUT 50
+#endif
+
+// How long (in milliseconds) to wait for a burst of resize signals to settle
+// down before reporting a single RESIZE_EVENT
+#ifndef BTUI_RESIZE_SETTLE
+#define BTUI_RESIZE_SETTLE 20
+#endif
+
+// Maximum number of file descriptors and timers for btui_wait_event()
+#ifndef BTUI_MAX_WATCHES
+#define BTUI_MAX_WATCHES 32
+#endif
+#ifndef BTUI_MAX_TIMERS
+#define BTUI_MAX_TIMERS 32
+#endif
+
+// Maximum number of offscreen surfaces (see btui_new_surface()), and of
+// separate damaged areas tracked for compositing them before they get merged
+#ifndef BTUI_MAX_SURFACES
+#define BTUI_MAX_SURFACES 32
+#endif
+#ifndef BTUI_MAX_DAMAGE
+#define BTUI_MAX_DAMAGE 16
+#endif
+
+// Maximum number of distinct multi-codepoint grapheme clusters kept for cells,
+// and the number of entries in the cache of text widths (a power of 2)
+#ifndef BTUI_MAX_GRAPHEMES
+#define BTUI_MAX_GRAPHEMES 65536
+#endif
+#ifndef BTUI_WIDTH_CACHE_SIZE
+#define BTUI_WIDTH_CACHE_SIZE 1024
+#endif
+#ifndef BTUI_COLOR_CACHE_SIZE
+#define BTUI_COLOR_CACHE_SIZE 256
+#endif
+
+// Maximum number of matchers (see btui_new_matcher()), the most threads one
+// search is split across, and the fewest candidates worth giving a thread
+#ifndef BTUI_MAX_MATCHERS
+#define BTUI_MAX_MATCHERS 16
+#endif
+#ifndef BTUI_MATCH_THREADS
+#define BTUI_MATCH_THREADS 16
+#endif
+#ifndef BTUI_MATCH_CHUNK
+#define BTUI_MATCH_CHUNK 16384
+#endif
+
+// Maximum time in milliseconds to wait for the rest of a bracketed paste
+#ifndef BTUI_PASTE_TIMEOUT
+#define BTUI_PASTE_TIMEOUT 500
+#endif
+
+// How many bytes of output may be waiting in the terminal's output queue
+// before btui_should_render() says to hold off on drawing another frame
+#ifndef BTUI_OUTPUT_BACKLOG
+#define BTUI_OUTPUT_BACKLOG 4096
+#endif
+
 // Maximum time in milliseconds between double clicks
 #ifndef BTUI_DOUBLECLICK_THRESHOLD
 #define BTUI_DOUBLECLICK_THRESHOLD 200
 #endif
 
+// How many decoded keys the input thread can queue up (must be a power of 2)
+#ifndef BTUI_INPUT_QUEUE_SIZE
+#define BTUI_INPUT_QUEUE_SIZE 256
+#endif
+
 // Keyboard modifiers:
 #define MOD_BITSHIFT 9
 #define MOD_META (1 << (MOD_BITSHIFT + 0))
 #define MOD_CTRL (1 << (MOD_BITSHIFT + 1))
 #define MOD_ALT (1 << (MOD_BITSHIFT + 2))
 #define MOD_SHIFT (1 << (MOD_BITSHIFT + 3))
+#define MOD_MASK (MOD_META | MOD_CTRL | MOD_ALT | MOD_SHIFT)
 
 typedef enum {
     BTUI_MODE_UNINITIALIZED = 0,
@@ -129,6 +248,7 @@ typedef enum {
     MOUSE_WHEEL_PRESS,
     // Special:
     RESIZE_EVENT,
+    PASTE_EVENT, // See btui_get_paste()
 } btui_key_t;
 
 typedef enum {
@@ -219,12 +339,388 @@ const attr_t BTUI_NO_OVERLINED = 1ul << 55;
 // 56-59: reserved
 // 60-65: Ideogram stuff
 
+// Colors (used by the cell buffer and btui_set_style()):
+typedef uint32_t btui_color_t;
+#define BTUI_COLOR_DEFAULT 0
+#define BTUI_COLOR_BASIC(n) (0x01000000u | (uint32_t)(n))
+#define BTUI_COLOR_256(n) (0x02000000u | (uint32_t)(n))
+#define BTUI_COLOR_RGB(r, g, b)                                                                    \
+    (0x03000000u | ((uint32_t)(r) << 16) | ((uint32_t)(g) << 8) | (uint32_t)(b))
+#define BTUI_COLOR_KIND(c) ((c) >> 24)
+#define BTUI_COLOR_UNCHANGED 0xFFFFFFFFu
+
+// A text style: which attributes are turned on, and the fg/bg colors
+typedef struct {
+    attr_t attrs;
+    btui_color_t fg, bg;
+} btui_style_t;
+
+// A single character cell on the screen:
+typedef struct {
+    btui_style_t style;
+    uint32_t ch; // Unicode codepoint (0 for the right half of a wide character)
+} btui_cell_t;
+
+// In a surface, a cell that shows whatever is beneath it:
+#define BTUI_TRANSPARENT 0xFFFFFFFFu
+
+// A cell holding a grapheme cluster of more than one codepoint stores the
+// cluster's index in the grapheme table (see intern_grapheme()) with this flag:
+#define BTUI_GRAPHEME_FLAG 0x80000000u
+#define BTUI_IS_GRAPHEME(ch) (((ch) & BTUI_GRAPHEME_FLAG) && (ch) != BTUI_TRANSPARENT)
+
+// An offscreen grid of cells that is composited onto the screen in buffered
+// mode (see btui_new_surface()):
+typedef struct {
+    int id;
+    int x, y, width, height; // Position on the screen and size
+    int z;                   // Stacking order: higher is drawn on top
+    int visible;
+    btui_cell_t *cells;
+    // The drawing cursor and style while another target is being drawn into:
+    int cursor_x, cursor_y;
+    btui_style_t pen;
+} btui_surface_t;
+
+typedef struct {
+    int x, y, w, h;
+} btui_rect_t;
+
+// Event loop:
+typedef enum {
+    BTUI_EVENT_TIMEOUT = 0,
+    BTUI_EVENT_KEY,
+    BTUI_EVENT_RESIZE,
+    BTUI_EVENT_FD,
+    BTUI_EVENT_TIMER,
+    BTUI_EVENT_PASTE,
+} btui_event_type_t;
+
+// Terminal capabilities (see btui_set_capabilities()):
+#define BTUI_CAP_SYNC_OUTPUT (1 << 0) // DEC synchronized output (mode 2026)
+#define BTUI_CAP_REP (1 << 1)         // Repeat the previous character (\033[<n>b)
+#define BTUI_CAP_ECH (1 << 2)         // Erase characters (\033[<n>X)
+#define BTUI_CAP_TRUECOLOR (1 << 3)   // 24-bit RGB colors
+#define BTUI_CAP_SCROLL (1 << 4)      // Scroll regions (\033[<t>;<b>r with \033[<n>S/T)
+#define BTUI_CAP_256COLOR (1 << 5)    // The xterm 256-color palette
+
+// Things that can be asked of the terminal (see btui_query()):
+#define BTUI_QUERY_FG (1 << 0)           // Default foreground color (OSC 10)
+#define BTUI_QUERY_BG (1 << 1)           // Default background color (OSC 11)
+#define BTUI_QUERY_DEVICE_ATTRS (1 << 2) // Primary device attributes (DA1)
+#define BTUI_QUERY_CURSOR (1 << 3)       // Cursor position (CPR)
+#define BTUI_QUERY_SYNC_OUTPUT (1 << 4)  // Synchronized output support (DECRQM 2026)
+#define BTUI_QUERY_TRUECOLOR (1 << 5)    // 24-bit color support (DECRQSS)
+#define BTUI_QUERY_ALL ((1 << 6) - 1)
+
+#define BTUI_READABLE 1
+#define BTUI_WRITABLE 2
+
+// Backends for btui_init_headless():
+#define BTUI_HEADLESS_MEMORY 1 // Output is captured in memory and input is read from a pipe
+#define BTUI_HEADLESS_PTY 2    // A pseudo-terminal with a fixed size
+
+// Kinds of escape sequences counted in btui_stats_t:
+typedef enum {
+    BTUI_ESCAPE_CURSOR = 0, // Cursor movement (including CR, LF and BS)
+    BTUI_ESCAPE_STYLE,      // SGR (colors and attributes)
+    BTUI_ESCAPE_ERASE,      // ECH and clearing parts of the screen
+    BTUI_ESCAPE_REPEAT,     // REP
+    BTUI_ESCAPE_SCROLL,     // Scrolling a region
+    BTUI_ESCAPE_OTHER,      // Modes, queries, synchronized output, character sets, etc.
+    BTUI_NUM_ESCAPE_KINDS,
+} btui_escape_kind_t;
+
+// Counters of the work BTUI has done since it started or since
+// btui_reset_stats() (see btui_stats()):
+typedef struct {
+    uint64_t bytes_written, write_calls;
+    uint64_t flushes; // Times the output buffer was sent to the terminal
+    uint64_t escapes[BTUI_NUM_ESCAPE_KINDS];
+    uint64_t frames;  // Outermost btui_end_frame() calls and btui_flush() calls that sent output
+    uint64_t events;  // Input events decoded (each merged mouse report counts)
+    uint64_t bytes_read, read_calls;
+    int64_t render_ns; // How long the last frame took to draw, up to sending it
+    int64_t flush_ns;  // How long the last frame took to write to the terminal
+} btui_stats_t;
+
+// Flags for btui_match():
+#define BTUI_MATCH_FUZZY (1 << 0) // Match the query's characters in order, not necessarily together
+
+typedef struct {
+    btui_event_type_t type;
+    int key, mouse_x, mouse_y; // BTUI_EVENT_KEY
+    int count;                 // BTUI_EVENT_KEY (see btui_key_count())
+    int fd, ready;             // BTUI_EVENT_FD (ready is BTUI_READABLE|BTUI_WRITABLE)
+    int timer;                 // BTUI_EVENT_TIMER
+    int width, height;         // BTUI_EVENT_RESIZE (the new terminal size)
+} btui_event_t;
+
+typedef struct {
+    int fd, events, ready;
+} btui_watch_t;
+
+typedef struct {
+    int id;
+    int64_t deadline, interval; // Nanoseconds (CLOCK_MONOTONIC)
+} btui_timer_t;
+
+// Input parser (see parse_input()):
+#define BTUI_MAX_PARAMS 16
+#define PARSE_INCOMPLETE (-2)
+
+typedef enum {
+    PARSE_GROUND = 0,
+    PARSE_ESCAPE,
+    PARSE_CSI,
+    PARSE_CSI_IGNORE, // A malformed control sequence, skipped up to its final byte
+    PARSE_SS3,
+    PARSE_STRING,        // The body of an OSC, DCS, APC, PM or SOS string
+    PARSE_STRING_ESCAPE, // An ESC inside a string (usually the start of ST)
+    NUM_PARSE_STATES,
+} parse_state_t;
+
+typedef enum {
+    BYTE_CONTROL = 0,  // C0 controls other than ESC and BEL
+    BYTE_BEL,          // 0x07
+    BYTE_ESC,          // 0x1B
+    BYTE_INTERMEDIATE, // 0x20-0x2F
+    BYTE_DIGIT,        // 0-9
+    BYTE_SEPARATOR,    // : ;
+    BYTE_MARKER,       // < = > ?
+    BYTE_FINAL,        // 0x40-0x7E
+    BYTE_DEL,          // 0x7F
+    BYTE_HIGH,         // 0x80-0xFF
+    NUM_BYTE_CLASSES,
+} byte_class_t;
+
+typedef enum {
+    ACT_NONE = 0,
+    ACT_PRINT,
+    ACT_ESC_KEY,
+    ACT_ESC_DISPATCH,
+    ACT_PARAM,
+    ACT_SEPARATOR,
+    ACT_MARKER,
+    ACT_INTERMEDIATE,
+    ACT_CSI_DISPATCH,
+    ACT_SS3_DISPATCH,
+    ACT_STRING_PUT,
+    ACT_STRING_END,
+    ACT_STRING_END_ESC,
+} parse_action_t;
+
+typedef struct {
+    parse_state_t state;
+    char prefix, intermediate; // Private marker and intermediate byte of a CSI sequence
+    // Numeric parameters, with the first ':' subparameter of each (or -1):
+    int params[BTUI_MAX_PARAMS], subparams[BTUI_MAX_PARAMS];
+    int nparams, in_subparam;
+    char string_kind; // The byte after ESC that started a string
+    char string[256];
+    size_t string_len;
+} btui_parser_t;
+
+// What the terminal has said in reply to queries (see btui_query()):
+typedef struct {
+    int pending;     // BTUI_QUERY_* flags that have been sent but not answered yet
+    int answered;    // Queries that have been answered
+    int unsupported; // Queries that the terminal finished replying to without answering
+    int sentinels;   // How many DA1 queries (which mark the end of a batch) are unanswered
+    uint32_t fg, bg; // 0xRRGGBB
+    int cursor_x, cursor_y; // 0-indexed
+    int device_attrs[BTUI_MAX_PARAMS], num_device_attrs;
+    int sync_output; // The DECRPM status of mode 2026 (1 or 2 if supported)
+    int truecolor;
+} btui_term_info_t;
+
+// A key that was read while waiting for replies to queries (with its text,
+// for a PASTE_EVENT):
+#define BTUI_MAX_QUEUED_KEYS 64
+typedef struct {
+    int key, mouse_x, mouse_y, count;
+    int64_t time_ns;
+    char *paste;
+    size_t paste_len;
+} btui_queued_key_t;
+
+// A key decoded by the input thread (see btui_set_input_thread()):
+typedef struct {
+    int key, mouse_x, mouse_y, count;
+    int64_t time_ns; // When its input arrived
+    char *paste;     // A copy of the text of a paste
+    size_t paste_len;
+} btui_input_event_t;
+
+// A grapheme cluster of more than one codepoint (e.g. a letter with combining
+// accents, or an emoji ZWJ sequence):
+typedef struct {
+    uint64_t hash;
+    uint8_t len, width;
+    char bytes[30];
+} btui_grapheme_t;
+
+// A cached width of some text that isn't all ASCII:
+typedef struct {
+    uint64_t hash;
+    size_t len;
+    int width;
+} btui_width_entry_t;
+
+// Caller text to send (without copying it) after the first `offset` bytes of
+// the output buffer:
+typedef struct {
+    size_t offset;
+    const char *text;
+    size_t len;
+} btui_span_t;
+
+// A color that was downsampled for a terminal with fewer colors:
+typedef struct {
+    btui_color_t from, to;
+} btui_color_entry_t;
+
+// The candidates that matched one query (see btui_match()):
+typedef struct {
+    char *query;
+    size_t query_len;
+    uint32_t *indices; // Indices of the matching candidates, in order
+    int32_t *scores;   // Their fuzzy match scores (only for fuzzy matching)
+    size_t count, cap;
+    size_t scanned; // How many candidates have been checked against the query
+} btui_match_level_t;
+
+// A set of candidates to search. Their text is kept together in one arena,
+// and the matches for each query are kept along with those for the shorter
+// queries it extends, so a longer query only checks what matched before.
+typedef struct {
+    char *bytes;
+    size_t bytes_len, bytes_cap;
+    size_t *offsets; // Where each candidate starts in `bytes` (and where the last ends)
+    size_t count, offsets_cap;
+    int fuzzy; // Whether the levels hold fuzzy matches
+    btui_match_level_t *levels;
+    int num_levels, levels_cap;
+    uint32_t *best; // The best fuzzy matches, best first
+    size_t num_best;
+    // The start of a line read by btui_matcher_read() that hasn't ended yet:
+    char *partial;
+    size_t partial_len, partial_cap;
+} btui_matcher_t;
+
 // BTUI object:
 typedef struct {
     FILE *in, *out;
     int width, height;
     int size_changed;
     btui_mode_t mode;
+    // Headless backend (see btui_init_headless()): which one (0 for a real
+    // terminal), where injected input is written, and the captured output
+    int headless;
+    int inject_fd;
+    char *capture;
+    size_t capture_len, capture_cap;
+    // Retained mode: drawing goes into `back` and btui_flush() sends only the
+    // cells that differ from `front` (what is currently on the screen).
+    int buffered;
+    btui_cell_t *front, *back;
+    uint64_t *row_hashes; // Scratch space for scroll_to_match() (4 per row)
+    int buf_width, buf_height;
+    // Where drawing goes: `back` or the cells of the target surface:
+    btui_cell_t *canvas;
+    int canvas_width, canvas_height;
+    int target; // The ID of the surface being drawn into (0 for the screen)
+    int saved_cursor_x, saved_cursor_y; // The screen's drawing cursor and style
+    btui_style_t saved_pen;             // while a surface is the target
+    // Surfaces (sorted by z) are composited over `back` into `composed`, but
+    // only in the areas that have changed since the last flush:
+    btui_surface_t surfaces[BTUI_MAX_SURFACES];
+    int num_surfaces, next_surface_id;
+    btui_cell_t *composed;
+    btui_rect_t damage[BTUI_MAX_DAMAGE];
+    int num_damage;
+    // Interned grapheme clusters, with an open-addressed hash table of their
+    // indices + 1 (0 for an empty slot):
+    btui_grapheme_t *graphemes;
+    int num_graphemes, graphemes_cap;
+    uint32_t *grapheme_slots;
+    btui_width_entry_t width_cache[BTUI_WIDTH_CACHE_SIZE];
+    btui_color_entry_t color_cache[BTUI_COLOR_CACHE_SIZE];
+    int cursor_x, cursor_y;
+    int screen_x, screen_y; // Where the terminal's cursor is (-1 if unknown)
+    btui_style_t pen;
+    // The text style the terminal is currently using. If `style_known` is not
+    // set, raw escape sequences may have changed it behind BTUI's back.
+    btui_style_t term_style;
+    int style_known;
+    // Output that hasn't been written to the terminal yet: the encoded bytes
+    // in `output`, with spans of caller text (see btui_puts_span()) to be sent
+    // in between them. `output_bufsize` is how much to hold back outside of a
+    // frame (0 for BTUI_OUTPUT_BUFSIZE).
+    char *output;
+    size_t output_len, output_cap, output_bufsize;
+    btui_span_t spans[BTUI_MAX_SPANS];
+    int num_spans;
+    size_t spans_len;
+    int frame_depth; // Nesting depth of btui_begin_frame() calls
+    int caps;        // BTUI_CAP_* flags
+    // Output pacing (see btui_render_delay_ns()):
+    int64_t frame_interval_ns; // Minimum time between frames (0 for no limit)
+    int64_t last_frame_ns;     // When the last frame finished being written
+    int64_t write_ns;          // How long the last frame spent blocked in write()
+    int64_t frame_start_ns;    // When the current frame started being drawn
+    int last_frame_queued;     // Bytes in the output queue right after the last frame
+    // Ring buffer of bytes read from the terminal but not yet decoded (the
+    // indices are free-running and wrap modulo BTUI_INPUT_BUFSIZE):
+    char input[BTUI_INPUT_BUFSIZE];
+    size_t input_start, input_end;
+    int poll_input; // Whether the caller already waited for input with poll()
+    btui_parser_t parser;
+    btui_term_info_t term;
+    btui_queued_key_t queued_keys[BTUI_MAX_QUEUED_KEYS];
+    int num_queued_keys;
+    // Whether repeated mouse drag/wheel reports are merged, and how many
+    // reports went into the last key:
+    int coalesce_mouse, key_count;
+    // When the input being decoded was read, and when the last key's was:
+    int64_t input_ns, key_ns;
+    // The last mouse button released and when, for detecting double clicks:
+    int last_click;
+    int64_t last_click_ns;
+    // The text of the last bracketed paste:
+    char *paste;
+    size_t paste_len, paste_cap;
+    // Event loop state:
+    btui_watch_t watches[BTUI_MAX_WATCHES];
+    int num_watches, next_watch;
+    btui_timer_t timers[BTUI_MAX_TIMERS];
+    int num_timers, next_timer_id;
+    btui_stats_t stats;
+    // Input counters, which the input thread adds to with atomics and
+    // btui_stats() moves into `stats`:
+    struct {
+        uint64_t events, bytes_read, read_calls;
+    } input_counts;
+    // Queries (BTUI_QUERY_* flags) whose replies haven't been applied to
+    // `caps` yet. Replies may be decoded by the input thread, so `caps` is
+    // only changed on the main thread (see apply_replies()).
+    int unapplied_replies;
+    // Input thread (see btui_set_input_thread()): while it runs, only it reads
+    // and decodes terminal input (holding `input_lock` while it does), and it
+    // hands keys to the main thread through a single-producer,
+    // single-consumer ring. The indices are free-running and only accessed
+    // with atomics. It writes to `wake_pipe` after adding keys, waits on
+    // `room_pipe` (written to when a key is taken from a full queue) while
+    // the queue is full, and stops when `stop_pipe` is written to or the input
+    // ends (setting `input_ended`).
+    int input_threaded, input_ended;
+    pthread_t input_thread;
+    pthread_mutex_t input_lock;
+    pthread_cond_t input_decoded;
+    int wake_pipe[2], stop_pipe[2], room_pipe[2];
+    btui_input_event_t input_queue[BTUI_INPUT_QUEUE_SIZE];
+    size_t queue_head, queue_tail;
+    btui_input_event_t taken; // The last key the main thread took from the queue
 } btui_t;
 
 // Key Names:
@@ -234,36 +730,106 @@ typedef struct {
 } keyname_t;
 
 // Public API:
+int btui_add_timer(int64_t delay_ns, int64_t interval_ns);
+int btui_begin_frame(void);
+int btui_cancel_timer(int id);
+int btui_capabilities(void);
+const char *btui_captured_output(size_t *len);
 int btui_clear(int mode);
 void btui_disable(void);
 void btui_draw_linebox(int x, int y, int w, int h);
 void btui_draw_shadow(int x, int y, int w, int h);
+int btui_end_frame(void);
 void btui_fill_box(int x, int y, int w, int h);
 int btui_flush(void);
 void btui_force_close(void);
+int btui_format(const char *fmt, ...);
+int btui_free_matcher(int id);
+int btui_free_surface(int id);
+const char *btui_get_paste(size_t *len);
 int btui_getkey(int timeout, int *mouse_x, int *mouse_y);
+int btui_getkey_ns(int64_t timeout_ns, int *mouse_x, int *mouse_y);
 int btui_hide_cursor(void);
 void btui_init(void);
+int btui_init_headless(int width, int height, int backend);
+int btui_inject_input(const char *bytes, size_t len);
 char *btui_keyname(int key, char *buf);
+int btui_key_count(void);
+int64_t btui_key_time(void);
 int btui_keynamed(const char *name);
+int64_t btui_match(int id, const char *query, int flags, size_t limit);
+const char *btui_match_result(int id, size_t n, size_t *len);
+size_t btui_match_total(int id);
+int btui_matcher_add(int id, const char *text, size_t len);
+size_t btui_matcher_count(int id);
+const char *btui_matcher_get(int id, size_t index, size_t *len);
+int64_t btui_matcher_read(int id, int fd);
 int btui_move_cursor(int x, int y);
 int btui_move_cursor_relative(int x, int y);
-#define btui_printf(bt, ...) fprintf((bt)->out, __VA_ARGS__)
+int btui_move_surface(int id, int x, int y);
+int btui_new_matcher(void);
+int btui_new_surface(int x, int y, int w, int h, int z);
+int btui_output_queued(void);
+#define btui_printf(bt, ...) btui_format(__VA_ARGS__)
 int btui_puts(const char *s);
+int btui_puts_span(const char *s);
+int btui_query(int queries, int64_t timeout_ns);
+int64_t btui_render_delay_ns(void);
+void btui_reset_captured_output(void);
+void btui_reset_stats(void);
+int btui_resize_headless(int width, int height);
 int btui_scroll(int firstline, int lastline, int scroll_amount);
+int btui_send_queries(int queries);
 int btui_set_attributes(attr_t attrs);
 int btui_set_bg(unsigned char r, unsigned char g, unsigned char b);
 int btui_set_bg_hex(uint32_t hex);
+int btui_set_buffered(int buffered);
+int btui_set_capabilities(int caps);
 int btui_set_cursor(cursor_t cur);
 int btui_set_fg(unsigned char r, unsigned char g, unsigned char b);
 int btui_set_fg_hex(uint32_t hex);
+int btui_set_input_thread(int enabled);
+int btui_set_max_fps(double fps);
+int btui_set_mouse_coalescing(int enabled);
+size_t btui_set_output_bufsize(size_t size);
+int btui_set_style(btui_color_t fg, btui_color_t bg, attr_t attrs);
 void btui_set_mode(btui_mode_t mode);
+int btui_set_surface_visible(int id, int visible);
+int btui_set_surface_z(int id, int z);
+int btui_set_target(int id);
+int btui_should_render(void);
 int btui_show_cursor(void);
+const btui_stats_t *btui_stats(void);
 int btui_suspend(void);
+const btui_term_info_t *btui_term_info(void);
+int btui_text_width(const char *s);
+int btui_tty_fd(void);
+int btui_unwatch_fd(int fd);
+int btui_wait_event(int64_t timeout_ns, btui_event_t *event);
+int btui_watch_fd(int fd, int events);
 
 // File-local variables:
 static btui_t bt = {.in = NULL, .out = NULL, .mode = BTUI_MODE_UNINITIALIZED};
 
+// Matchers don't depend on the terminal, so they live outside of `bt`:
+static btui_matcher_t *matchers[BTUI_MAX_MATCHERS];
+
+// The RGB values of the 16 basic colors (as xterm shows them by default):
+static const uint8_t basic_rgb[16][3] = {
+    {0, 0, 0},       {205, 0, 0},   {0, 205, 0},   {205, 205, 0},
+    {0, 0, 238},     {205, 0, 205}, {0, 205, 205}, {229, 229, 229},
+    {127, 127, 127}, {255, 0, 0},   {0, 255, 0},   {255, 255, 0},
+    {92, 92, 255},   {255, 0, 255}, {0, 255, 255}, {255, 255, 255},
+};
+
+// The channel values of the 256-color palette's 6x6x6 color cube:
+static const uint8_t cube_levels[6] = {0, 95, 135, 175, 215, 255};
+
+// The nearest basic color to each RGB color, with 4 bits per channel (made
+// on first use by nearest_basic()):
+static uint8_t basic_color_cube[16 * 16 * 16];
+static int basic_color_cube_ready;
+
 // The names of keys that don't render well:
 static keyname_t key_names[] = {
     {KEY_SPACE, "Space"},
@@ -333,7 +899,7 @@ static keyname_t key_names[] = {
     {KEY_CTRL_Z, "Ctrl-z"},
     {KEY_CTRL_TILDE, "Ctrl-~"},
     {KEY_CTRL_BACKSLASH, "Ctrl-\\"},
-    {KEY_CTRL_LSQ_BRACKET, "Ctrl-]"},
+    {KEY_CTRL_LSQ_BRACKET, "Ctrl-["},
     {KEY_CTRL_RSQ_BRACKET, "Ctrl-]"},
     {KEY_CTRL_UNDERSCORE, "Ctrl-_"},
     {KEY_CTRL_SLASH, "Ctrl-/"},
@@ -346,8 +912,7 @@ static keyname_t key_names[] = {
     {KEY_CTRL_5, "Ctrl-5"},
     {KEY_CTRL_6, "Ctrl-6"},
     {KEY_CTRL_7, "Ctrl-7"},
-    {KEY_CTRL_5, "Ctrl-8"},
-    {KEY_CTRL_6, "Ctrl-9"},
+    {KEY_CTRL_8, "Ctrl-8"},
     {KEY_F1, "F1"},
     {KEY_F2, "F2"},
     {KEY_F3, "F3"},
@@ -361,36 +926,132 @@ static keyname_t key_names[] = {
     {KEY_F11, "F11"},
     {KEY_F12, "F12"},
     {RESIZE_EVENT, "Resize"},
+    {PASTE_EVENT, "Paste"},
 };
 
+// Lookup tables built from key_names[] the first time they're needed: the
+// first name listed for each key, and an open-addressed hash table of names.
+#define KEY_NAME_SLOTS 256
+static const char *names_by_key[PASTE_EVENT + 1];
+static const keyname_t *keys_by_name[KEY_NAME_SLOTS];
+
 // This is the default termios for normal terminal behavior and the
 // text-user-interface one:
 static struct termios normal_termios, tui_termios;
 
+// A pipe that the SIGWINCH handler writes to, so that resizes can wake up
+// poll() without doing any work inside the signal handler:
+static int resize_pipe[2] = {-1, -1};
+
 // File-local functions:
 
 /*
- * Read and return the next character from the file descriptor, or -1 if no
- * character is available. (Helper method for nextnum() and btui_getkey())
+ * Return the current time in nanoseconds on the monotonic clock.
  */
-static inline int nextchar(int fd) {
-    char c;
-    return read(fd, &c, 1) == 1 ? c : -1;
+static inline int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
 /*
- * Given a file descriptor, parse an integer value, updating *c to hold the
- * next character after the integer value. Return the parsed integer value.
- * (Helper method for btui_getkey())
+ * Read as many bytes as are available (up to the free space in the input
+ * buffer) from the file descriptor with a single syscall. Returns the number
+ * of bytes read, or -1 on failure/timeout.
  */
-static inline int nextnum(int fd, int *c) {
-    int n;
-    *c = nextchar(fd);
-    for (n = 0; '0' <= *c && *c <= '9'; *c = nextchar(fd))
-        n = 10 * n + (*c - '0');
+static ssize_t fill_input(int fd) {
+    size_t used = bt.input_end - bt.input_start;
+    if (used == BTUI_INPUT_BUFSIZE) return 0;
+    size_t end = bt.input_end & (BTUI_INPUT_BUFSIZE - 1);
+    size_t start = bt.input_start & (BTUI_INPUT_BUFSIZE - 1);
+    struct iovec iov[2];
+    int iovcnt;
+    if (end >= start) {
+        iov[0] = (struct iovec){&bt.input[end], BTUI_INPUT_BUFSIZE - end};
+        iov[1] = (struct iovec){&bt.input[0], start};
+        iovcnt = start > 0 ? 2 : 1;
+    } else {
+        iov[0] = (struct iovec){&bt.input[end], start - end};
+        iovcnt = 1;
+    }
+    if (used == 0) { // Empty buffer: use a single contiguous read
+        bt.input_start = bt.input_end = 0;
+        iov[0] = (struct iovec){&bt.input[0], BTUI_INPUT_BUFSIZE};
+        iovcnt = 1;
+    }
+    ssize_t n = iovcnt == 1 ? read(fd, iov[0].iov_base, iov[0].iov_len) : readv(fd, iov, iovcnt);
+    __atomic_fetch_add(&bt.input_counts.read_calls, 1, __ATOMIC_RELAXED);
+    if (n <= 0) return -1;
+    bt.input_ns = now_ns();
+    __atomic_fetch_add(&bt.input_counts.bytes_read, (uint64_t)n, __ATOMIC_RELAXED);
+    bt.input_end += (size_t)n;
     return n;
 }
 
+/*
+ * Wait until the file descriptor has input to read, or until the timeout (in
+ * nanoseconds, negative to wait forever) elapses. If `wake_on_resize` is set,
+ * a terminal resize will also end the wait. Returns 1 if input is ready, 0 on
+ * timeout or resize, or -1 on error (including being interrupted by a signal).
+ */
+static int wait_input(int fd, int64_t timeout_ns, int wake_on_resize) {
+    struct pollfd pfds[2] = {{.fd = fd, .events = POLLIN}, {.fd = resize_pipe[0], .events = POLLIN}};
+    nfds_t nfds = (wake_on_resize && resize_pipe[0] >= 0) ? 2 : 1;
+#if (defined(__linux__) && defined(_GNU_SOURCE)) || defined(__FreeBSD__) || defined(__OpenBSD__)
+    struct timespec ts = {.tv_sec = timeout_ns / 1000000000, .tv_nsec = timeout_ns % 1000000000};
+    int ready = ppoll(pfds, nfds, timeout_ns < 0 ? NULL : &ts, NULL);
+#else
+    int ready = poll(pfds, nfds, timeout_ns < 0 ? -1 : (int)((timeout_ns + 999999) / 1000000));
+#endif
+    if (ready < 0) return -1;
+    return (pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) ? 1 : 0;
+}
+
+/*
+ * Return whether there is input that hasn't been returned as keys yet.
+ */
+static inline int has_input(void) {
+    if (bt.input_threaded) {
+        if (__atomic_load_n(&bt.queue_tail, __ATOMIC_ACQUIRE) != bt.queue_head) return 1;
+        if (!__atomic_load_n(&bt.input_ended, __ATOMIC_ACQUIRE)) return 0;
+    }
+    return bt.num_queued_keys > 0 || bt.input_start != bt.input_end;
+}
+
+/*
+ * Return whether the input thread is decoding the terminal's input, so the
+ * main thread must leave the input buffer and parser alone.
+ */
+static inline int thread_owns_input(void) {
+    return bt.input_threaded && !__atomic_load_n(&bt.input_ended, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Return the file descriptor to wait on for keys: the terminal, or the input
+ * thread's wakeup pipe.
+ */
+static inline int key_fd(void) { return thread_owns_input() ? bt.wake_pipe[0] : fileno(bt.in); }
+
+/*
+ * Set the terminal's termios attributes (which a headless memory backend
+ * doesn't have, so that always succeeds).
+ */
+static int set_termios(const struct termios *termios) {
+    if (bt.headless == BTUI_HEADLESS_MEMORY) return 0;
+    return tcsetattr(fileno(bt.out), TCSANOW, termios);
+}
+
+/*
+ * Make sure the terminal is in VMIN=1/VTIME=0 mode, so that reads return
+ * whatever input is available (and poll() is used for waiting).
+ */
+static int use_poll_termios(void) {
+    if (tui_termios.c_cc[VMIN] == 1 && tui_termios.c_cc[VTIME] == 0) return 0;
+    tui_termios.c_cc[VMIN] = 1;
+    tui_termios.c_cc[VTIME] = 0;
+    return set_termios(&tui_termios);
+}
+
 /*
  * Reset the terminal back to its normal state and raise the given signal.
  * (This is used as a signal handler that gracefully exits without gunking up
@@ -398,22 +1059,34 @@ static inline int nextnum(int fd, int *c) {
  */
 static void btui_disable_and_raise(int sig) {
     btui_mode_t mode = bt.mode;
+    int input_threaded = bt.input_threaded;
     btui_disable();
     raise(sig);
     // This code will only ever be run if sig is SIGTSTP/SIGSTOP, otherwise,
     // raise() won't return:
     btui_init();
+    if (input_threaded) btui_set_input_thread(1);
     struct sigaction sa = {.sa_handler = &btui_disable_and_raise,
                            .sa_flags = (int)(SA_NODEFER | SA_RESETHAND)};
     sigaction(sig, &sa, NULL);
 }
 
 /*
- * A signal handler used to update BTUI's internal window size values when a
- * SIGWINCH event occurs.
+ * A signal handler for SIGWINCH, which wakes up anything waiting on the resize
+ * pipe. (Only async-signal-safe work is done here)
  */
-static void update_term_size(int sig) {
+static void notify_resize(int sig) {
     (void)sig;
+    int saved_errno = errno;
+    if (resize_pipe[1] >= 0) (void)!write(resize_pipe[1], "", 1);
+    errno = saved_errno;
+}
+
+/*
+ * Update BTUI's internal window size values.
+ */
+static void update_term_size(void) {
+    if (bt.headless == BTUI_HEADLESS_MEMORY) return; // Only btui_resize_headless() changes the size
     struct winsize winsize;
     if (ioctl(fileno(bt.in), TIOCGWINSZ, &winsize) == -1) {
         btui_disable();
@@ -423,221 +1096,2580 @@ static void update_term_size(int sig) {
         bt.width = winsize.ws_col;
         bt.height = winsize.ws_row;
         bt.size_changed = 1;
+        // The terminal may have moved the cursor while reflowing text:
+        bt.screen_x = bt.screen_y = -1;
     }
 }
 
-// Public API functions:
-
 /*
- * Clear all or part of the screen. `mode` should be one of:
- *   BTUI_CLEAR_(BELOW|ABOVE|SCREEN|RIGHT|LEFT|LINE)
+ * Handle any pending resize signals and return whether the terminal size has
+ * changed since the last RESIZE_EVENT. A burst of resize signals (e.g. from
+ * dragging the window's edge) is merged by waiting until the signals stop for
+ * BTUI_RESIZE_SETTLE milliseconds.
  */
-int btui_clear(int mode) {
-    switch (mode) {
-    case BTUI_CLEAR_BELOW: return fputs("\033[J", bt.out);
-    case BTUI_CLEAR_ABOVE: return fputs("\033[1J", bt.out);
-    case BTUI_CLEAR_SCREEN: return fputs("\033[2J", bt.out);
-    case BTUI_CLEAR_RIGHT: return fputs("\033[K", bt.out);
-    case BTUI_CLEAR_LEFT: return fputs("\033[1K", bt.out);
-    case BTUI_CLEAR_LINE: return fputs("\033[2K", bt.out);
-    default: return -1;
+static int check_resize(void) {
+    if (resize_pipe[0] < 0) return bt.size_changed;
+    char buf[64];
+    if (read(resize_pipe[0], buf, sizeof(buf)) > 0) {
+        while (read(resize_pipe[0], buf, sizeof(buf)) > 0)
+            continue;
+        struct pollfd pfd = {.fd = resize_pipe[0], .events = POLLIN};
+        int64_t give_up = now_ns() + (int64_t)5 * BTUI_RESIZE_SETTLE * 1000000;
+        while (now_ns() < give_up) {
+            int ready = poll(&pfd, 1, BTUI_RESIZE_SETTLE);
+            if (ready == 0 || (ready < 0 && errno != EINTR)) break;
+            while (read(resize_pipe[0], buf, sizeof(buf)) > 0)
+                continue;
+        }
+        update_term_size();
     }
+    return bt.size_changed;
 }
 
 /*
- * Disable TUI mode (return to the normal terminal with the normal terminal
- * input handling).
+ * Append bytes to the captured output of a headless backend.
  */
-void btui_disable(void) {
-    if (!bt.out) return;
-    tcsetattr(fileno(bt.out), TCSANOW, &normal_termios);
-    btui_set_cursor(CURSOR_DEFAULT);
-    btui_set_mode(BTUI_MODE_UNINITIALIZED);
-    fflush(bt.out);
-    fclose(bt.in);
-    fclose(bt.out);
-    memset(&bt, 0, sizeof(btui_t));
+static void capture_output(const char *bytes, size_t len) {
+    if (bt.capture_len + len > bt.capture_cap) {
+        size_t cap = bt.capture_cap ? 2 * bt.capture_cap : 65536;
+        while (cap < bt.capture_len + len)
+            cap *= 2;
+        char *capture = realloc(bt.capture, cap);
+        if (!capture) err(1, "Couldn't allocate memory for captured output");
+        bt.capture = capture;
+        bt.capture_cap = cap;
+    }
+    memcpy(bt.capture + bt.capture_len, bytes, len);
+    bt.capture_len += len;
 }
 
 /*
- * Draw a box using the special box-drawing characters at the given x,y
- * position with the given width,height.
+ * Capture whatever output can be read from the master side of a headless
+ * pty, waiting up to `wait_ms` milliseconds for more after it runs dry.
  */
-void btui_draw_linebox(int x, int y, int w, int h) {
-    btui_move_cursor(x - 1, y - 1);
-    // Top row
-    fputs("\033(0l", bt.out);
-    for (int i = 0; i < w; i++)
-        fputc('q', bt.out);
-    fputc('k', bt.out);
-    // Side walls
-    for (int i = 0; i < h; i++) {
-        btui_move_cursor(x - 1, y + i);
-        fputc('x', bt.out);
-        btui_move_cursor(x + w, y + i);
-        fputc('x', bt.out);
+static void capture_pty_output(int wait_ms) {
+    char buf[4096];
+    for (;;) {
+        ssize_t n = read(bt.inject_fd, buf, sizeof(buf));
+        if (n > 0) {
+            capture_output(buf, (size_t)n);
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        struct pollfd pfd = {.fd = bt.inject_fd, .events = POLLIN};
+        if (wait_ms <= 0 || poll(&pfd, 1, wait_ms) <= 0) break;
     }
-    // Bottom row
-    btui_move_cursor(x - 1, y + h);
-    fputc('m', bt.out);
-    for (int i = 0; i < w; i++)
-        fputc('q', bt.out);
-    fputs("j\033(B", bt.out);
 }
 
 /*
- * Draw a shadow to the bottom right of the given box coordinates.
+ * Close the parts of a headless backend that aren't `bt.in` or `bt.out`.
  */
-void btui_draw_shadow(int x, int y, int w, int h) {
-    fputs("\033(0", bt.out);
-    for (int i = 0; i < h - 1; i++) {
-        btui_move_cursor(x + w, y + 1 + i);
-        fputc('a', bt.out);
+static void close_headless(void) {
+    if (bt.headless) close(bt.inject_fd);
+    free(bt.capture);
+}
+
+/*
+ * Stop the input thread (if `join` is set, waiting for it to finish) and keep
+ * any keys it decoded that haven't been taken yet, so they're read next.
+ */
+static void stop_input_thread(int join) {
+    if (!bt.input_threaded) return;
+    if (join) {
+        (void)!write(bt.stop_pipe[1], "", 1);
+        pthread_join(bt.input_thread, NULL);
     }
-    btui_move_cursor(x + 1, y + h);
-    for (int i = 0; i < w; i++) {
-        fputc('a', bt.out);
+    for (size_t i = bt.queue_head; i != bt.queue_tail; i++) {
+        btui_input_event_t *event = &bt.input_queue[i & (BTUI_INPUT_QUEUE_SIZE - 1)];
+        if (join && bt.num_queued_keys < BTUI_MAX_QUEUED_KEYS) {
+            // The paste's text goes along with it:
+            bt.queued_keys[bt.num_queued_keys++] = (btui_queued_key_t){
+                .key = event->key, .mouse_x = event->mouse_x, .mouse_y = event->mouse_y,
+                .count = event->count, .time_ns = event->time_ns, .paste = event->paste,
+                .paste_len = event->paste_len};
+        } else {
+            free(event->paste);
+        }
     }
-    fputs("\033(B", bt.out);
+    free(bt.taken.paste);
+    bt.taken = (btui_input_event_t){0};
+    bt.queue_head = bt.queue_tail = 0;
+    for (int i = 0; i < 2; i++) {
+        close(bt.wake_pipe[i]);
+        close(bt.stop_pipe[i]);
+        close(bt.room_pipe[i]);
+    }
+    pthread_mutex_destroy(&bt.input_lock);
+    pthread_cond_destroy(&bt.input_decoded);
+    bt.input_threaded = bt.input_ended = 0;
 }
 
 /*
- * Enable TUI mode for this terminal and return a pointer to the BTUI struct
- * that should be passed to future API calls.
+ * Write all buffered output to the terminal: the output buffer and the spans
+ * of caller text between its pieces, in as few writev() calls as the terminal
+ * takes them. Returns 0 on success, or EOF on failure (in which case the
+ * buffered output is discarded).
  */
-void btui_init(void) {
-    bt.in = fopen("/dev/tty", "r");
-    if (!bt.in) err(1, "Couldn't open /dev/tty for reading");
-    bt.out = fopen("/dev/tty", "w");
-    if (!bt.out) err(1, "Couldn't open /dev/tty for writing");
-
-    if (tcgetattr(fileno(bt.in), &normal_termios)) err(1, "Couldn't get termios attributes");
-
-    memcpy(&tui_termios, &normal_termios, sizeof(tui_termios));
-    cfmakeraw(&tui_termios);
+static int output_flush(void) {
+    if (bt.output_len == 0 && bt.num_spans == 0) return 0;
+    if (!bt.out) return EOF;
+    int fd = fileno(bt.out);
+    int64_t start = now_ns();
+    bt.stats.flushes += 1;
+    struct iovec iov[2 * BTUI_MAX_SPANS + 1];
+    int num_iov = 0;
+    size_t offset = 0, total = 0;
+    for (int i = 0; i <= bt.num_spans; i++) {
+        size_t end = i < bt.num_spans ? bt.spans[i].offset : bt.output_len;
+        if (end > offset) iov[num_iov++] = (struct iovec){bt.output + offset, end - offset};
+        offset = end;
+        if (i < bt.num_spans) iov[num_iov++] = (struct iovec){(char *)bt.spans[i].text, bt.spans[i].len};
+    }
+    for (int i = 0; i < num_iov; i++) {
+        total += iov[i].iov_len;
+        // The memory backend's output also goes to /dev/null, so the system
+        // calls are the same as with a real terminal:
+        if (bt.headless == BTUI_HEADLESS_MEMORY) capture_output(iov[i].iov_base, iov[i].iov_len);
+    }
+    size_t written = 0;
+    for (int first = 0; first < num_iov;) {
+        int count = num_iov - first < IOV_MAX ? num_iov - first : IOV_MAX;
+        // Nothing else reads a headless pty, so its output is captured as it
+        // goes (before filling up the pty's buffer and blocking):
+        size_t full_len = iov[first].iov_len;
+        if (bt.headless == BTUI_HEADLESS_PTY) {
+            count = 1;
+            if (full_len > 1024) iov[first].iov_len = 1024;
+        }
+        ssize_t n = writev(fd, &iov[first], count);
+        iov[first].iov_len = full_len;
+        bt.stats.write_calls += 1;
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) {
+            // The terminal is non-blocking and full: wait for room instead of spinning
+            struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+            if (poll(&pfd, 1, -1) < 0 && errno != EINTR) break;
+            continue;
+        }
+        if (n <= 0) break;
+        written += (size_t)n;
+        bt.stats.bytes_written += (uint64_t)n;
+        // Skip past what was written, which may end partway through a piece:
+        for (size_t left = (size_t)n; left > 0;) {
+            if (left < iov[first].iov_len) {
+                iov[first].iov_base = (char *)iov[first].iov_base + left;
+                iov[first].iov_len -= left;
+                break;
+            }
+            left -= iov[first++].iov_len;
+        }
+        if (bt.headless == BTUI_HEADLESS_PTY) capture_pty_output(0);
+    }
+    int ret = written == total ? 0 : EOF;
+    bt.output_len = 0;
+    bt.num_spans = 0;
+    bt.spans_len = 0;
+    bt.write_ns = now_ns() - start;
+    return ret;
+}
 
-    bt.mode = BTUI_MODE_DISABLED;
-    atexit(btui_disable);
+/*
+ * Note that a frame has been written, for pacing the next one and for the
+ * stats. `render_end` is when the frame's output was ready to send. (Helper
+ * method for btui_end_frame() and btui_flush())
+ */
+static void finish_frame(int64_t render_end) {
+    bt.last_frame_ns = now_ns();
+    bt.last_frame_queued = btui_output_queued();
+    bt.stats.frames += 1;
+    bt.stats.render_ns = render_end - bt.frame_start_ns;
+    bt.stats.flush_ns = bt.write_ns;
+}
 
-    struct sigaction sa_winch = {.sa_handler = &update_term_size};
-    sigaction(SIGWINCH, &sa_winch, NULL);
-    int signals[] = {SIGTERM, SIGINT,  SIGXCPU, SIGXFSZ, SIGVTALRM,
-                     SIGPROF, SIGSEGV, SIGTSTP, SIGPIPE};
-    struct sigaction sa = {.sa_handler = &btui_disable_and_raise,
-                           .sa_flags = (int)(SA_NODEFER | SA_RESETHAND)};
-    for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++)
-        sigaction(signals[i], &sa, NULL);
+// How much output to hold back outside of a frame before writing it:
+static inline size_t output_bufsize(void) {
+    return bt.output_bufsize ? bt.output_bufsize : BTUI_OUTPUT_BUFSIZE;
+}
 
-    update_term_size(SIGWINCH);
-    bt.size_changed = 0;
+/*
+ * Make room for at least `n` more bytes of output and return a pointer to
+ * where they should be written. (output_commit() finishes the write)
+ */
+static inline char *output_reserve(size_t n) {
+    if (bt.output_len + n > bt.output_cap) {
+        size_t cap = bt.output_cap ? 2 * bt.output_cap : 4096;
+        while (cap < bt.output_len + n)
+            cap *= 2;
+        char *output = realloc(bt.output, cap);
+        if (!output) err(1, "Couldn't allocate memory for terminal output");
+        bt.output = output;
+        bt.output_cap = cap;
+    }
+    return bt.output + bt.output_len;
 }
 
 /*
- * Set the display mode of BTUI
+ * Mark the bytes from output_reserve() up to `end` as written and return how
+ * many bytes that was.
  */
-void btui_set_mode(btui_mode_t mode) {
-    if (mode == bt.mode) return;
+static inline int output_commit(char *end) {
+    int n = (int)(end - (bt.output + bt.output_len));
+    bt.output_len = (size_t)(end - bt.output);
+    if (bt.frame_depth == 0 && bt.output_len + bt.spans_len >= output_bufsize()) output_flush();
+    return n;
+}
 
-    if (bt.mode == BTUI_MODE_UNINITIALIZED) btui_init();
+static inline int output_write(const char *str, size_t len) {
+    char *buf = output_reserve(len);
+    memcpy(buf, str, len);
+    return output_commit(buf + len);
+}
 
-    if (mode == BTUI_MODE_NORMAL || mode == BTUI_MODE_TUI) {
-        if (tcsetattr(fileno(bt.out), TCSANOW, &tui_termios)) errx(1, "Failed to set attr");
-    }
+static inline int output_puts(const char *str) { return output_write(str, strlen(str)); }
 
-    switch (mode) {
-    case BTUI_MODE_UNINITIALIZED:
-    case BTUI_MODE_NORMAL:
-    case BTUI_MODE_DISABLED:
-        if (bt.mode == BTUI_MODE_TUI) fputs(T_OFF(T_ALT_SCREEN), bt.out);
-        fputs(T_ON(T_SHOW_CURSOR ";" T_WRAP)
-                  T_OFF(T_MOUSE_XY ";" T_MOUSE_CELL ";" T_MOUSE_SGR) "\033[0m",
-              bt.out);
-        break;
-    case BTUI_MODE_TUI:
-        fputs(T_OFF(T_SHOW_CURSOR ";" T_WRAP)
-                  T_ON(T_ALT_SCREEN ";" T_MOUSE_XY ";" T_MOUSE_CELL ";" T_MOUSE_SGR),
-              bt.out);
-        break;
-    default: break;
-    }
-    fflush(bt.out);
-    bt.mode = mode;
+static inline int output_putc(char c) {
+    char *buf = output_reserve(1);
+    *buf = c;
+    return output_commit(buf + 1);
+}
+
+// Output escape sequences that aren't counted as any other kind in the stats:
+static inline int output_control(const char *str) {
+    bt.stats.escapes[BTUI_ESCAPE_OTHER] += 1;
+    return output_puts(str);
 }
 
+// Decimal digits for all two-digit numbers, and for all byte values:
+static const char digit_pairs[200] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+static const struct {
+    char len, digits[3];
+} byte_digits[256] = {
+    {1, "0"}, {1, "1"}, {1, "2"}, {1, "3"}, {1, "4"}, {1, "5"}, {1, "6"}, {1, "7"}, {1, "8"},
+    {1, "9"}, {2, "10"}, {2, "11"}, {2, "12"}, {2, "13"}, {2, "14"}, {2, "15"}, {2, "16"},
+    {2, "17"}, {2, "18"}, {2, "19"}, {2, "20"}, {2, "21"}, {2, "22"}, {2, "23"}, {2, "24"},
+    {2, "25"}, {2, "26"}, {2, "27"}, {2, "28"}, {2, "29"}, {2, "30"}, {2, "31"}, {2, "32"},
+    {2, "33"}, {2, "34"}, {2, "35"}, {2, "36"}, {2, "37"}, {2, "38"}, {2, "39"}, {2, "40"},
+    {2, "41"}, {2, "42"}, {2, "43"}, {2, "44"}, {2, "45"}, {2, "46"}, {2, "47"}, {2, "48"},
+    {2, "49"}, {2, "50"}, {2, "51"}, {2, "52"}, {2, "53"}, {2, "54"}, {2, "55"}, {2, "56"},
+    {2, "57"}, {2, "58"}, {2, "59"}, {2, "60"}, {2, "61"}, {2, "62"}, {2, "63"}, {2, "64"},
+    {2, "65"}, {2, "66"}, {2, "67"}, {2, "68"}, {2, "69"}, {2, "70"}, {2, "71"}, {2, "72"},
+    {2, "73"}, {2, "74"}, {2, "75"}, {2, "76"}, {2, "77"}, {2, "78"}, {2, "79"}, {2, "80"},
+    {2, "81"}, {2, "82"}, {2, "83"}, {2, "84"}, {2, "85"}, {2, "86"}, {2, "87"}, {2, "88"},
+    {2, "89"}, {2, "90"}, {2, "91"}, {2, "92"}, {2, "93"}, {2, "94"}, {2, "95"}, {2, "96"},
+    {2, "97"}, {2, "98"}, {2, "99"}, {3, "100"}, {3, "101"}, {3, "102"}, {3, "103"}, {3, "104"},
+    {3, "105"}, {3, "106"}, {3, "107"}, {3, "108"}, {3, "109"}, {3, "110"}, {3, "111"}, {3, "112"},
+    {3, "113"}, {3, "114"}, {3, "115"}, {3, "116"}, {3, "117"}, {3, "118"}, {3, "119"}, {3, "120"},
+    {3, "121"}, {3, "122"}, {3, "123"}, {3, "124"}, {3, "125"}, {3, "126"}, {3, "127"}, {3, "128"},
+    {3, "129"}, {3, "130"}, {3, "131"}, {3, "132"}, {3, "133"}, {3, "134"}, {3, "135"}, {3, "136"},
+    {3, "137"}, {3, "138"}, {3, "139"}, {3, "140"}, {3, "141"}, {3, "142"}, {3, "143"}, {3, "144"},
+    {3, "145"}, {3, "146"}, {3, "147"}, {3, "148"}, {3, "149"}, {3, "150"}, {3, "151"}, {3, "152"},
+    {3, "153"}, {3, "154"}, {3, "155"}, {3, "156"}, {3, "157"}, {3, "158"}, {3, "159"}, {3, "160"},
+    {3, "161"}, {3, "162"}, {3, "163"}, {3, "164"}, {3, "165"}, {3, "166"}, {3, "167"}, {3, "168"},
+    {3, "169"}, {3, "170"}, {3, "171"}, {3, "172"}, {3, "173"}, {3, "174"}, {3, "175"}, {3, "176"},
+    {3, "177"}, {3, "178"}, {3, "179"}, {3, "180"}, {3, "181"}, {3, "182"}, {3, "183"}, {3, "184"},
+    {3, "185"}, {3, "186"}, {3, "187"}, {3, "188"}, {3, "189"}, {3, "190"}, {3, "191"}, {3, "192"},
+    {3, "193"}, {3, "194"}, {3, "195"}, {3, "196"}, {3, "197"}, {3, "198"}, {3, "199"}, {3, "200"},
+    {3, "201"}, {3, "202"}, {3, "203"}, {3, "204"}, {3, "205"}, {3, "206"}, {3, "207"}, {3, "208"},
+    {3, "209"}, {3, "210"}, {3, "211"}, {3, "212"}, {3, "213"}, {3, "214"}, {3, "215"}, {3, "216"},
+    {3, "217"}, {3, "218"}, {3, "219"}, {3, "220"}, {3, "221"}, {3, "222"}, {3, "223"}, {3, "224"},
+    {3, "225"}, {3, "226"}, {3, "227"}, {3, "228"}, {3, "229"}, {3, "230"}, {3, "231"}, {3, "232"},
+    {3, "233"}, {3, "234"}, {3, "235"}, {3, "236"}, {3, "237"}, {3, "238"}, {3, "239"}, {3, "240"},
+    {3, "241"}, {3, "242"}, {3, "243"}, {3, "244"}, {3, "245"}, {3, "246"}, {3, "247"}, {3, "248"},
+    {3, "249"}, {3, "250"}, {3, "251"}, {3, "252"}, {3, "253"}, {3, "254"}, {3, "255"},
+};
+
 /*
- * Fill the given rectangular area (x,y coordinates and width,height) with
- * spaces.
+ * Write a non-negative integer in decimal into `buf` and return a pointer to
+ * the end.
  */
-void btui_fill_box(int x, int y, int w, int h) {
-    int left = x, bottom = y + h;
-    for (; y < bottom; y++) {
-        x = left;
-        btui_move_cursor(x, y);
-        for (; x < left + w; x++) {
-            fputc(' ', bt.out);
-        }
+static inline char *put_int(char *buf, int n) {
+    if (n < 0) n = 0;
+    if (n < 256) {
+        memcpy(buf, byte_digits[n].digits, 3);
+        return buf + byte_digits[n].len;
     }
+    char digits[12], *p = &digits[sizeof(digits)];
+    while (n >= 100) {
+        p -= 2;
+        memcpy(p, &digit_pairs[2 * (n % 100)], 2);
+        n /= 100;
+    }
+    if (n >= 10) {
+        p -= 2;
+        memcpy(p, &digit_pairs[2 * n], 2);
+    } else {
+        *(--p) = (char)('0' + n);
+    }
+    size_t len = (size_t)(&digits[sizeof(digits)] - p);
+    memcpy(buf, p, len);
+    return buf + len;
 }
 
 /*
- * Flush BTUI's output.
+ * Write a control sequence with a single numeric parameter (e.g. "\033[5A")
+ * into `buf` and return a pointer to the end.
  */
-int btui_flush(void) { return fflush(bt.out); }
+static inline char *put_csi(char *buf, int n, char final) {
+    *(buf++) = '\033';
+    *(buf++) = '[';
+    buf = put_int(buf, n);
+    *(buf++) = final;
+    return buf;
+}
 
 /*
- * Close BTUI files and prevent cleaning up (useful for fork/exec)
+ * Write the escape sequence to move the cursor to (x,y) into `buf` and return
+ * a pointer to the end.
  */
-void btui_force_close(void) {
-    if (!bt.out) return;
-    fclose(bt.in);
-    fclose(bt.out);
-    memset(&bt, 0, sizeof(btui_t));
+static inline char *put_cup(char *buf, int x, int y) {
+    *(buf++) = '\033';
+    *(buf++) = '[';
+    buf = put_int(buf, y + 1);
+    *(buf++) = ';';
+    buf = put_int(buf, x + 1);
+    *(buf++) = 'H';
+    return buf;
 }
 
 /*
- * Get one key of input from the given file. Returns -1 on failure.
- * If mouse_x or mouse_y are non-null and a mouse event occurs, they will be
- * set to the position of the mouse (0-indexed).
+ * Close the resize pipe and stop listening for SIGWINCH.
  */
-int btui_getkey(int timeout, int *mouse_x, int *mouse_y) {
-    int new_vmin = timeout < 0 ? 1 : 0, new_vtime = timeout < 0 ? 0 : timeout;
-    if (new_vmin != tui_termios.c_cc[VMIN] || new_vtime != tui_termios.c_cc[VTIME]) {
-        tui_termios.c_cc[VMIN] = new_vmin;
-        tui_termios.c_cc[VTIME] = new_vtime;
-        if (tcsetattr(fileno(bt.out), TCSANOW, &tui_termios) == -1) return -1;
+static void close_resize_pipe(void) {
+    signal(SIGWINCH, SIG_DFL);
+    for (int i = 0; i < 2; i++) {
+        if (resize_pipe[i] >= 0) close(resize_pipe[i]);
+        resize_pipe[i] = -1;
     }
+}
 
-    if (mouse_x) *mouse_x = -1;
-    if (mouse_y) *mouse_y = -1;
-    int fd = fileno(bt.in);
-    int numcode = 0, modifiers = 0;
-    int c = nextchar(fd);
-    if (c == '\x1b') {
-        goto escape;
-    } else if (c == -1 && bt.size_changed) {
-        bt.size_changed = 0;
-        return RESIZE_EVENT;
-    }
+static const btui_cell_t blank_cell = {.style = {0, BTUI_COLOR_DEFAULT, BTUI_COLOR_DEFAULT},
+                                        .ch = ' '};
 
-    return c;
+static inline int style_eq(btui_style_t a, btui_style_t b) {
+    return a.attrs == b.attrs && a.fg == b.fg && a.bg == b.bg;
+}
 
-escape:
-    c = nextchar(fd);
-    // Actual escape key:
-    if (c < 0) return KEY_ESC;
+static inline int cell_eq(btui_cell_t a, btui_cell_t b) {
+    return a.ch == b.ch && style_eq(a.style, b.style);
+}
+
+/*
+ * Decode one UTF-8 codepoint from *s and advance *s past it. Invalid bytes
+ * decode as U+FFFD.
+ */
+static inline uint32_t utf8_decode(const char **s) {
+    const unsigned char *p = (const unsigned char *)*s;
+    uint32_t cp;
+    int len;
+    if (p[0] < 0x80) cp = p[0], len = 1;
+    else if ((p[0] & 0xE0) == 0xC0) cp = p[0] & 0x1F, len = 2;
+    else if ((p[0] & 0xF0) == 0xE0) cp = p[0] & 0x0F, len = 3;
+    else if ((p[0] & 0xF8) == 0xF0) cp = p[0] & 0x07, len = 4;
+    else {
+        *s += 1;
+        return 0xFFFD;
+    }
+    for (int i = 1; i < len; i++) {
+        if ((p[i] & 0xC0) != 0x80) {
+            *s += i;
+            return 0xFFFD;
+        }
+        cp = (cp << 6) | (p[i] & 0x3F);
+    }
+    *s += len;
+    return cp;
+}
+
+/*
+ * Encode a codepoint as UTF-8 into `buf` and return the number of bytes.
+ */
+static inline int utf8_encode(uint32_t cp, char *buf) {
+    if (cp < 0x80) {
+        buf[0] = (char)cp;
+        return 1;
+    } else if (cp < 0x800) {
+        buf[0] = (char)(0xC0 | (cp >> 6));
+        buf[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    } else if (cp < 0x10000) {
+        buf[0] = (char)(0xE0 | (cp >> 12));
+        buf[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        buf[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    } else {
+        buf[0] = (char)(0xF0 | (cp >> 18));
+        buf[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+        buf[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        buf[3] = (char)(0x80 | (cp & 0x3F));
+        return 4;
+    }
+}
+
+// Ranges of codepoints that aren't one cell wide (sorted, for binary search):
+static const struct {
+    uint32_t first, last;
+    int width;
+} wide_ranges[] = {
+    {0x0300, 0x036F, 0},   {0x0483, 0x0489, 0},   {0x0591, 0x05BD, 0},   {0x05BF, 0x05C7, 0},
+    {0x0610, 0x061A, 0},   {0x064B, 0x065F, 0},   {0x0670, 0x0670, 0},   {0x06D6, 0x06ED, 0},
+    {0x0E31, 0x0E31, 0},   {0x0E34, 0x0E3A, 0},   {0x0E47, 0x0E4E, 0},   {0x1100, 0x115F, 2},
+    {0x1AB0, 0x1AFF, 0},   {0x1DC0, 0x1DFF, 0},   {0x200B, 0x200F, 0},   {0x202A, 0x202E, 0},
+    {0x2060, 0x2064, 0},   {0x20D0, 0x20FF, 0},   {0x231A, 0x231B, 2},   {0x2329, 0x232A, 2},
+    {0x23E9, 0x23EC, 2},   {0x23F0, 0x23F0, 2},   {0x23F3, 0x23F3, 2},   {0x25FD, 0x25FE, 2},
+    {0x2614, 0x2615, 2},   {0x2648, 0x2653, 2},   {0x267F, 0x267F, 2},   {0x2693, 0x2693, 2},
+    {0x26A1, 0x26A1, 2},   {0x26AA, 0x26AB, 2},   {0x26BD, 0x26BE, 2},   {0x26C4, 0x26C5, 2},
+    {0x26CE, 0x26CE, 2},   {0x26D4, 0x26D4, 2},   {0x26EA, 0x26EA, 2},   {0x26F2, 0x26F3, 2},
+    {0x26F5, 0x26F5, 2},   {0x26FA, 0x26FA, 2},   {0x26FD, 0x26FD, 2},   {0x2705, 0x2705, 2},
+    {0x270A, 0x270B, 2},   {0x2728, 0x2728, 2},   {0x274C, 0x274C, 2},   {0x274E, 0x274E, 2},
+    {0x2753, 0x2755, 2},   {0x2757, 0x2757, 2},   {0x2795, 0x2797, 2},   {0x27B0, 0x27B0, 2},
+    {0x27BF, 0x27BF, 2},   {0x2B1B, 0x2B1C, 2},   {0x2B50, 0x2B50, 2},   {0x2B55, 0x2B55, 2},
+    {0x2E80, 0x303E, 2},   {0x3041, 0x33FF, 2},   {0x3400, 0x4DBF, 2},   {0x4E00, 0x9FFF, 2},
+    {0xA000, 0xA4CF, 2},   {0xA960, 0xA97F, 2},   {0xAC00, 0xD7A3, 2},   {0xF900, 0xFAFF, 2},
+    {0xFE00, 0xFE0F, 0},   {0xFE10, 0xFE19, 2},   {0xFE20, 0xFE2F, 0},   {0xFE30, 0xFE6F, 2},
+    {0xFEFF, 0xFEFF, 0},   {0xFF00, 0xFF60, 2},   {0xFFE0, 0xFFE6, 2},   {0x1F300, 0x1F64F, 2},
+    {0x1F680, 0x1F6FF, 2}, {0x1F900, 0x1F9FF, 2}, {0x20000, 0x2FFFD, 2}, {0x30000, 0x3FFFD, 2},
+    {0xE0100, 0xE01EF, 0},
+};
+
+/*
+ * Return the number of terminal cells a codepoint takes up (0, 1, or 2).
+ */
+static int codepoint_width(uint32_t cp) {
+    if (cp < 0x300) return 1;
+    int lo = 0, hi = (int)(sizeof(wide_ranges) / sizeof(wide_ranges[0])) - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (cp < wide_ranges[mid].first) hi = mid - 1;
+        else if (cp > wide_ranges[mid].last) lo = mid + 1;
+        else return wide_ranges[mid].width;
+    }
+    return 1;
+}
+
+/*
+ * Decode one grapheme cluster from *s and advance *s past it: a character
+ * along with any combining marks, variation selectors, emoji skin tones, tag
+ * characters and ZWJ-joined characters that follow it, or a pair of regional
+ * indicators (a flag). `*first` is set to its first codepoint and `*count` to
+ * the number of codepoints in it. Returns its width in cells.
+ */
+static int next_grapheme(const char **s, uint32_t *first, int *count) {
+    uint32_t cp = utf8_decode(s);
+    int width = codepoint_width(cp), n = 1;
+    int flag = (0x1F1E6 <= cp && cp <= 0x1F1FF);
+    *first = cp;
+    // Everything that can extend a cluster is outside of ASCII:
+    while ((unsigned char)**s >= 0x80) {
+        const char *next = *s;
+        uint32_t ext = utf8_decode(&next);
+        if (ext == 0x200D) { // ZWJ: the next character joins this one
+            if ((unsigned char)*next >= 0x80) utf8_decode(&next), n++;
+        } else if (ext == 0xFE0F) { // Emoji presentation
+            width = 2;
+        } else if (flag && 0x1F1E6 <= ext && ext <= 0x1F1FF) {
+            flag = 0;
+            width = 2;
+        } else if (!(0x1F3FB <= ext && ext <= 0x1F3FF) && !(0xE0020 <= ext && ext <= 0xE007F)
+                   && codepoint_width(ext) != 0) {
+            break;
+        }
+        *s = next;
+        n++;
+    }
+    *count = n;
+    return width;
+}
+
+/*
+ * Hash some bytes (FNV-1a).
+ */
+static inline uint64_t hash_bytes(const char *s, size_t len) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char)s[i]) * 1099511628211ull;
+    return hash;
+}
+
+/*
+ * Return the value to store in a cell for a grapheme cluster of more than
+ * one codepoint, adding the cluster to the grapheme table if it's new. If the
+ * table is full (or the cluster is too long), the cell just gets the cluster's
+ * first codepoint.
+ */
+static uint32_t intern_grapheme(const char *s, size_t len, uint32_t first, int width) {
+    if (len > sizeof(bt.graphemes[0].bytes)) return first;
+    uint64_t hash = hash_bytes(s, len);
+    if (bt.grapheme_slots) {
+        uint32_t mask = (uint32_t)(2 * bt.graphemes_cap - 1);
+        for (uint32_t slot = (uint32_t)hash & mask; bt.grapheme_slots[slot]; slot = (slot + 1) & mask) {
+            btui_grapheme_t *g = &bt.graphemes[bt.grapheme_slots[slot] - 1];
+            if (g->hash == hash && g->len == len && memcmp(g->bytes, s, len) == 0)
+                return BTUI_GRAPHEME_FLAG | (bt.grapheme_slots[slot] - 1);
+        }
+    }
+    if (bt.num_graphemes >= BTUI_MAX_GRAPHEMES) return first;
+    if (bt.num_graphemes >= bt.graphemes_cap) {
+        // Grow the table, keeping it no more than half full:
+        int cap = bt.graphemes_cap ? 2 * bt.graphemes_cap : 64;
+        btui_grapheme_t *graphemes = realloc(bt.graphemes, sizeof(btui_grapheme_t) * (size_t)cap);
+        if (!graphemes) return first;
+        bt.graphemes = graphemes;
+        uint32_t *slots = calloc((size_t)(2 * cap), sizeof(uint32_t));
+        if (!slots) return first;
+        free(bt.grapheme_slots);
+        bt.grapheme_slots = slots;
+        bt.graphemes_cap = cap;
+        uint32_t mask = (uint32_t)(2 * cap - 1);
+        for (int i = 0; i < bt.num_graphemes; i++) {
+            uint32_t slot = (uint32_t)bt.graphemes[i].hash & mask;
+            while (slots[slot])
+                slot = (slot + 1) & mask;
+            slots[slot] = (uint32_t)i + 1;
+        }
+    }
+    uint32_t mask = (uint32_t)(2 * bt.graphemes_cap - 1);
+    uint32_t slot = (uint32_t)hash & mask;
+    while (bt.grapheme_slots[slot])
+        slot = (slot + 1) & mask;
+    int i = bt.num_graphemes++;
+    bt.grapheme_slots[slot] = (uint32_t)i + 1;
+    btui_grapheme_t *g = &bt.graphemes[i];
+    g->hash = hash;
+    g->len = (uint8_t)len;
+    g->width = (uint8_t)width;
+    memcpy(g->bytes, s, len);
+    return BTUI_GRAPHEME_FLAG | (uint32_t)i;
+}
+
+/*
+ * Return the width of whatever is stored in a cell (a codepoint or an
+ * interned grapheme cluster).
+ */
+static inline int cell_width(uint32_t ch) {
+    if (BTUI_IS_GRAPHEME(ch)) return bt.graphemes[ch & ~BTUI_GRAPHEME_FLAG].width;
+    return codepoint_width(ch);
+}
+
+/*
+ * Encode the contents of a cell as UTF-8 into `buf` (which must have room for
+ * 30 bytes) and return the number of bytes.
+ */
+static inline int cell_encode(uint32_t ch, char *buf) {
+    if (!BTUI_IS_GRAPHEME(ch)) return utf8_encode(ch, buf);
+    const btui_grapheme_t *g = &bt.graphemes[ch & ~BTUI_GRAPHEME_FLAG];
+    memcpy(buf, g->bytes, g->len);
+    return g->len;
+}
+
+/*
+ * Free the grapheme table and forget cached text widths.
+ */
+static void free_graphemes(void) {
+    free(bt.graphemes);
+    free(bt.grapheme_slots);
+    bt.graphemes = NULL;
+    bt.grapheme_slots = NULL;
+    bt.num_graphemes = bt.graphemes_cap = 0;
+    memset(bt.width_cache, 0, sizeof(bt.width_cache));
+}
+
+/*
+ * Update where BTUI thinks the terminal's cursor is after printing the given
+ * text. Anything that might move the cursor unpredictably (most escape
+ * sequences, or running off the edge of the screen) makes it unknown.
+ */
+static void track_text(const char *s) {
+    int x = bt.screen_x, y = bt.screen_y;
+    while (*s && x >= 0 && y >= 0) {
+        if (*s == '\033') {
+            // Setting the style or erasing text leaves the cursor alone:
+            const char *end = s + 1;
+            if (*end == '[') {
+                for (end++; *end >= 0x20 && *end < 0x40; end++)
+                    continue;
+            }
+            if (s[1] == '[' && (*end == 'm' || *end == 'K' || *end == 'J' || *end == 'X')) {
+                s = end + 1;
+                continue;
+            }
+            x = y = -1;
+            break;
+        }
+        uint32_t cp;
+        int n, w = next_grapheme(&s, &cp, &n);
+        if (cp == '\r') x = 0;
+        else if (cp == '\n') y += y + 1 < bt.height ? 1 : 0;
+        else if (cp == '\t') x = (x / 8 + 1) * 8 < bt.width ? (x / 8 + 1) * 8 : bt.width - 1;
+        else if (cp == '\b') x -= x > 0 ? 1 : 0;
+        else if (cp == '\a') continue;
+        else if (cp < ' ' || cp == 0x7F) x = -1;
+        else x += w;
+        if (x >= bt.width) x = -1;
+    }
+    bt.screen_x = x, bt.screen_y = y;
+}
+
+/*
+ * Move where BTUI thinks the terminal's cursor is `n` cells to the right, after
+ * printing `n` single-width characters.
+ */
+static inline void advance_cursor(int n) {
+    if (bt.screen_x >= 0) bt.screen_x = bt.screen_x + n < bt.width ? bt.screen_x + n : -1;
+}
+
+/*
+ * Write the cheapest way to move the terminal's cursor from where it is to
+ * (x,y) into `buf` (at most 32 bytes) and return a pointer to the end. Control
+ * characters and relative moves are used when the cursor's position is known,
+ * otherwise this is an absolute move.
+ */
+static char *put_move(char *buf, int x, int y) {
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+    if (bt.width > 0 && x >= bt.width) x = bt.width - 1;
+    if (bt.height > 0 && y >= bt.height) y = bt.height - 1;
+    int from_x = bt.screen_x, from_y = bt.screen_y;
+    bt.screen_x = x, bt.screen_y = y;
+    if (from_x < 0 || from_y < 0 || (bt.mode != BTUI_MODE_NORMAL && bt.mode != BTUI_MODE_TUI)) {
+        bt.stats.escapes[BTUI_ESCAPE_CURSOR] += 1;
+        return put_cup(buf, x, y);
+    }
+
+    char rel[32], *end = rel;
+    int dy = y - from_y;
+    if (dy > 0 && dy < 4) {
+        memset(end, '\n', (size_t)dy);
+        end += dy;
+    } else if (dy > 0) {
+        end = put_csi(end, dy, 'B');
+    } else if (dy == -1) {
+        // Reverse index can't scroll here, since the cursor isn't on the top line
+        *(end++) = '\033', *(end++) = 'M';
+    } else if (dy < 0) {
+        end = put_csi(end, -dy, 'A');
+    }
+
+    int dx = x - from_x;
+    if (x == 0 && dx != 0) {
+        *(end++) = '\r';
+    } else if (dx < 0 && dx > -4) {
+        memset(end, '\b', (size_t)-dx);
+        end += -dx;
+    } else if (dx != 0) {
+        char *cha_end = put_csi(end, x + 1, 'G');
+        char col[16], *col_end = put_csi(col, dx > 0 ? dx : -dx, dx > 0 ? 'C' : 'D');
+        if (col_end - col < cha_end - end) {
+            memcpy(end, col, (size_t)(col_end - col));
+            end += col_end - col;
+        } else {
+            end = cha_end;
+        }
+    }
+
+    if (end > rel) bt.stats.escapes[BTUI_ESCAPE_CURSOR] += 1;
+    char *cup_end = put_cup(buf, x, y);
+    if (end - rel >= cup_end - buf) return cup_end;
+    memcpy(buf, rel, (size_t)(end - rel));
+    return buf + (end - rel);
+}
+
+/*
+ * Output `n` copies of the single-width character `cp` in the terminal's
+ * current style. Runs of spaces are erased with ECH (which leaves the cursor
+ * where it is) and other runs use REP, when the terminal supports them.
+ * Otherwise, the whole run is copied into the output buffer at once.
+ */
+static void output_run(uint32_t cp, int n) {
+    if (n <= 0) return;
+    // Erased cells only get the background color, not these attributes:
+    const attr_t visible_on_blanks = BTUI_UNDERLINE | BTUI_DOUBLE_UNDERLINE | BTUI_REVERSE
+                                     | BTUI_STRIKETHROUGH | BTUI_FRAMED | BTUI_ENCIRCLED
+                                     | BTUI_OVERLINED;
+    if (cp == ' ' && n > 4 && (bt.caps & BTUI_CAP_ECH) && bt.style_known
+        && !(bt.term_style.attrs & visible_on_blanks)) {
+        bt.stats.escapes[BTUI_ESCAPE_ERASE] += 1;
+        output_commit(put_csi(output_reserve(16), n, 'X'));
+        return;
+    }
+    char ch[4];
+    int len = utf8_encode(cp, ch);
+    if ((bt.caps & BTUI_CAP_REP) && (n - 1) * len > 5) {
+        bt.stats.escapes[BTUI_ESCAPE_REPEAT] += 1;
+        char *buf = output_reserve(24);
+        memcpy(buf, ch, (size_t)len);
+        output_commit(put_csi(buf + len, n - 1, 'b'));
+    } else {
+        char *buf = output_reserve((size_t)(n * len));
+        if (len == 1) {
+            memset(buf, ch[0], (size_t)n);
+        } else {
+            for (int i = 0; i < n; i++)
+                memcpy(buf + i * len, ch, (size_t)len);
+        }
+        output_commit(buf + n * len);
+    }
+    advance_cursor(n);
+}
+
+/*
+ * Update a style as if the terminal received the SGR codes in `attrs`. The
+ * codes are applied in the same order btui_set_attributes() emits them.
+ */
+static void style_apply(btui_style_t *style, attr_t attrs) {
+    const attr_t toggles = BTUI_BOLD | BTUI_FAINT | BTUI_ITALIC | BTUI_UNDERLINE | BTUI_BLINK_SLOW
+                           | BTUI_BLINK_FAST | BTUI_REVERSE | BTUI_CONCEAL | BTUI_STRIKETHROUGH
+                           | BTUI_FRAKTUR | BTUI_DOUBLE_UNDERLINE | BTUI_FRAMED | BTUI_ENCIRCLED
+                           | BTUI_OVERLINED;
+    for (int i = 63; i >= 0; i--) {
+        attr_t bit = 1ul << i;
+        if (!(attrs & bit)) continue;
+        if (bit == BTUI_NORMAL) *style = blank_cell.style;
+        else if (bit & toggles) style->attrs |= bit;
+        else if (bit == BTUI_NO_BOLD_OR_FAINT) style->attrs &= ~(BTUI_BOLD | BTUI_FAINT);
+        else if (bit == BTUI_NO_ITALIC_OR_FRAKTUR) style->attrs &= ~(BTUI_ITALIC | BTUI_FRAKTUR);
+        else if (bit == BTUI_NO_UNDERLINE) style->attrs &= ~(BTUI_UNDERLINE | BTUI_DOUBLE_UNDERLINE);
+        else if (bit == BTUI_NO_BLINK) style->attrs &= ~(BTUI_BLINK_SLOW | BTUI_BLINK_FAST);
+        else if (bit == BTUI_NO_REVERSE) style->attrs &= ~BTUI_REVERSE;
+        else if (bit == BTUI_NO_CONCEAL) style->attrs &= ~BTUI_CONCEAL;
+        else if (bit == BTUI_NO_STRIKETHROUGH) style->attrs &= ~BTUI_STRIKETHROUGH;
+        else if (bit == BTUI_NO_FRAMED_OR_ENCIRCLED) style->attrs &= ~(BTUI_FRAMED | BTUI_ENCIRCLED);
+        else if (bit == BTUI_NO_OVERLINED) style->attrs &= ~BTUI_OVERLINED;
+        else if (30 <= i && i <= 37) style->fg = BTUI_COLOR_BASIC(i - 30);
+        else if (bit == BTUI_FG_NORMAL) style->fg = BTUI_COLOR_DEFAULT;
+        else if (40 <= i && i <= 47) style->bg = BTUI_COLOR_BASIC(i - 40);
+        else if (bit == BTUI_BG_NORMAL) style->bg = BTUI_COLOR_DEFAULT;
+    }
+}
+
+/*
+ * Return how far apart two colors look (a squared distance with the channels
+ * weighted by how much they affect brightness).
+ */
+static inline int color_distance(int r1, int g1, int b1, int r2, int g2, int b2) {
+    return 2 * (r1 - r2) * (r1 - r2) + 4 * (g1 - g2) * (g1 - g2) + 3 * (b1 - b2) * (b1 - b2);
+}
+
+/*
+ * Return the index of the 256-color palette entry nearest to an RGB color,
+ * which is either the nearest point of the color cube or the nearest gray.
+ */
+static int nearest_256(int r, int g, int b) {
+#define CUBE_INDEX(v) ((v) < 48 ? 0 : (v) < 115 ? 1 : ((v) - 35) / 40)
+    int ri = CUBE_INDEX(r), gi = CUBE_INDEX(g), bi = CUBE_INDEX(b);
+#undef CUBE_INDEX
+    int cube = 16 + 36 * ri + 6 * gi + bi;
+    int cr = cube_levels[ri], cg = cube_levels[gi], cb = cube_levels[bi];
+    if (cr == r && cg == g && cb == b) return cube;
+    int average = (r + g + b) / 3;
+    int gray_index = average > 238 ? 23 : average < 8 ? 0 : (average - 3) / 10;
+    int gray = 8 + 10 * gray_index;
+    if (color_distance(gray, gray, gray, r, g, b) < color_distance(cr, cg, cb, r, g, b))
+        return 232 + gray_index;
+    return cube;
+}
+
+/*
+ * Return the index of the basic color nearest to an RGB color, looked up in a
+ * cube of precomputed answers.
+ */
+static int nearest_basic(int r, int g, int b) {
+    if (!basic_color_cube_ready) {
+        for (int i = 0; i < 16 * 16 * 16; i++) {
+            int cr = (i >> 8) * 17, cg = ((i >> 4) & 0xF) * 17, cb = (i & 0xF) * 17;
+            int best = 0, best_distance = INT32_MAX;
+            for (int n = 0; n < 16; n++) {
+                const uint8_t *rgb = basic_rgb[n];
+                int d = color_distance(cr, cg, cb, rgb[0], rgb[1], rgb[2]);
+                if (d < best_distance) best = n, best_distance = d;
+            }
+            basic_color_cube[i] = (uint8_t)best;
+        }
+        basic_color_cube_ready = 1;
+    }
+    return basic_color_cube[((r >> 4) << 8) | ((g >> 4) << 4) | (b >> 4)];
+}
+
+/*
+ * Return the color to use instead of `color` on this terminal: RGB colors
+ * become the nearest palette color unless the terminal has BTUI_CAP_TRUECOLOR,
+ * and palette colors become the nearest basic color unless it has
+ * BTUI_CAP_256COLOR. Recently used colors are cached.
+ */
+static btui_color_t downsample_color(btui_color_t color) {
+    uint32_t kind = BTUI_COLOR_KIND(color);
+    uint32_t depth = (bt.caps & BTUI_CAP_TRUECOLOR) ? 3 : (bt.caps & BTUI_CAP_256COLOR) ? 2 : 1;
+    if (kind <= depth || color == BTUI_COLOR_UNCHANGED) return color;
+    uint32_t slot = ((color * 2654435761u) >> 16) & (BTUI_COLOR_CACHE_SIZE - 1);
+    btui_color_entry_t *entry = &bt.color_cache[slot];
+    if (entry->from == color && BTUI_COLOR_KIND(entry->to) == depth) return entry->to;
+    int r, g, b, n = (int)(color & 0xFF);
+    if (kind == 3) {
+        r = (int)((color >> 16) & 0xFF), g = (int)((color >> 8) & 0xFF), b = n;
+    } else if (n < 16) {
+        r = basic_rgb[n][0], g = basic_rgb[n][1], b = basic_rgb[n][2];
+    } else if (n >= 232) {
+        r = g = b = 8 + 10 * (n - 232);
+    } else {
+        n -= 16;
+        r = cube_levels[n / 36], g = cube_levels[n / 6 % 6], b = cube_levels[n % 6];
+    }
+    entry->from = color;
+    entry->to = depth == 2 ? BTUI_COLOR_256(nearest_256(r, g, b))
+                           : BTUI_COLOR_BASIC(nearest_basic(r, g, b));
+    return entry->to;
+}
+
+/*
+ * Write the SGR parameters for a color (e.g. ";38;2;r;g;b") into `buf` and
+ * return a pointer to the end. `base` is 30 for foreground colors and 40 for
+ * background colors.
+ */
+static char *sgr_color(char *buf, btui_color_t color, int base) {
+    *(buf++) = ';';
+    int n = (int)(color & 0xFF);
+    switch (BTUI_COLOR_KIND(color)) {
+    case 1: return put_int(buf, n < 8 ? base + n : base + 60 + (n - 8));
+    case 2:
+        buf = put_int(buf, base + 8);
+        buf = stpcpy(buf, ";5;");
+        return put_int(buf, n);
+    case 3:
+        buf = put_int(buf, base + 8);
+        buf = stpcpy(buf, ";2;");
+        memcpy(buf, byte_digits[(color >> 16) & 0xFF].digits, 3);
+        buf += byte_digits[(color >> 16) & 0xFF].len;
+        *(buf++) = ';';
+        memcpy(buf, byte_digits[(color >> 8) & 0xFF].digits, 3);
+        buf += byte_digits[(color >> 8) & 0xFF].len;
+        *(buf++) = ';';
+        memcpy(buf, byte_digits[n].digits, 3);
+        return buf + byte_digits[n].len;
+    default: return put_int(buf, base + 9);
+    }
+}
+
+/*
+ * Write the SGR parameters for the given attribute codes into `buf` (in the
+ * same order as btui_set_attributes() has always sent them, each preceded by
+ * ';') and return a pointer to the end.
+ */
+static char *sgr_attrs(char *buf, attr_t attrs) {
+    for (int i = 63; i >= 0; i--) {
+        if (attrs & (1ul << i)) {
+            *(buf++) = ';';
+            buf = put_int(buf, i);
+        }
+    }
+    return buf;
+}
+
+/*
+ * Write the SGR parameters to change the text style from `from` to `to` into
+ * `buf` and return a pointer to the end.
+ */
+static char *sgr_diff(char *buf, btui_style_t from, btui_style_t to) {
+    static const struct {
+        attr_t attrs, off;
+    } groups[] = {
+        {BTUI_BOLD | BTUI_FAINT, BTUI_NO_BOLD_OR_FAINT},
+        {BTUI_ITALIC | BTUI_FRAKTUR, BTUI_NO_ITALIC_OR_FRAKTUR},
+        {BTUI_UNDERLINE | BTUI_DOUBLE_UNDERLINE, BTUI_NO_UNDERLINE},
+        {BTUI_BLINK_SLOW | BTUI_BLINK_FAST, BTUI_NO_BLINK},
+        {BTUI_REVERSE, BTUI_NO_REVERSE},
+        {BTUI_CONCEAL, BTUI_NO_CONCEAL},
+        {BTUI_STRIKETHROUGH, BTUI_NO_STRIKETHROUGH},
+        {BTUI_FRAMED | BTUI_ENCIRCLED, BTUI_NO_FRAMED_OR_ENCIRCLED},
+        {BTUI_OVERLINED, BTUI_NO_OVERLINED},
+    };
+    attr_t on = to.attrs & ~from.attrs;
+    for (size_t i = 0; i < sizeof(groups) / sizeof(groups[0]); i++) {
+        if (from.attrs & ~to.attrs & groups[i].attrs) {
+            // Turning off one attribute in a group turns off the whole group:
+            buf = sgr_attrs(buf, groups[i].off);
+            on |= to.attrs & groups[i].attrs;
+        }
+    }
+    buf = sgr_attrs(buf, on);
+    if (from.fg != to.fg) buf = sgr_color(buf, to.fg, 30);
+    if (from.bg != to.bg) buf = sgr_color(buf, to.bg, 40);
+    return buf;
+}
+
+/*
+ * Send an SGR escape sequence with the given parameters (each preceded by ';').
+ */
+static int put_sgr(const char *params, const char *end) {
+    if (end == params) return 0;
+    bt.stats.escapes[BTUI_ESCAPE_STYLE] += 1;
+    size_t len = (size_t)(end - params) - 1;
+    char *buf = output_reserve(len + 3);
+    buf[0] = '\033', buf[1] = '[';
+    memcpy(&buf[2], params + 1, len);
+    buf[2 + len] = 'm';
+    return output_commit(buf + len + 3);
+}
+
+/*
+ * Change the terminal's text style to `style`. Nothing is sent if the terminal
+ * already has that style, and otherwise the shorter of a minimal change or a
+ * full reset is sent.
+ */
+static int set_term_style(btui_style_t style) {
+    if (bt.style_known && style_eq(bt.term_style, style)) return 0;
+    char full[256], diff[256];
+    char *full_end = stpcpy(full, ";0");
+    full_end = sgr_attrs(full_end, style.attrs);
+    if (style.fg != BTUI_COLOR_DEFAULT) full_end = sgr_color(full_end, style.fg, 30);
+    if (style.bg != BTUI_COLOR_DEFAULT) full_end = sgr_color(full_end, style.bg, 40);
+    btui_style_t prev = bt.term_style;
+    bt.term_style = style;
+    if (bt.style_known) {
+        char *diff_end = sgr_diff(diff, prev, style);
+        if (diff_end - diff < full_end - full) return put_sgr(diff, diff_end);
+    }
+    bt.style_known = 1;
+    return put_sgr(full, full_end);
+}
+
+/*
+ * Encode scrolling the lines from `firstline` to `lastline` (0-indexed) by
+ * `amount` lines (positive to move text up) into `buf`, using a scroll
+ * region. Returns the end of the encoded bytes.
+ */
+static char *put_scroll(char *buf, int firstline, int lastline, int amount) {
+    bt.stats.escapes[BTUI_ESCAPE_SCROLL] += 1;
+    *(buf++) = '\033', *(buf++) = '[';
+    buf = put_int(buf, firstline + 1);
+    *(buf++) = ';';
+    buf = put_int(buf, lastline + 1);
+    *(buf++) = 'r';
+    if (amount > 0) buf = put_csi(buf, amount, 'S');
+    else buf = put_csi(buf, -amount, 'T');
+    memcpy(buf, "\033[r", 3);
+    // Setting the scroll region moves the cursor:
+    bt.screen_x = bt.screen_y = -1;
+    return buf + 3;
+}
+
+/*
+ * Find a surface by its ID (NULL if there's no such surface).
+ */
+static btui_surface_t *find_surface(int id) {
+    for (int i = 0; i < bt.num_surfaces; i++) {
+        if (bt.surfaces[i].id == id) return &bt.surfaces[i];
+    }
+    return NULL;
+}
+
+/*
+ * Free all surfaces and go back to drawing onto the screen.
+ */
+static void free_surfaces(void) {
+    for (int i = 0; i < bt.num_surfaces; i++)
+        free(bt.surfaces[i].cells);
+    bt.num_surfaces = 0;
+    free(bt.composed);
+    bt.composed = NULL;
+    bt.num_damage = 0;
+    if (bt.target) {
+        bt.target = 0;
+        bt.canvas = bt.back, bt.canvas_width = bt.buf_width, bt.canvas_height = bt.buf_height;
+        bt.cursor_x = bt.saved_cursor_x, bt.cursor_y = bt.saved_cursor_y;
+        bt.pen = bt.saved_pen;
+    }
+}
+
+/*
+ * Put a surface into the list of surfaces where its z belongs (on top of
+ * others with the same z).
+ */
+static void insert_surface(btui_surface_t surface) {
+    int i = bt.num_surfaces++;
+    for (; i > 0 && bt.surfaces[i - 1].z > surface.z; i--)
+        bt.surfaces[i] = bt.surfaces[i - 1];
+    bt.surfaces[i] = surface;
+}
+
+/*
+ * Note that an area of the screen needs to be composited again before the
+ * next flush. Nearby areas aren't merged until there are too many to track,
+ * and then they all become their bounding box.
+ */
+static void add_damage(int x, int y, int w, int h) {
+    if (bt.num_surfaces == 0) return;
+    // (One cell wider on each side, for wide characters that get cut in half)
+    x -= 1, w += 2;
+    if (x < 0) w += x, x = 0;
+    if (y < 0) h += y, y = 0;
+    if (x + w > bt.buf_width) w = bt.buf_width - x;
+    if (y + h > bt.buf_height) h = bt.buf_height - y;
+    if (w <= 0 || h <= 0) return;
+    if (bt.num_damage == BTUI_MAX_DAMAGE) {
+        btui_rect_t *box = &bt.damage[0];
+        int x2 = box->x + box->w, y2 = box->y + box->h;
+        for (int i = 1; i < bt.num_damage; i++) {
+            btui_rect_t r = bt.damage[i];
+            if (r.x < box->x) box->x = r.x;
+            if (r.y < box->y) box->y = r.y;
+            if (r.x + r.w > x2) x2 = r.x + r.w;
+            if (r.y + r.h > y2) y2 = r.y + r.h;
+        }
+        box->w = x2 - box->x, box->h = y2 - box->y;
+        bt.num_damage = 1;
+    }
+    bt.damage[bt.num_damage++] = (btui_rect_t){x, y, w, h};
+}
+
+/*
+ * Note that an area of the drawing target has changed (in the target's
+ * coordinates).
+ */
+static inline void add_canvas_damage(int x, int y, int w, int h) {
+    if (bt.target == 0) {
+        add_damage(x, y, w, h);
+    } else {
+        btui_surface_t *surface = find_surface(bt.target);
+        if (surface && surface->visible) add_damage(surface->x + x, surface->y + y, w, h);
+    }
+}
+
+/*
+ * (Re)allocate the cell buffers to match the terminal size. Existing back
+ * buffer content is kept where it still fits, and the screen is cleared so
+ * that the next flush repaints everything that isn't blank.
+ */
+static int resize_buffers(void) {
+    int w = bt.width, h = bt.height;
+    btui_cell_t *back = malloc(sizeof(btui_cell_t) * (size_t)(w * h));
+    btui_cell_t *front = malloc(sizeof(btui_cell_t) * (size_t)(w * h));
+    uint64_t *row_hashes = malloc(sizeof(uint64_t) * (size_t)(4 * h));
+    if (!back || !front || !row_hashes) {
+        free(back);
+        free(front);
+        free(row_hashes);
+        return -1;
+    }
+    for (int i = 0; i < w * h; i++)
+        back[i] = front[i] = blank_cell;
+    if (bt.back) {
+        for (int y = 0; y < h && y < bt.buf_height; y++)
+            memcpy(&back[y * w], &bt.back[y * bt.buf_width],
+                   sizeof(btui_cell_t) * (size_t)(w < bt.buf_width ? w : bt.buf_width));
+    }
+    if (bt.num_surfaces > 0) {
+        btui_cell_t *composed = realloc(bt.composed, sizeof(btui_cell_t) * (size_t)(w * h));
+        if (!composed) {
+            free(back);
+            free(front);
+            free(row_hashes);
+            return -1;
+        }
+        bt.composed = composed;
+    }
+    free(bt.back);
+    free(bt.front);
+    free(bt.row_hashes);
+    bt.back = back;
+    bt.front = front;
+    bt.row_hashes = row_hashes;
+    bt.buf_width = w;
+    bt.buf_height = h;
+    if (bt.target == 0) bt.canvas = back, bt.canvas_width = w, bt.canvas_height = h;
+    bt.num_damage = 0;
+    add_damage(0, 0, w, h);
+    bt.screen_x = bt.screen_y = -1;
+    bt.stats.escapes[BTUI_ESCAPE_STYLE] += 1;
+    bt.stats.escapes[BTUI_ESCAPE_ERASE] += 1;
+    output_puts("\033[0m\033[2J");
+    bt.term_style = blank_cell.style;
+    bt.style_known = 1;
+    return 0;
+}
+
+/*
+ * Set a range of cells in the drawing target (clipped to its size).
+ */
+static void buffer_fill(int x, int y, int w, int h, btui_cell_t cell) {
+    if (x < 0) w += x, x = 0;
+    if (y < 0) h += y, y = 0;
+    if (x + w > bt.canvas_width) w = bt.canvas_width - x;
+    if (y + h > bt.canvas_height) h = bt.canvas_height - y;
+    if (w <= 0 || h <= 0) return;
+    add_canvas_damage(x, y, w, h);
+    for (int row = y; row < y + h; row++) {
+        btui_cell_t *cells = &bt.canvas[row * bt.canvas_width];
+        // Don't leave half of a wide character behind:
+        if (x > 0 && cells[x].ch == 0) cells[x - 1].ch = ' ';
+        if (x + w < bt.canvas_width && cells[x + w].ch == 0) cells[x + w].ch = ' ';
+        for (int col = x; col < x + w; col++)
+            cells[col] = cell;
+    }
+}
+
+/*
+ * Composite the visible surfaces over the back buffer into `composed`, in the
+ * areas that have changed since the last time. (Helper method for
+ * buffer_flush())
+ */
+static void composite(void) {
+    int w = bt.buf_width;
+    for (int d = 0; d < bt.num_damage; d++) {
+        btui_rect_t r = bt.damage[d];
+        for (int y = r.y; y < r.y + r.h; y++) {
+            btui_cell_t *row = &bt.composed[y * w];
+            memcpy(&row[r.x], &bt.back[y * w + r.x], sizeof(btui_cell_t) * (size_t)r.w);
+            for (int i = 0; i < bt.num_surfaces; i++) {
+                btui_surface_t *surface = &bt.surfaces[i];
+                if (!surface->visible || y < surface->y || y >= surface->y + surface->height)
+                    continue;
+                int x0 = r.x > surface->x ? r.x : surface->x;
+                int x1 = r.x + r.w < surface->x + surface->width ? r.x + r.w
+                                                                 : surface->x + surface->width;
+                const btui_cell_t *src = &surface->cells[(y - surface->y) * surface->width - surface->x];
+                for (int x = x0; x < x1; x++) {
+                    if (src[x].ch != BTUI_TRANSPARENT) row[x] = src[x];
+                }
+            }
+            // Where layers meet, half of a wide character may be covered up:
+            for (int x = r.x; x < r.x + r.w; x++) {
+                if (row[x].ch == 0 && (x == 0 || row[x - 1].ch == 0 || cell_width(row[x - 1].ch) != 2))
+                    row[x].ch = ' ';
+                else if (row[x].ch != 0 && cell_width(row[x].ch) == 2
+                         && (x + 1 >= w || row[x + 1].ch != 0))
+                    row[x].ch = ' ';
+            }
+        }
+    }
+    bt.num_damage = 0;
+}
+
+/*
+ * Put a single codepoint or interned grapheme cluster `w` cells wide into the
+ * back buffer at the cursor position and advance the cursor.
+ */
+static void buffer_putc(uint32_t cp, int w) {
+    if (w == 0) return; // Stray combining characters can't be represented in a cell
+    if (bt.cursor_y >= 0 && bt.cursor_y < bt.canvas_height && bt.cursor_x >= 0
+        && bt.cursor_x + w <= bt.canvas_width) {
+        buffer_fill(bt.cursor_x, bt.cursor_y, w, 1, (btui_cell_t){.style = bt.pen, .ch = 0});
+        bt.canvas[bt.cursor_y * bt.canvas_width + bt.cursor_x].ch = cp;
+    }
+    bt.cursor_x += w;
+}
+
+/*
+ * Consume one escape sequence from the text being drawn into the back buffer
+ * and return a pointer just past it. SGR (color/attribute) sequences update
+ * the drawing style, other sequences are ignored.
+ */
+static const char *buffer_escape(const char *s) {
+    if (s[1] == '[') {
+        int params[32], nparams = 0, n = 0;
+        for (s += 2; *s && (*s < 0x40 || *s > 0x7E); s++) {
+            if ('0' <= *s && *s <= '9') {
+                n = 10 * n + (*s - '0');
+            } else if (*s == ';' || *s == ':') {
+                if (nparams < 32) params[nparams++] = n;
+                n = 0;
+            }
+        }
+        if (nparams < 32) params[nparams++] = n;
+        if (*s != 'm') return *s ? s + 1 : s;
+        for (int i = 0; i < nparams; i++) {
+            int p = params[i];
+            if ((p == 38 || p == 48) && i + 2 < nparams && params[i + 1] == 5) {
+                btui_color_t c = BTUI_COLOR_256(params[i + 2] & 0xFF);
+                *(p == 38 ? &bt.pen.fg : &bt.pen.bg) = c;
+                i += 2;
+            } else if ((p == 38 || p == 48) && i + 4 < nparams && params[i + 1] == 2) {
+                btui_color_t c = BTUI_COLOR_RGB(params[i + 2] & 0xFF, params[i + 3] & 0xFF,
+                                                params[i + 4] & 0xFF);
+                *(p == 38 ? &bt.pen.fg : &bt.pen.bg) = c;
+                i += 4;
+            } else if (90 <= p && p <= 97) {
+                bt.pen.fg = BTUI_COLOR_BASIC(p - 90 + 8);
+            } else if (100 <= p && p <= 107) {
+                bt.pen.bg = BTUI_COLOR_BASIC(p - 100 + 8);
+            } else if (p < 64) {
+                style_apply(&bt.pen, 1ul << p);
+            }
+        }
+        return s + 1;
+    } else if (s[1] == ']' || s[1] == 'P') { // OSC/DCS strings end with BEL or ST
+        for (s += 2; *s; s++) {
+            if (*s == '\a') return s + 1;
+            if (s[0] == '\033' && s[1] == '\\') return s + 2;
+        }
+        return s;
+    } else if (s[1] == '(' || s[1] == ')') {
+        return s[2] ? s + 3 : s + 2;
+    }
+    return s[1] ? s + 2 : s + 1;
+}
+
+/*
+ * Draw a string into the back buffer at the cursor position.
+ */
+static void buffer_puts(const char *s) {
+    while (*s) {
+        if (*s == '\033') {
+            s = buffer_escape(s);
+            continue;
+        }
+        if ((unsigned char)s[0] < 0x80 && (unsigned char)s[1] < 0x80) {
+            // ASCII that isn't followed by anything that could combine with it:
+            char c = *s++;
+            if (c == '\r') bt.cursor_x = 0;
+            else if (c == '\n') bt.cursor_y += 1;
+            else if (c == '\t') bt.cursor_x = (bt.cursor_x / 8 + 1) * 8;
+            else if (c == '\b') bt.cursor_x -= bt.cursor_x > 0 ? 1 : 0;
+            else if (c >= ' ' && c != 0x7F) buffer_putc((uint32_t)c, 1);
+            continue;
+        }
+        const char *start = s;
+        uint32_t cp;
+        int n, w = next_grapheme(&s, &cp, &n);
+        if (cp < ' ' || cp == 0x7F) continue;
+        buffer_putc(n == 1 ? cp : intern_grapheme(start, (size_t)(s - start), cp, w), w);
+    }
+}
+
+/*
+ * Hash the cells of one row of a cell buffer.
+ */
+static uint64_t hash_row(const btui_cell_t *row, int width) {
+    uint64_t hash = 14695981039346656037ull;
+    for (int x = 0; x < width; x++) {
+        hash = (hash ^ row[x].ch) * 1099511628211ull;
+        hash = (hash ^ row[x].style.attrs) * 1099511628211ull;
+        hash = (hash ^ (((uint64_t)row[x].style.fg << 32) | row[x].style.bg)) * 1099511628211ull;
+    }
+    return hash;
+}
+
+/*
+ * If the back buffer looks like what's on the screen shifted up or down
+ * (like a log that gained some lines), scroll the screen to match, so only
+ * the newly exposed lines need to be drawn. Rows are compared by hash: for
+ * each shift, the longest runs of rows that would come out right are found,
+ * and the one that saves sending the most cells is used (counting the cells
+ * that would need to be drawn on the blank lines that scrolling exposes).
+ * (Helper method for buffer_flush())
+ */
+static void scroll_to_match(const btui_cell_t *frame) {
+    int w = bt.buf_width, h = bt.buf_height;
+    if (!(bt.caps & BTUI_CAP_SCROLL) || h < 3) return;
+    uint64_t *back_hashes = bt.row_hashes, *front_hashes = bt.row_hashes + h;
+    // How many cells of each row are wrong, and how many aren't blank:
+    uint64_t *wrong = bt.row_hashes + 2 * h, *filled = bt.row_hashes + 3 * h;
+    for (int y = 0; y < h; y++) {
+        back_hashes[y] = hash_row(&frame[y * w], w);
+        front_hashes[y] = hash_row(&bt.front[y * w], w);
+        wrong[y] = filled[y] = 0;
+        for (int x = 0; x < w; x++) {
+            wrong[y] += !cell_eq(frame[y * w + x], bt.front[y * w + x]);
+            filled[y] += !cell_eq(frame[y * w + x], blank_cell);
+        }
+    }
+
+    // The best run of back buffer rows [best_top, best_bottom] that matches
+    // the screen shifted up by best_shift rows (it has to save more than the
+    // scrolling escape sequences cost):
+    int best_shift = 0, best_top = 0, best_bottom = -1;
+    int64_t best_gain = 16;
+    for (int shift = -(h - 1); shift < h; shift++) {
+        if (shift == 0) continue;
+        int top = shift > 0 ? 0 : -shift, end = shift > 0 ? h - shift : h;
+        int run_start = top;
+        int64_t gain = 0;
+        for (int y = top; y <= end; y++) {
+            if (y < end && back_hashes[y] == front_hashes[y + shift]) {
+                gain += (int64_t)wrong[y];
+                continue;
+            }
+            // The lines exposed by scrolling, which will have to be drawn:
+            int exposed = shift > 0 ? y : run_start + shift;
+            int exposed_end = shift > 0 ? y + shift : run_start;
+            if (exposed_end > h) exposed_end = h;
+            for (int e = exposed; e < exposed_end; e++)
+                gain -= (int64_t)filled[e] - (int64_t)wrong[e];
+            if (gain > best_gain && y > run_start)
+                best_gain = gain, best_shift = shift, best_top = run_start, best_bottom = y - 1;
+            run_start = y + 1, gain = 0;
+        }
+    }
+    if (best_shift == 0) return;
+
+    // Scroll the region holding both where the rows are now and where they
+    // need to go (new lines are blank with the default background):
+    int first = best_shift > 0 ? best_top : best_top + best_shift;
+    int last = best_shift > 0 ? best_bottom + best_shift : best_bottom;
+    int n = last - first + 1, shift = best_shift > 0 ? best_shift : -best_shift;
+    set_term_style(blank_cell.style);
+    output_commit(put_scroll(output_reserve(64), first, last, best_shift));
+    btui_cell_t *region = &bt.front[first * w];
+    if (best_shift > 0) {
+        memmove(region, region + shift * w, sizeof(btui_cell_t) * (size_t)((n - shift) * w));
+        region += (n - shift) * w;
+    } else {
+        memmove(region + shift * w, region, sizeof(btui_cell_t) * (size_t)((n - shift) * w));
+    }
+    for (int i = 0; i < shift * w; i++)
+        region[i] = blank_cell;
+}
+
+/*
+ * Send the cells in the back buffer that differ from what's on the screen.
+ */
+static void buffer_flush(void) {
+    if (bt.width != bt.buf_width || bt.height != bt.buf_height) resize_buffers();
+    // What the screen should look like:
+    const btui_cell_t *frame = bt.back;
+    if (bt.num_surfaces > 0) {
+        composite();
+        frame = bt.composed;
+    }
+    scroll_to_match(frame);
+    for (int y = 0; y < bt.buf_height; y++) {
+        for (int x = 0; x < bt.buf_width; x++) {
+            int i = y * bt.buf_width + x;
+            btui_cell_t cell = frame[i];
+            if (cell.ch == 0) continue; // Drawn along with the left half
+            int w = (x + 1 < bt.buf_width && frame[i + 1].ch == 0) ? 2 : 1;
+            if (cell_eq(cell, bt.front[i]) && (w == 1 || cell_eq(frame[i + 1], bt.front[i + 1])))
+                continue;
+            if (bt.screen_x != x || bt.screen_y != y) output_commit(put_move(output_reserve(32), x, y));
+            set_term_style(cell.style);
+            if (w == 1 && !BTUI_IS_GRAPHEME(cell.ch)) {
+                // Send runs of the same changed cell together:
+                int run = 1;
+                while (x + run < bt.buf_width && cell_eq(frame[i + run], cell)
+                       && !cell_eq(frame[i + run], bt.front[i + run])
+                       && !(x + run + 1 < bt.buf_width && frame[i + run + 1].ch == 0))
+                    run++;
+                output_run(cell.ch, run);
+                for (int j = 0; j < run; j++)
+                    bt.front[i + j] = cell;
+                x += run - 1;
+                continue;
+            }
+            char *buf = output_reserve(sizeof(bt.graphemes[0].bytes));
+            output_commit(buf + cell_encode(cell.ch, buf));
+            memcpy(&bt.front[i], &frame[i], sizeof(btui_cell_t) * (size_t)w);
+            bt.screen_x = x + w < bt.width ? x + w : -1;
+        }
+    }
+    // Leave the terminal's cursor at the screen's drawing cursor:
+    int cursor_x = bt.target ? bt.saved_cursor_x : bt.cursor_x;
+    int cursor_y = bt.target ? bt.saved_cursor_y : bt.cursor_y;
+    if (bt.screen_x != cursor_x || bt.screen_y != cursor_y)
+        output_commit(put_move(output_reserve(32), cursor_x, cursor_y));
+}
+
+#ifdef MATCH_SIMD_WIDTH
+/*
+ * Compare MATCH_SIMD_WIDTH bytes at `p` with `c` and return a mask with
+ * MATCH_MASK_BITS bits set for each byte that is equal.
+ */
+static inline uint64_t match_mask(const char *p, char c) {
+#if defined(__AVX2__)
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)));
+#elif defined(__SSE2__)
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    return (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+#else
+    uint8x16_t eq = vceqq_u8(vld1q_u8((const uint8_t *)p), vdupq_n_u8((uint8_t)c));
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+#endif
+}
+#endif
+
+/*
+ * Return the first byte in `s` that is `a` or `b`, or NULL if there is none.
+ * (Helper method for btui_match())
+ */
+static const char *find_byte(const char *s, size_t len, char a, char b) {
+    size_t i = 0;
+#ifdef MATCH_SIMD_WIDTH
+    for (; i + MATCH_SIMD_WIDTH <= len; i += MATCH_SIMD_WIDTH) {
+        uint64_t mask = match_mask(s + i, a) | match_mask(s + i, b);
+        if (mask) return s + i + (size_t)__builtin_ctzll(mask) / MATCH_MASK_BITS;
+    }
+#endif
+    for (; i < len; i++) {
+        if (s[i] == a || s[i] == b) return s + i;
+    }
+    return NULL;
+}
+
+/*
+ * Return the first place in `s` where the byte `a` is followed by `b`, or
+ * NULL if there is none. (Helper method for btui_match())
+ */
+static const char *find_pair(const char *s, size_t len, char a, char b) {
+    size_t i = 0;
+#ifdef MATCH_SIMD_WIDTH
+    for (; i + MATCH_SIMD_WIDTH + 1 <= len; i += MATCH_SIMD_WIDTH) {
+        uint64_t mask = match_mask(s + i, a) & match_mask(s + i + 1, b);
+        if (mask) return s + i + (size_t)__builtin_ctzll(mask) / MATCH_MASK_BITS;
+    }
+#endif
+    for (; i + 1 < len; i++) {
+        if (s[i] == a && s[i + 1] == b) return s + i;
+    }
+    return NULL;
+}
+
+/*
+ * Return whether `s` contains `query`. Places where the query's first two
+ * bytes appear are found with find_pair() before comparing the rest.
+ * (Helper method for btui_match())
+ */
+static int substring_match(const char *s, size_t len, const char *query, size_t query_len) {
+    if (query_len == 0) return 1;
+    if (query_len > len) return 0;
+    if (query_len == 1) return find_byte(s, len, query[0], query[0]) != NULL;
+    const char *end = s + len;
+    for (const char *p = s; (p = find_pair(p, (size_t)(end - p) - (query_len - 2), query[0], query[1]));
+         p++) {
+        if (memcmp(p + 2, query + 2, query_len - 2) == 0) return 1;
+    }
+    return 0;
+}
+
+/*
+ * Return whether a byte of a fuzzy match candidate is the same as a query
+ * byte, ignoring ASCII case if `fold` is set. (Helper method for fuzzy_score())
+ */
+static inline int fuzzy_eq(char c, char q, int fold) {
+    if (fold && 'A' <= c && c <= 'Z') c = (char)(c - 'A' + 'a');
+    return c == q;
+}
+
+/*
+ * Score how well `s` matches the bytes of `query` in order (not necessarily
+ * together), or return -1 if it doesn't. The shortest window that matches is
+ * scored, with bonuses for consecutive bytes and bytes at the start of words,
+ * and a penalty for each byte skipped over inside the window. `fold` ignores
+ * ASCII case (`query` must be lowercase). (Helper method for btui_match())
+ */
+static int fuzzy_score(const char *s, size_t len, const char *query, size_t query_len, int fold) {
+    if (query_len == 0) return 0;
+    char first = query[0];
+    const char *p = find_byte(s, len, first, fold && 'a' <= first && first <= 'z' ? (char)(first - 'a' + 'A') : first);
+    if (!p) return -1;
+    // Find the end of the first match:
+    size_t start = (size_t)(p - s), end = 0, j = 0;
+    for (size_t i = start; i < len; i++) {
+        if (fuzzy_eq(s[i], query[j], fold) && ++j == query_len) {
+            end = i;
+            break;
+        }
+    }
+    if (j < query_len) return -1;
+    // Then work backwards to where the shortest match ending there starts:
+    j = query_len - 1;
+    for (size_t i = end + 1; i-- > start;) {
+        if (fuzzy_eq(s[i], query[j], fold)) {
+            if (j == 0) {
+                start = i;
+                break;
+            }
+            j--;
+        }
+    }
+    int score = -(int)(end - start + 1 - query_len);
+    size_t prev = start;
+    j = 0;
+    for (size_t i = start; i <= end && j < query_len; i++) {
+        if (!fuzzy_eq(s[i], query[j], fold)) continue;
+        score += 16;
+        if (i > start && prev == i - 1) score += 12;
+        if (i == 0 || strchr(" /\\-_.:", s[i - 1] ? s[i - 1] : '?')) score += 10;
+        else if ('a' <= s[i - 1] && s[i - 1] <= 'z' && 'A' <= s[i] && s[i] <= 'Z') score += 8;
+        prev = i;
+        j++;
+    }
+    // Shorter candidates win ties:
+    score -= (int)(len < 1024 ? len : 1024) / 32;
+    return score < 0 ? 0 : score;
+}
+
+// One thread's share of a search (see match_candidates()):
+typedef struct {
+    const btui_matcher_t *m;
+    const uint32_t *src; // Candidate indices to check, or NULL to check [first, last) directly
+    size_t first, last;
+    const char *query;
+    size_t query_len;
+    int fuzzy, fold;
+    uint32_t *out; // Where to put the indices of the matches
+    int32_t *scores;
+    size_t count;
+} match_job_t;
+
+/*
+ * Check one range of candidates. (Helper method for match_candidates())
+ */
+static void *run_match_job(void *arg) {
+    match_job_t *job = arg;
+    const btui_matcher_t *m = job->m;
+    for (size_t k = job->first; k < job->last; k++) {
+        uint32_t i = job->src ? job->src[k] : (uint32_t)k;
+        const char *s = m->bytes + m->offsets[i];
+        size_t len = m->offsets[i + 1] - m->offsets[i];
+        if (job->fuzzy) {
+            int score = fuzzy_score(s, len, job->query, job->query_len, job->fold);
+            if (score < 0) continue;
+            job->scores[job->count] = score;
+        } else if (!substring_match(s, len, job->query, job->query_len)) {
+            continue;
+        }
+        job->out[job->count++] = i;
+    }
+    return NULL;
+}
+
+/*
+ * Append the candidates in [first, last) of `src` (or just [first, last) if
+ * `src` is NULL) that match the level's query to the level, splitting the
+ * work between threads when there's enough of it. Returns 0 on success or -1
+ * on failure. (Helper method for btui_match())
+ */
+static int match_candidates(const btui_matcher_t *m, btui_match_level_t *level, const uint32_t *src,
+                            size_t first, size_t last) {
+    size_t n = last - first;
+    if (n == 0) return 0;
+    if (level->count + n > level->cap) {
+        size_t cap = level->cap ? level->cap : 1024;
+        while (cap < level->count + n)
+            cap *= 2;
+        uint32_t *indices = realloc(level->indices, sizeof(uint32_t) * cap);
+        if (!indices) return -1;
+        level->indices = indices;
+        if (m->fuzzy) {
+            int32_t *scores = realloc(level->scores, sizeof(int32_t) * cap);
+            if (!scores) return -1;
+            level->scores = scores;
+        }
+        level->cap = cap;
+    }
+
+    int fold = 0;
+    if (m->fuzzy) { // Smart case: only a query with uppercase letters is case-sensitive
+        fold = 1;
+        for (size_t i = 0; i < level->query_len; i++) {
+            if ('A' <= level->query[i] && level->query[i] <= 'Z') fold = 0;
+        }
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t num_jobs = n / BTUI_MATCH_CHUNK + 1;
+    if (num_jobs > BTUI_MATCH_THREADS) num_jobs = BTUI_MATCH_THREADS;
+    if (cpus > 0 && num_jobs > (size_t)cpus) num_jobs = (size_t)cpus;
+
+    // Each job writes its matches into its own part of the free space, then
+    // they're moved together:
+    match_job_t jobs[BTUI_MATCH_THREADS];
+    pthread_t threads[BTUI_MATCH_THREADS];
+    int started[BTUI_MATCH_THREADS] = {0};
+    // Signals are handled by the main thread, so the workers block them all:
+    sigset_t all, old;
+    sigfillset(&all);
+    if (num_jobs > 1) pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (size_t t = 0; t < num_jobs; t++) {
+        size_t job_first = first + n * t / num_jobs;
+        size_t offset = level->count + (job_first - first);
+        jobs[t] = (match_job_t){
+            .m = m,
+            .src = src,
+            .first = job_first,
+            .last = first + n * (t + 1) / num_jobs,
+            .query = level->query,
+            .query_len = level->query_len,
+            .fuzzy = m->fuzzy,
+            .fold = fold,
+            .out = level->indices + offset,
+            .scores = m->fuzzy ? level->scores + offset : NULL,
+        };
+        if (t > 0) started[t] = pthread_create(&threads[t], NULL, run_match_job, &jobs[t]) == 0;
+    }
+    if (num_jobs > 1) pthread_sigmask(SIG_SETMASK, &old, NULL);
+    run_match_job(&jobs[0]);
+    for (size_t t = 1; t < num_jobs; t++) {
+        if (started[t]) pthread_join(threads[t], NULL);
+        else run_match_job(&jobs[t]);
+    }
+    for (size_t t = 0; t < num_jobs; t++) {
+        memmove(level->indices + level->count, jobs[t].out, sizeof(uint32_t) * jobs[t].count);
+        if (m->fuzzy)
+            memmove(level->scores + level->count, jobs[t].scores, sizeof(int32_t) * jobs[t].count);
+        level->count += jobs[t].count;
+    }
+    return 0;
+}
+
+/*
+ * Return the matcher with the given ID, or NULL if there isn't one.
+ */
+static btui_matcher_t *find_matcher(int id) {
+    return (id >= 1 && id <= BTUI_MAX_MATCHERS) ? matchers[id - 1] : NULL;
+}
+
+/*
+ * Free the last set of matches in a matcher's stack of queries.
+ */
+static void pop_match_level(btui_matcher_t *m) {
+    btui_match_level_t *level = &m->levels[--m->num_levels];
+    free(level->query);
+    free(level->indices);
+    free(level->scores);
+}
+
+// A fuzzy match and its score, for ranking (see rank_matches()):
+typedef struct {
+    int32_t score;
+    uint32_t index;
+} ranked_match_t;
+
+/*
+ * Return whether match `a` ranks worse than match `b` (a lower score, or the
+ * same score but later in the list of candidates).
+ */
+static inline int ranks_below(ranked_match_t a, ranked_match_t b) {
+    return a.score < b.score || (a.score == b.score && a.index > b.index);
+}
+
+/*
+ * Compare matches for qsort(), best first. (Helper method for rank_matches())
+ */
+static int compare_ranked(const void *va, const void *vb) {
+    ranked_match_t a = *(const ranked_match_t *)va, b = *(const ranked_match_t *)vb;
+    return ranks_below(a, b) ? 1 : (ranks_below(b, a) ? -1 : 0);
+}
+
+/*
+ * Put the best `limit` fuzzy matches of a level (or all of them, if `limit`
+ * is 0) into `m->best`, best first. Only the best `limit` are kept while
+ * looking, in a heap with the worst of them on top. Returns 0 on success or
+ * -1 on failure. (Helper method for btui_match())
+ */
+static int rank_matches(btui_matcher_t *m, const btui_match_level_t *level, size_t limit) {
+    size_t k = (limit == 0 || limit > level->count) ? level->count : limit;
+    ranked_match_t *heap = malloc(sizeof(ranked_match_t) * (k ? k : 1));
+    uint32_t *best = realloc(m->best, sizeof(uint32_t) * (k ? k : 1));
+    if (!heap || !best) {
+        free(heap);
+        if (best) m->best = best;
+        return -1;
+    }
+    m->best = best;
+    size_t n = 0;
+    for (size_t i = 0; i < level->count; i++) {
+        ranked_match_t match = {.score = level->scores[i], .index = level->indices[i]};
+        size_t pos;
+        if (n < k) {
+            // Sift up:
+            for (pos = n++; pos > 0 && ranks_below(match, heap[(pos - 1) / 2]); pos = (pos - 1) / 2)
+                heap[pos] = heap[(pos - 1) / 2];
+        } else if (ranks_below(heap[0], match)) {
+            // Replace the worst and sift down:
+            for (pos = 0; 2 * pos + 1 < n;) {
+                size_t child = 2 * pos + 1;
+                if (child + 1 < n && ranks_below(heap[child + 1], heap[child])) child++;
+                if (!ranks_below(heap[child], match)) break;
+                heap[pos] = heap[child];
+                pos = child;
+            }
+        } else {
+            continue;
+        }
+        heap[pos] = match;
+    }
+    qsort(heap, n, sizeof(ranked_match_t), compare_ranked);
+    for (size_t i = 0; i < n; i++)
+        m->best[i] = heap[i].index;
+    m->num_best = n;
+    free(heap);
+    return 0;
+}
+
+/*
+ * Set up the terminal that `bt.in` and `bt.out` were opened on. (Helper method
+ * for btui_init() and btui_init_headless())
+ */
+static void setup_terminal(void) {
+    if (bt.headless == BTUI_HEADLESS_MEMORY) memset(&normal_termios, 0, sizeof(normal_termios));
+    else if (tcgetattr(fileno(bt.in), &normal_termios)) err(1, "Couldn't get termios attributes");
+
+    memcpy(&tui_termios, &normal_termios, sizeof(tui_termios));
+    cfmakeraw(&tui_termios);
+
+    bt.mode = BTUI_MODE_DISABLED;
+    atexit(btui_disable);
+
+    close_resize_pipe();
+    if (pipe(resize_pipe) == 0) {
+        for (int i = 0; i < 2; i++) {
+            fcntl(resize_pipe[i], F_SETFL, fcntl(resize_pipe[i], F_GETFL) | O_NONBLOCK);
+            fcntl(resize_pipe[i], F_SETFD, FD_CLOEXEC);
+        }
+    }
+    struct sigaction sa_winch = {.sa_handler = &notify_resize};
+    sigaction(SIGWINCH, &sa_winch, NULL);
+    int signals[] = {SIGTERM, SIGINT,  SIGXCPU, SIGXFSZ, SIGVTALRM,
+                     SIGPROF, SIGSEGV, SIGTSTP, SIGPIPE};
+    struct sigaction sa = {.sa_handler = &btui_disable_and_raise,
+                           .sa_flags = (int)(SA_NODEFER | SA_RESETHAND)};
+    for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++)
+        sigaction(signals[i], &sa, NULL);
+
+    update_term_size();
+    bt.size_changed = 0;
+    bt.screen_x = bt.screen_y = -1;
+    // Terminals that don't support synchronized output ignore the mode, and
+    // ECH is supported by everything since the VT220. REP is newer, so it's
+    // only used on terminals known to have it. $COLORTERM is often missing
+    // (e.g. over SSH), so colors are sent as they are until the terminal says
+    // it can't show them (see btui_query()) or the program says so:
+    bt.caps = BTUI_CAP_SYNC_OUTPUT | BTUI_CAP_ECH | BTUI_CAP_SCROLL | BTUI_CAP_TRUECOLOR
+              | BTUI_CAP_256COLOR;
+    const char *term = getenv("TERM");
+    const char *modern[] = {"xterm", "tmux", "foot", "alacritty", "kitty", "wezterm", "contour"};
+    for (size_t i = 0; term && i < sizeof(modern) / sizeof(modern[0]); i++) {
+        if (strncmp(term, modern[i], strlen(modern[i])) == 0) bt.caps |= BTUI_CAP_REP;
+    }
+    const char *colorterm = getenv("COLORTERM");
+    if (colorterm && (strcmp(colorterm, "truecolor") == 0 || strcmp(colorterm, "24bit") == 0)) {
+        bt.term.truecolor = 1;
+        bt.term.answered |= BTUI_QUERY_TRUECOLOR;
+    }
+}
+
+
+// Public API functions:
+
+/*
+ * Add a timer for btui_wait_event() that fires after `delay_ns` nanoseconds,
+ * and then every `interval_ns` nanoseconds (if `interval_ns` is positive).
+ * Returns the timer's ID, or -1 if there are too many timers.
+ */
+int btui_add_timer(int64_t delay_ns, int64_t interval_ns) {
+    if (bt.num_timers >= BTUI_MAX_TIMERS) return -1;
+    int id = bt.next_timer_id++;
+    bt.timers[bt.num_timers++] = (btui_timer_t){
+        .id = id, .deadline = now_ns() + delay_ns, .interval = interval_ns};
+    return id;
+}
+
+/*
+ * Start a frame: until the matching btui_end_frame(), output is held back
+ * (including btui_flush()) so the whole frame is sent to the terminal in one
+ * write. Frames may be nested, and only the outermost one is sent. Returns the
+ * new nesting depth.
+ */
+int btui_begin_frame(void) {
+    if (bt.frame_depth++ == 0) {
+        bt.frame_start_ns = now_ns();
+        if (bt.caps & BTUI_CAP_SYNC_OUTPUT) output_control(T_ON(T_SYNC_OUTPUT));
+    }
+    return bt.frame_depth;
+}
+
+/*
+ * Cancel a timer created by btui_add_timer(). Returns 0 on success or -1 if
+ * there is no such timer.
+ */
+int btui_cancel_timer(int id) {
+    for (int i = 0; i < bt.num_timers; i++) {
+        if (bt.timers[i].id == id) {
+            bt.timers[i] = bt.timers[--bt.num_timers];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Return the output captured by a headless backend (see btui_init_headless())
+ * since it started or since btui_reset_captured_output(), and set *len to its
+ * length. Returns NULL if there is no headless backend. The output is not
+ * NUL-terminated.
+ */
+const char *btui_captured_output(size_t *len) {
+    if (!bt.headless) return NULL;
+    output_flush();
+    // Output written to a pty can take a moment to come out the other side:
+    if (bt.headless == BTUI_HEADLESS_PTY) capture_pty_output(5);
+    *len = bt.capture_len;
+    return bt.capture ? bt.capture : "";
+}
+
+/*
+ * Clear all or part of the screen. `mode` should be one of:
+ *   BTUI_CLEAR_(BELOW|ABOVE|SCREEN|RIGHT|LEFT|LINE)
+ */
+int btui_clear(int mode) {
+    if (bt.buffered) {
+        btui_cell_t blank = {.style = {0, BTUI_COLOR_DEFAULT, bt.pen.bg}, .ch = ' '};
+        int x = bt.cursor_x, y = bt.cursor_y, w = bt.canvas_width, h = bt.canvas_height;
+        switch (mode) {
+        case BTUI_CLEAR_BELOW:
+            buffer_fill(x, y, w - x, 1, blank);
+            buffer_fill(0, y + 1, w, h - (y + 1), blank);
+            return 0;
+        case BTUI_CLEAR_ABOVE:
+            buffer_fill(0, 0, w, y, blank);
+            buffer_fill(0, y, x + 1, 1, blank);
+            return 0;
+        case BTUI_CLEAR_SCREEN: buffer_fill(0, 0, w, h, blank); return 0;
+        case BTUI_CLEAR_RIGHT: buffer_fill(x, y, w - x, 1, blank); return 0;
+        case BTUI_CLEAR_LEFT: buffer_fill(0, y, x + 1, 1, blank); return 0;
+        case BTUI_CLEAR_LINE: buffer_fill(0, y, w, 1, blank); return 0;
+        default: return -1;
+        }
+    }
+    const char *sequence;
+    switch (mode) {
+    case BTUI_CLEAR_BELOW: sequence = "\033[J"; break;
+    case BTUI_CLEAR_ABOVE: sequence = "\033[1J"; break;
+    case BTUI_CLEAR_SCREEN: sequence = "\033[2J"; break;
+    case BTUI_CLEAR_RIGHT: sequence = "\033[K"; break;
+    case BTUI_CLEAR_LEFT: sequence = "\033[1K"; break;
+    case BTUI_CLEAR_LINE: sequence = "\033[2K"; break;
+    default: return -1;
+    }
+    bt.stats.escapes[BTUI_ESCAPE_ERASE] += 1;
+    return output_puts(sequence);
+}
+
+/*
+ * Disable TUI mode (return to the normal terminal with the normal terminal
+ * input handling).
+ */
+void btui_disable(void) {
+    if (!bt.out) return;
+    stop_input_thread(1);
+    if (bt.frame_depth > 0) {
+        bt.frame_depth = 0;
+        if (bt.caps & BTUI_CAP_SYNC_OUTPUT) output_control(T_OFF(T_SYNC_OUTPUT));
+    }
+    btui_set_buffered(0);
+    set_termios(&normal_termios);
+    btui_set_cursor(CURSOR_DEFAULT);
+    btui_set_mode(BTUI_MODE_UNINITIALIZED);
+    output_flush();
+    free_graphemes();
+    free(bt.output);
+    for (int i = 0; i < bt.num_queued_keys; i++)
+        free(bt.queued_keys[i].paste);
+    free(bt.paste);
+    fclose(bt.in);
+    fclose(bt.out);
+    close_headless();
+    close_resize_pipe();
+    memset(&bt, 0, sizeof(btui_t));
+}
+
+/*
+ * Draw a box using the special box-drawing characters at the given x,y
+ * position with the given width,height.
+ */
+void btui_draw_linebox(int x, int y, int w, int h) {
+    if (bt.buffered) {
+        btui_cell_t cell = {.style = bt.pen};
+        cell.ch = 0x2500; // ─
+        buffer_fill(x, y - 1, w, 1, cell);
+        buffer_fill(x, y + h, w, 1, cell);
+        cell.ch = 0x2502; // │
+        buffer_fill(x - 1, y, 1, h, cell);
+        buffer_fill(x + w, y, 1, h, cell);
+        cell.ch = 0x250C, buffer_fill(x - 1, y - 1, 1, 1, cell); // ┌
+        cell.ch = 0x2510, buffer_fill(x + w, y - 1, 1, 1, cell); // ┐
+        cell.ch = 0x2514, buffer_fill(x - 1, y + h, 1, 1, cell); // └
+        cell.ch = 0x2518, buffer_fill(x + w, y + h, 1, 1, cell); // ┘
+        return;
+    }
+    btui_move_cursor(x - 1, y - 1);
+    // Top row
+    output_control("\033(0");
+    output_putc('l');
+    advance_cursor(1);
+    output_run('q', w);
+    output_putc('k');
+    advance_cursor(1);
+    // Side walls
+    for (int i = 0; i < h; i++) {
+        btui_move_cursor(x - 1, y + i);
+        output_putc('x');
+        advance_cursor(1);
+        btui_move_cursor(x + w, y + i);
+        output_putc('x');
+        advance_cursor(1);
+    }
+    // Bottom row
+    btui_move_cursor(x - 1, y + h);
+    output_putc('m');
+    advance_cursor(1);
+    output_run('q', w);
+    output_putc('j');
+    output_control("\033(B");
+    advance_cursor(1);
+}
+
+/*
+ * Draw a shadow to the bottom right of the given box coordinates.
+ */
+void btui_draw_shadow(int x, int y, int w, int h) {
+    if (bt.buffered) {
+        btui_cell_t cell = {.style = bt.pen, .ch = 0x2592}; // ▒
+        buffer_fill(x + w, y + 1, 1, h - 1, cell);
+        buffer_fill(x + 1, y + h, w, 1, cell);
+        return;
+    }
+    output_control("\033(0");
+    for (int i = 0; i < h - 1; i++) {
+        btui_move_cursor(x + w, y + 1 + i);
+        output_putc('a');
+        advance_cursor(1);
+    }
+    btui_move_cursor(x + 1, y + h);
+    output_run('a', w);
+    output_control("\033(B");
+}
+
+/*
+ * Finish a frame started with btui_begin_frame(). When the outermost frame
+ * ends, all of its output is sent to the terminal at once. Returns 0 on
+ * success or EOF on failure.
+ */
+int btui_end_frame(void) {
+    if (bt.frame_depth == 0 || --bt.frame_depth > 0) return 0;
+    if (bt.buffered) buffer_flush();
+    if (bt.caps & BTUI_CAP_SYNC_OUTPUT) output_control(T_OFF(T_SYNC_OUTPUT));
+    int64_t render_end = now_ns();
+    int ret = output_flush();
+    finish_frame(render_end);
+    return ret;
+}
+
+/*
+ * Enable TUI mode for this terminal and return a pointer to the BTUI struct
+ * that should be passed to future API calls.
+ */
+void btui_init(void) {
+    bt.in = fopen("/dev/tty", "r");
+    if (!bt.in) err(1, "Couldn't open /dev/tty for reading");
+    bt.out = fopen("/dev/tty", "w");
+    if (!bt.out) err(1, "Couldn't open /dev/tty for writing");
+    setup_terminal();
+}
+
+/*
+ * Initialize BTUI without a real terminal, for tests and benchmarks. The
+ * terminal is `width` by `height` cells until btui_resize_headless(), and
+ * its input comes from btui_inject_input(). Everything written to it can be
+ * read back with btui_captured_output(). With BTUI_HEADLESS_MEMORY, output
+ * is copied into memory (and also written to /dev/null, so the system calls
+ * are like a real terminal's) and input goes through a pipe (so there are no
+ * termios settings). With BTUI_HEADLESS_PTY, BTUI runs on a pseudo-terminal,
+ * like it would on a real one. Returns 0 on success or -1 on failure
+ * (including when BTUI is already initialized).
+ */
+int btui_init_headless(int width, int height, int backend) {
+    if (bt.out || width <= 0 || height <= 0) return -1;
+    int in_fd, out_fd, inject_fd, fds[2];
+    if (backend == BTUI_HEADLESS_MEMORY) {
+        if (pipe(fds) != 0) return -1;
+        in_fd = fds[0], inject_fd = fds[1];
+#ifdef F_SETPIPE_SZ
+        fcntl(inject_fd, F_SETPIPE_SZ, 1 << 20);
+#endif
+        out_fd = open("/dev/null", O_WRONLY);
+    } else if (backend == BTUI_HEADLESS_PTY) {
+        inject_fd = posix_openpt(O_RDWR | O_NOCTTY);
+        if (inject_fd < 0) return -1;
+        const char *name = (grantpt(inject_fd) == 0 && unlockpt(inject_fd) == 0) ? ptsname(inject_fd) : NULL;
+        in_fd = name ? open(name, O_RDWR | O_NOCTTY) : -1;
+        struct winsize winsize = {.ws_row = (unsigned short)height, .ws_col = (unsigned short)width};
+        if (in_fd >= 0) ioctl(inject_fd, TIOCSWINSZ, &winsize);
+        out_fd = in_fd >= 0 ? dup(in_fd) : -1;
+    } else {
+        return -1;
+    }
+    if (out_fd >= 0) {
+        bt.in = fdopen(in_fd, "r");
+        bt.out = bt.in ? fdopen(out_fd, "w") : NULL;
+    }
+    if (!bt.out) {
+        if (bt.in) fclose(bt.in);
+        else if (in_fd >= 0) close(in_fd);
+        if (out_fd >= 0) close(out_fd);
+        close(inject_fd);
+        bt.in = NULL;
+        return -1;
+    }
+    fcntl(in_fd, F_SETFD, FD_CLOEXEC);
+    fcntl(out_fd, F_SETFD, FD_CLOEXEC);
+    fcntl(inject_fd, F_SETFD, FD_CLOEXEC);
+    fcntl(inject_fd, F_SETFL, fcntl(inject_fd, F_GETFL) | O_NONBLOCK);
+    bt.headless = backend;
+    bt.inject_fd = inject_fd;
+    bt.width = width;
+    bt.height = height;
+    setup_terminal();
+    return 0;
+}
+
+/*
+ * Feed bytes to a headless backend's input, as if they were typed (or sent by
+ * the terminal). Returns the number of bytes accepted, which is less than
+ * `len` if the pipe or pty is full (until some input is read), or -1 on
+ * failure.
+ */
+int btui_inject_input(const char *bytes, size_t len) {
+    if (!bt.headless) return -1;
+    size_t written = 0;
+    while (written < len) {
+        ssize_t n = write(bt.inject_fd, bytes + written, len - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        written += (size_t)n;
+    }
+    return (written > 0 || len == 0) ? (int)written : -1;
+}
+
+/*
+ * Set the display mode of BTUI
+ */
+void btui_set_mode(btui_mode_t mode) {
+    if (mode == bt.mode) return;
+
+    if (bt.mode == BTUI_MODE_UNINITIALIZED) btui_init();
+
+    if (mode == BTUI_MODE_NORMAL || mode == BTUI_MODE_TUI) {
+        if (set_termios(&tui_termios)) errx(1, "Failed to set attr");
+    }
+
+    switch (mode) {
+    case BTUI_MODE_UNINITIALIZED:
+    case BTUI_MODE_NORMAL:
+    case BTUI_MODE_DISABLED:
+        if (bt.mode == BTUI_MODE_TUI) output_control(T_OFF(T_ALT_SCREEN));
+        output_control(T_ON(T_SHOW_CURSOR ";" T_WRAP) T_OFF(
+            T_MOUSE_XY ";" T_MOUSE_CELL ";" T_MOUSE_SGR ";" T_BRACKETED_PASTE) "\033[0m");
+        break;
+    case BTUI_MODE_TUI:
+        output_control(T_OFF(T_SHOW_CURSOR ";" T_WRAP) T_ON(T_ALT_SCREEN ";" T_MOUSE_XY ";" T_MOUSE_CELL
+                                                         ";" T_MOUSE_SGR ";" T_BRACKETED_PASTE) "\033[0m");
+        break;
+    default: break;
+    }
+    output_flush();
+    bt.mode = mode;
+    bt.term_style = blank_cell.style;
+    bt.style_known = 1;
+    bt.screen_x = bt.screen_y = -1;
+}
+
+/*
+ * Fill the given rectangular area (x,y coordinates and width,height) with
+ * spaces, leaving the cursor just past the end of the bottom row.
+ */
+void btui_fill_box(int x, int y, int w, int h) {
+    if (bt.buffered) {
+        buffer_fill(x, y, w, h, (btui_cell_t){.style = bt.pen, .ch = ' '});
+        return;
+    }
+    // Only the part of the box that's on the screen is filled (cursor moves
+    // would be clamped to the screen's edges, filling the wrong cells):
+    if (x < 0) w += x, x = 0;
+    if (y < 0) h += y, y = 0;
+    if (bt.width > 0 && x + w > bt.width) w = bt.width - x;
+    if (bt.height > 0 && y + h > bt.height) h = bt.height - y;
+    if (w <= 0 || h <= 0) return;
+    for (int row = y; row < y + h; row++) {
+        btui_move_cursor(x, row);
+        output_run(' ', w);
+    }
+    // Erasing with ECH leaves the cursor at the start of the row, unlike
+    // writing the spaces out:
+    if (bt.screen_x == x && bt.screen_y == y + h - 1)
+        btui_move_cursor(x + w < bt.width ? x + w : bt.width - 1, y + h - 1);
+}
+
+/*
+ * Flush BTUI's output. In buffered mode, this first sends all the cells that
+ * have changed since the last flush. Inside a frame, this does nothing (the
+ * output is sent by btui_end_frame()).
+ */
+int btui_flush(void) {
+    if (bt.frame_depth > 0) return 0;
+    bt.frame_start_ns = now_ns();
+    if (bt.buffered) buffer_flush();
+    if (bt.output_len == 0 && bt.num_spans == 0) return 0;
+    int64_t render_end = now_ns();
+    int ret = output_flush();
+    finish_frame(render_end);
+    return ret;
+}
+
+/*
+ * Close BTUI files and prevent cleaning up (useful for fork/exec)
+ */
+void btui_force_close(void) {
+    if (!bt.out) return;
+    // After a fork, the input thread only exists in the parent:
+    stop_input_thread(0);
+    free_surfaces();
+    free(bt.front);
+    free(bt.back);
+    free(bt.row_hashes);
+    free_graphemes();
+    free(bt.output);
+    for (int i = 0; i < bt.num_queued_keys; i++)
+        free(bt.queued_keys[i].paste);
+    free(bt.paste);
+    fclose(bt.in);
+    fclose(bt.out);
+    close_headless();
+    close_resize_pipe();
+    memset(&bt, 0, sizeof(btui_t));
+}
+
+/*
+ * Format text (like printf()) into BTUI's output buffer.
+ */
+int btui_format(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    char *buf = output_reserve(256);
+    int len = vsnprintf(buf, 256, fmt, args);
+    va_end(args);
+    if (len < 0) return len;
+    if (len >= 256) {
+        buf = output_reserve((size_t)len + 1);
+        va_start(args, fmt);
+        vsnprintf(buf, (size_t)len + 1, fmt, args);
+        va_end(args);
+    }
+    if (memchr(buf, '\033', (size_t)len)) bt.style_known = 0;
+    track_text(buf);
+    return output_commit(buf + len);
+}
+
+/*
+ * Read the text of a bracketed paste (after its "\033[200~") into bt.paste,
+ * up to the closing "\033[201~". Input is copied a buffer-full at a time
+ * rather than decoded byte by byte. If the closing sequence doesn't arrive
+ * within BTUI_PASTE_TIMEOUT, whatever was received is used. (Helper method for
+ * read_key())
+ */
+static void read_paste(int fd) {
+    static const char end_marker[] = "\033[201~";
+    const size_t marker_len = sizeof(end_marker) - 1;
+    bt.paste_len = 0;
+    for (;;) {
+        while (bt.input_start != bt.input_end) {
+            // Copy the contiguous part of the ring buffer:
+            size_t start = bt.input_start & (BTUI_INPUT_BUFSIZE - 1);
+            size_t n = bt.input_end - bt.input_start;
+            if (n > BTUI_INPUT_BUFSIZE - start) n = BTUI_INPUT_BUFSIZE - start;
+            if (bt.paste_len + n > bt.paste_cap) {
+                size_t cap = bt.paste_cap ? 2 * bt.paste_cap : BTUI_INPUT_BUFSIZE;
+                while (cap < bt.paste_len + n)
+                    cap *= 2;
+                char *paste = realloc(bt.paste, cap);
+                if (!paste) err(1, "Couldn't allocate memory for pasted text");
+                bt.paste = paste, bt.paste_cap = cap;
+            }
+            size_t searched = bt.paste_len > marker_len ? bt.paste_len - marker_len : 0;
+            memcpy(&bt.paste[bt.paste_len], &bt.input[start], n);
+            bt.paste_len += n;
+            bt.input_start += n;
+            const char *marker = &bt.paste[searched], *paste_end = &bt.paste[bt.paste_len];
+            while ((marker = memchr(marker, '\033', (size_t)(paste_end - marker)))
+                   && ((size_t)(paste_end - marker) < marker_len
+                       || memcmp(marker, end_marker, marker_len) != 0))
+                marker++;
+            if (marker && (size_t)(paste_end - marker) >= marker_len) {
+                // Put back anything that came after the paste:
+                size_t end = (size_t)(marker - bt.paste) + marker_len;
+                bt.input_start -= bt.paste_len - end;
+                bt.paste_len = (size_t)(marker - bt.paste);
+                return;
+            }
+        }
+        if (wait_input(fd, (int64_t)BTUI_PASTE_TIMEOUT * 1000000, 0) <= 0 || fill_input(fd) <= 0)
+            return;
+    }
+}
+
+/*
+ * Return a copy of the text of the last paste (NULL if it's empty or there's
+ * no memory for it), for keeping with a key that is read later.
+ */
+static char *copy_paste(void) {
+    if (bt.paste_len == 0) return NULL;
+    char *copy = malloc(bt.paste_len);
+    if (copy) memcpy(copy, bt.paste, bt.paste_len);
+    return copy;
+}
+
+/*
+ * If the input buffer starts with a complete SGR mouse report for a drag or
+ * mouse wheel event, return its button code and set *x, *y and *len to its
+ * (1-indexed) position and length in bytes. Otherwise return -1 and set them
+ * to 0. Nothing is consumed and no input is read. (Helper method for
+ * read_key())
+ */
+static int peek_mouse_motion(int *x, int *y, size_t *len) {
+    *x = *y = 0, *len = 0;
+    size_t start = bt.input_start, i = start;
+    const char *prefix = "\033[<";
+    for (; *prefix; prefix++, i++) {
+        if (i == bt.input_end || bt.input[i & (BTUI_INPUT_BUFSIZE - 1)] != *prefix) return -1;
+    }
+    int nums[3] = {0, 0, 0}, n = 0;
+    for (; i != bt.input_end; i++) {
+        char c = bt.input[i & (BTUI_INPUT_BUFSIZE - 1)];
+        if ('0' <= c && c <= '9') {
+            nums[n] = 10 * nums[n] + (c - '0');
+        } else if (c == ';' && n < 2) {
+            n++;
+        } else if (c == 'M' && n == 2 && (nums[0] & (32 | 64))) {
+            *x = nums[1], *y = nums[2], *len = i + 1 - start;
+            return nums[0];
+        } else {
+            return -1;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Classify a byte of input for the parser's transition table.
+ */
+static inline byte_class_t byte_class(unsigned char c) {
+    if (c >= 0x80) return BYTE_HIGH;
+    if (c >= 0x40) return c == 0x7F ? BYTE_DEL : BYTE_FINAL;
+    if (c >= 0x3C) return BYTE_MARKER;
+    if (c >= 0x30) return c <= '9' ? BYTE_DIGIT : BYTE_SEPARATOR;
+    if (c >= 0x20) return BYTE_INTERMEDIATE;
+    return c == '\x1b' ? BYTE_ESC : (c == '\a' ? BYTE_BEL : BYTE_CONTROL);
+}
+
+// The parser's transitions: for each state and class of byte, what to do with
+// the byte and which state to go to next. (Dispatch actions may override the
+// next state, e.g. ESC '[' goes on to PARSE_CSI)
+static const struct {
+    uint8_t action, next;
+} parse_table[NUM_PARSE_STATES][NUM_BYTE_CLASSES] = {
+    [PARSE_GROUND] = {
+        [BYTE_CONTROL] = {ACT_PRINT, PARSE_GROUND},
+        [BYTE_BEL] = {ACT_PRINT, PARSE_GROUND},
+        [BYTE_ESC] = {ACT_NONE, PARSE_ESCAPE},
+        [BYTE_INTERMEDIATE] = {ACT_PRINT, PARSE_GROUND},
+        [BYTE_DIGIT] = {ACT_PRINT, PARSE_GROUND},
+        [BYTE_SEPARATOR] = {ACT_PRINT, PARSE_GROUND},
+        [BYTE_MARKER] = {ACT_PRINT, PARSE_GROUND},
+        [BYTE_FINAL] = {ACT_PRINT, PARSE_GROUND},
+        [BYTE_DEL] = {ACT_PRINT, PARSE_GROUND},
+        [BYTE_HIGH] = {ACT_PRINT, PARSE_GROUND},
+    },
+    [PARSE_ESCAPE] = {
+        [BYTE_CONTROL] = {ACT_ESC_DISPATCH, PARSE_GROUND},
+        [BYTE_BEL] = {ACT_ESC_DISPATCH, PARSE_GROUND},
+        [BYTE_ESC] = {ACT_ESC_KEY, PARSE_GROUND},
+        [BYTE_INTERMEDIATE] = {ACT_ESC_DISPATCH, PARSE_GROUND},
+        [BYTE_DIGIT] = {ACT_ESC_DISPATCH, PARSE_GROUND},
+        [BYTE_SEPARATOR] = {ACT_ESC_DISPATCH, PARSE_GROUND},
+        [BYTE_MARKER] = {ACT_ESC_DISPATCH, PARSE_GROUND},
+        [BYTE_FINAL] = {ACT_ESC_DISPATCH, PARSE_GROUND},
+        [BYTE_DEL] = {ACT_ESC_DISPATCH, PARSE_GROUND},
+        [BYTE_HIGH] = {ACT_ESC_DISPATCH, PARSE_GROUND},
+    },
+    [PARSE_CSI] = {
+        [BYTE_CONTROL] = {ACT_NONE, PARSE_CSI},
+        [BYTE_BEL] = {ACT_NONE, PARSE_CSI},
+        [BYTE_ESC] = {ACT_NONE, PARSE_ESCAPE},
+        [BYTE_INTERMEDIATE] = {ACT_INTERMEDIATE, PARSE_CSI},
+        [BYTE_DIGIT] = {ACT_PARAM, PARSE_CSI},
+        [BYTE_SEPARATOR] = {ACT_SEPARATOR, PARSE_CSI},
+        [BYTE_MARKER] = {ACT_MARKER, PARSE_CSI},
+        [BYTE_FINAL] = {ACT_CSI_DISPATCH, PARSE_GROUND},
+        [BYTE_DEL] = {ACT_NONE, PARSE_CSI},
+        [BYTE_HIGH] = {ACT_NONE, PARSE_CSI_IGNORE},
+    },
+    [PARSE_CSI_IGNORE] = {
+        [BYTE_CONTROL] = {ACT_NONE, PARSE_CSI_IGNORE},
+        [BYTE_BEL] = {ACT_NONE, PARSE_CSI_IGNORE},
+        [BYTE_ESC] = {ACT_NONE, PARSE_ESCAPE},
+        [BYTE_INTERMEDIATE] = {ACT_NONE, PARSE_CSI_IGNORE},
+        [BYTE_DIGIT] = {ACT_NONE, PARSE_CSI_IGNORE},
+        [BYTE_SEPARATOR] = {ACT_NONE, PARSE_CSI_IGNORE},
+        [BYTE_MARKER] = {ACT_NONE, PARSE_CSI_IGNORE},
+        [BYTE_FINAL] = {ACT_NONE, PARSE_GROUND},
+        [BYTE_DEL] = {ACT_NONE, PARSE_CSI_IGNORE},
+        [BYTE_HIGH] = {ACT_NONE, PARSE_CSI_IGNORE},
+    },
+    [PARSE_SS3] = {
+        [BYTE_CONTROL] = {ACT_NONE, PARSE_GROUND},
+        [BYTE_BEL] = {ACT_NONE, PARSE_GROUND},
+        [BYTE_ESC] = {ACT_NONE, PARSE_ESCAPE},
+        [BYTE_INTERMEDIATE] = {ACT_NONE, PARSE_GROUND},
+        [BYTE_DIGIT] = {ACT_PARAM, PARSE_SS3},
+        [BYTE_SEPARATOR] = {ACT_NONE, PARSE_GROUND},
+        [BYTE_MARKER] = {ACT_NONE, PARSE_GROUND},
+        [BYTE_FINAL] = {ACT_SS3_DISPATCH, PARSE_GROUND},
+        [BYTE_DEL] = {ACT_NONE, PARSE_GROUND},
+        [BYTE_HIGH] = {ACT_NONE, PARSE_GROUND},
+    },
+    [PARSE_STRING] = {
+        [BYTE_CONTROL] = {ACT_STRING_PUT, PARSE_STRING},
+        [BYTE_BEL] = {ACT_STRING_END, PARSE_GROUND},
+        [BYTE_ESC] = {ACT_NONE, PARSE_STRING_ESCAPE},
+        [BYTE_INTERMEDIATE] = {ACT_STRING_PUT, PARSE_STRING},
+        [BYTE_DIGIT] = {ACT_STRING_PUT, PARSE_STRING},
+        [BYTE_SEPARATOR] = {ACT_STRING_PUT, PARSE_STRING},
+        [BYTE_MARKER] = {ACT_STRING_PUT, PARSE_STRING},
+        [BYTE_FINAL] = {ACT_STRING_PUT, PARSE_STRING},
+        [BYTE_DEL] = {ACT_STRING_PUT, PARSE_STRING},
+        [BYTE_HIGH] = {ACT_STRING_PUT, PARSE_STRING},
+    },
+    // ESC '\' (ST) ends a string. Any other byte also ends it, and is then
+    // handled as if it came after an ESC.
+    [PARSE_STRING_ESCAPE] = {
+        [BYTE_CONTROL] = {ACT_STRING_END_ESC, PARSE_GROUND},
+        [BYTE_BEL] = {ACT_STRING_END_ESC, PARSE_GROUND},
+        [BYTE_ESC] = {ACT_STRING_END_ESC, PARSE_GROUND},
+        [BYTE_INTERMEDIATE] = {ACT_STRING_END_ESC, PARSE_GROUND},
+        [BYTE_DIGIT] = {ACT_STRING_END_ESC, PARSE_GROUND},
+        [BYTE_SEPARATOR] = {ACT_STRING_END_ESC, PARSE_GROUND},
+        [BYTE_MARKER] = {ACT_STRING_END_ESC, PARSE_GROUND},
+        [BYTE_FINAL] = {ACT_STRING_END_ESC, PARSE_GROUND},
+        [BYTE_DEL] = {ACT_STRING_END_ESC, PARSE_GROUND},
+        [BYTE_HIGH] = {ACT_STRING_END_ESC, PARSE_GROUND},
+    },
+};
+
+/*
+ * Convert an xterm-style modifier parameter (1 + a bitmask of shift, alt, ctrl
+ * and meta) to BTUI modifiers.
+ */
+static inline int decode_modifiers(int param) {
+    if (param <= 1) return 0;
+    int bits = param - 1, modifiers = 0;
+    if (bits & 1) modifiers |= MOD_SHIFT;
+    if (bits & 2) modifiers |= MOD_ALT;
+    if (bits & 4) modifiers |= MOD_CTRL;
+    if (bits & 8) modifiers |= MOD_META;
+    return modifiers;
+}
+
+/*
+ * Convert a key reported as a Unicode codepoint plus modifiers (by the kitty
+ * keyboard protocol or xterm's modifyOtherKeys) to a BTUI key, the way the
+ * same key would be reported without those protocols. Returns -1 for keys
+ * BTUI doesn't represent.
+ */
+static int codepoint_key(int cp, int modifiers) {
+    switch (cp) {
+    case 9: return modifiers | KEY_TAB;
+    case 13: case 57414: return modifiers | KEY_ENTER;
+    case 27: return modifiers | KEY_ESC;
+    case 127: return modifiers | KEY_BACKSPACE2;
+    default: break;
+    }
+    if (57399 <= cp && cp <= 57408) cp = '0' + (cp - 57399); // Keypad digits
+    if (cp < ' ' || cp >= 0x7F) return -1;
+    if ((modifiers & MOD_SHIFT) && 'a' <= cp && cp <= 'z') {
+        cp += 'A' - 'a';
+        modifiers &= ~MOD_SHIFT;
+    }
+    if ((modifiers & MOD_CTRL) && ('a' <= cp && cp <= 'z')) {
+        cp = KEY_CTRL_A + (cp - 'a');
+        modifiers &= ~MOD_CTRL;
+    }
+    return modifiers | cp;
+}
+
+/*
+ * Turn a mouse button code and position from an SGR mouse report into a key,
+ * setting *mouse_x and *mouse_y. (Helper method for csi_dispatch())
+ */
+static int mouse_key(int buttons, int x, int y, int release, int *mouse_x, int *mouse_y) {
+    // Skip ahead to the newest of a run of identical drag/wheel reports
+    // that are already buffered (presses and releases never match):
+    if (__atomic_load_n(&bt.coalesce_mouse, __ATOMIC_RELAXED) && !release && (buttons & (32 | 64))) {
+        int next_x, next_y;
+        size_t len;
+        while (peek_mouse_motion(&next_x, &next_y, &len) == buttons) {
+            bt.input_start += len;
+            x = next_x, y = next_y;
+            bt.key_count += 1;
+        }
+    }
+
+    if (mouse_x) *mouse_x = x - 1;
+    if (mouse_y) *mouse_y = y - 1;
+
+    int modifiers = 0;
+    if (buttons & 4) modifiers |= MOD_SHIFT;
+    if (buttons & 8) modifiers |= MOD_META;
+    if (buttons & 16) modifiers |= MOD_CTRL;
+    int key = -1;
+    switch (buttons & ~(4 | 8 | 16)) {
+    case 0: key = release ? MOUSE_LEFT_RELEASE : MOUSE_LEFT_PRESS; break;
+    case 1: key = release ? MOUSE_MIDDLE_RELEASE : MOUSE_MIDDLE_PRESS; break;
+    case 2: key = release ? MOUSE_RIGHT_RELEASE : MOUSE_RIGHT_PRESS; break;
+    case 32: key = MOUSE_LEFT_DRAG; break;
+    case 33: key = MOUSE_MIDDLE_DRAG; break;
+    case 34: key = MOUSE_RIGHT_DRAG; break;
+    case 64: key = MOUSE_WHEEL_RELEASE; break;
+    case 65: key = MOUSE_WHEEL_PRESS; break;
+    default: return -1;
+    }
+    if (key == MOUSE_LEFT_RELEASE || key == MOUSE_RIGHT_RELEASE || key == MOUSE_MIDDLE_RELEASE) {
+        // Clicks are timed by when their input arrived, not when it's decoded:
+        int64_t click_ns = bt.input_ns;
+        if (key == bt.last_click
+            && click_ns - bt.last_click_ns < (int64_t)BTUI_DOUBLECLICK_THRESHOLD * 1000000) {
+            switch (key) {
+            case MOUSE_LEFT_RELEASE: key = MOUSE_LEFT_DOUBLE; break;
+            case MOUSE_RIGHT_RELEASE: key = MOUSE_RIGHT_DOUBLE; break;
+            case MOUSE_MIDDLE_RELEASE: key = MOUSE_MIDDLE_DOUBLE; break;
+            default: break;
+            }
+        }
+        bt.last_click_ns = click_ns;
+        bt.last_click = key;
+    }
+    return modifiers | key;
+}
 
+/*
+ * Handle the final byte of an escape sequence that starts with ESC. Returns a
+ * key, or -1 if the sequence continues (or isn't a key).
+ */
+static int esc_dispatch(unsigned char c) {
+    btui_parser_t *p = &bt.parser;
     switch (c) {
-    case '\x1b': return KEY_ESC;
-    case '[': c = nextchar(fd); goto CSI_start;
-    case 'P': goto DCS;
-    case 'O': goto SS3;
+    case '[':
+    case 'O':
+        p->state = c == '[' ? PARSE_CSI : PARSE_SS3;
+        p->prefix = p->intermediate = 0;
+        p->nparams = 0;
+        p->in_subparam = 0;
+        return -1;
+    case 'P': // DCS
+    case ']': // OSC
+    case '_': // APC
+    case '^': // PM
+    case 'X': // SOS
+        p->state = PARSE_STRING;
+        p->string_kind = (char)c;
+        p->string_len = 0;
+        return -1;
     default: return MOD_ALT | c;
     }
+}
 
-CSI_start:
-    if (c == -1) return MOD_ALT | '[';
+/*
+ * Parse a color from an OSC 10/11 reply ("rgb:RRRR/GGGG/BBBB", with 1-4 hex
+ * digits per channel, "rgba:..." or "#RRGGBB") into 0xRRGGBB. Returns 0 on
+ * success or -1 if it isn't a color.
+ */
+static int parse_color_reply(const char *str, uint32_t *rgb) {
+    *rgb = 0;
+    if (str[0] == '#') {
+        char *end;
+        unsigned long hex = strtoul(str + 1, &end, 16);
+        if (end != str + 7) return -1;
+        *rgb = (uint32_t)hex;
+        return 0;
+    }
+    if (strncmp(str, "rgb:", 4) == 0) str += 4;
+    else if (strncmp(str, "rgba:", 5) == 0) str += 5;
+    else return -1;
+    for (int channel = 0; channel < 3; channel++) {
+        char *end;
+        unsigned long value = strtoul(str, &end, 16);
+        int digits = (int)(end - str);
+        if (digits < 1 || digits > 4 || (channel < 2 && *end != '/')) return -1;
+        unsigned long max = (1ul << (4 * digits)) - 1;
+        *rgb = (*rgb << 8) | (uint32_t)((value * 255 + max / 2) / max);
+        str = end + 1;
+    }
+    return 0;
+}
 
-    switch (c) {
+/*
+ * Record the answer to a query, and when the DA1 reply that ends a batch of
+ * queries arrives, mark the rest of the batch as unsupported.
+ */
+static void answer_query(int query) {
+    bt.term.answered |= query;
+    bt.term.unsupported &= ~query;
+    bt.term.pending &= ~query;
+    if (query == BTUI_QUERY_DEVICE_ATTRS && bt.term.sentinels > 0 && --bt.term.sentinels == 0) {
+        bt.term.unsupported |= bt.term.pending;
+        bt.term.pending = 0;
+    }
+}
+
+/*
+ * Handle a control sequence that is a reply to a query (DA1, CPR or DECRPM).
+ * (Helper method for csi_dispatch())
+ */
+static void csi_reply(unsigned char final) {
+    btui_parser_t *p = &bt.parser;
+    if (final == 'c' && p->prefix == '?' && !p->intermediate) {
+        bt.term.num_device_attrs = p->nparams;
+        memcpy(bt.term.device_attrs, p->params, (size_t)p->nparams * sizeof(p->params[0]));
+        answer_query(BTUI_QUERY_DEVICE_ATTRS);
+    } else if (final == 'R' && !p->prefix && p->nparams == 2) {
+        bt.term.cursor_y = p->params[0] - 1;
+        bt.term.cursor_x = p->params[1] - 1;
+        answer_query(BTUI_QUERY_CURSOR);
+    } else if (final == 'y' && p->prefix == '?' && p->intermediate == '$' && p->nparams == 2
+               && p->params[0] == 2026) {
+        bt.term.sync_output = p->params[1];
+        __atomic_fetch_or(&bt.unapplied_replies, BTUI_QUERY_SYNC_OUTPUT, __ATOMIC_RELEASE);
+        answer_query(BTUI_QUERY_SYNC_OUTPUT);
+    }
+}
+
+/*
+ * Handle the final byte of a control sequence (CSI) and return the key it
+ * represents, or -1 if it isn't a key.
+ */
+static int csi_dispatch(unsigned char final, int *mouse_x, int *mouse_y) {
+    btui_parser_t *p = &bt.parser;
+    int numcode = p->nparams > 0 ? p->params[0] : 0;
+    int modifiers = p->nparams > 1 ? decode_modifiers(p->params[1]) : 0;
+    if (p->prefix == '<') {
+        if ((final != 'M' && final != 'm') || p->nparams < 3) return -1;
+        return mouse_key(p->params[0], p->params[1], p->params[2], final == 'm', mouse_x,
+                         mouse_y);
+    }
+    // Other private sequences and ones with intermediate bytes are replies to
+    // queries, not keys. A cursor position report looks like F3 with
+    // modifiers, so it's only taken as one while it's expected:
+    if (p->prefix || p->intermediate) {
+        csi_reply(final);
+        return -1;
+    } else if (final == 'R' && (bt.term.pending & BTUI_QUERY_CURSOR) && p->nparams == 2) {
+        csi_reply(final);
+        return -1;
+    }
+    // Key release events from the kitty keyboard protocol:
+    if (p->nparams > 1 && p->subparams[1] == 3) return -1;
+
+    switch (final) {
     case 'A': return modifiers | KEY_ARROW_UP;
     case 'B': return modifiers | KEY_ARROW_DOWN;
     case 'C': return modifiers | KEY_ARROW_RIGHT;
@@ -652,6 +3684,7 @@ CSI_start:
     case 'R': return numcode == 1 ? (modifiers | KEY_F3) : -1;
     case 'S': return numcode == 1 ? (modifiers | KEY_F4) : -1;
     case 'Z': return MOD_SHIFT | modifiers | (int)KEY_TAB;
+    case 'u': return codepoint_key(numcode, modifiers); // kitty keyboard protocol
     case '~':
         switch (numcode) {
         case 1: return modifiers | KEY_HOME;
@@ -675,84 +3708,477 @@ CSI_start:
         case 21: return modifiers | KEY_F10;
         case 23: return modifiers | KEY_F11;
         case 24: return modifiers | KEY_F12;
-        default: break;
+        case 27: // xterm's modifyOtherKeys
+            return p->nparams > 2 ? codepoint_key(p->params[2], modifiers) : -1;
+        case 200: return PASTE_EVENT;
+        default: return -1;
         }
-        return -1;
-    case '<': { // Mouse clicks
-        int buttons = nextnum(fd, &c);
-        if (c != ';') return -1;
-        int x = nextnum(fd, &c);
-        if (c != ';') return -1;
-        int y = nextnum(fd, &c);
-        if (c != 'm' && c != 'M') return -1;
-
-        if (mouse_x) *mouse_x = x - 1;
-        if (mouse_y) *mouse_y = y - 1;
-
-        if (buttons & 4) modifiers |= MOD_SHIFT;
-        if (buttons & 8) modifiers |= MOD_META;
-        if (buttons & 16) modifiers |= MOD_CTRL;
+    default: return -1;
+    }
+}
+
+/*
+ * Handle the final byte of a single shift 3 (ESC O) sequence.
+ */
+static int ss3_dispatch(unsigned char final) {
+    btui_parser_t *p = &bt.parser;
+    int modifiers = p->nparams > 0 ? decode_modifiers(p->params[0]) : 0;
+    switch (final) {
+    case 'A': return modifiers | KEY_ARROW_UP;
+    case 'B': return modifiers | KEY_ARROW_DOWN;
+    case 'C': return modifiers | KEY_ARROW_RIGHT;
+    case 'D': return modifiers | KEY_ARROW_LEFT;
+    case 'F': return modifiers | KEY_END;
+    case 'H': return modifiers | KEY_HOME;
+    case 'M': return modifiers | KEY_ENTER;
+    case 'P': return modifiers | KEY_F1;
+    case 'Q': return modifiers | KEY_F2;
+    case 'R': return modifiers | KEY_F3;
+    case 'S': return modifiers | KEY_F4;
+    default: return -1;
+    }
+}
+
+/*
+ * Handle a complete control string (OSC, DCS, etc.), which is in
+ * bt.parser.string. None of these are keys, but some are replies to queries:
+ * OSC 10/11 colors and the DECRQSS reply used to detect truecolor support.
+ */
+static void string_dispatch(void) {
+    btui_parser_t *p = &bt.parser;
+    if (p->string_kind == ']' && (strncmp(p->string, "10;", 3) == 0 || strncmp(p->string, "11;", 3) == 0)) {
+        int is_bg = p->string[1] == '1';
+        if (parse_color_reply(&p->string[3], is_bg ? &bt.term.bg : &bt.term.fg) == 0)
+            answer_query(is_bg ? BTUI_QUERY_BG : BTUI_QUERY_FG);
+    } else if (p->string_kind == 'P' && (bt.term.pending & BTUI_QUERY_TRUECOLOR)
+               && strncmp(p->string + 1, "$r", 2) == 0) {
+        // The reply to asking for the SGR after setting the color 1,2,3 says
+        // whether the terminal kept the exact color:
+        bt.term.truecolor = p->string[0] == '1'
+                            && (strstr(p->string, "2:1:2:3") || strstr(p->string, "2::1:2:3")
+                                || strstr(p->string, "2;1;2;3"));
+        __atomic_fetch_or(&bt.unapplied_replies, BTUI_QUERY_TRUECOLOR, __ATOMIC_RELEASE);
+        answer_query(BTUI_QUERY_TRUECOLOR);
+    }
+}
+
+/*
+ * Run the input parser over the bytes in the input buffer until it finishes a
+ * key, which is returned (or -1 for bytes that decode to -1, as the 0xFF byte
+ * does). If the buffer runs out first, PARSE_INCOMPLETE is returned and the
+ * parser's state is kept, so parsing picks up where it left off once more
+ * input arrives. This never reads any input itself.
+ */
+static int parse_input(int *mouse_x, int *mouse_y) {
+    btui_parser_t *p = &bt.parser;
+    while (bt.input_start != bt.input_end) {
+        unsigned char c = (unsigned char)bt.input[bt.input_start++ & (BTUI_INPUT_BUFSIZE - 1)];
         int key = -1;
-        switch (buttons & ~(4 | 8 | 16)) {
-        case 0: key = c == 'm' ? MOUSE_LEFT_RELEASE : MOUSE_LEFT_PRESS; break;
-        case 1: key = c == 'm' ? MOUSE_MIDDLE_RELEASE : MOUSE_MIDDLE_PRESS; break;
-        case 2: key = c == 'm' ? MOUSE_RIGHT_RELEASE : MOUSE_RIGHT_PRESS; break;
-        case 32: key = MOUSE_LEFT_DRAG; break;
-        case 33: key = MOUSE_MIDDLE_DRAG; break;
-        case 34: key = MOUSE_RIGHT_DRAG; break;
-        case 64: key = MOUSE_WHEEL_RELEASE; break;
-        case 65: key = MOUSE_WHEEL_PRESS; break;
-        default: return -1;
+        int action = parse_table[p->state][byte_class(c)].action;
+        p->state = parse_table[p->state][byte_class(c)].next;
+        switch (action) {
+        case ACT_NONE: continue;
+        case ACT_PRINT: return (char)c; // Bytes above 0x7F are negative, as with getc()-style input
+        case ACT_ESC_KEY: return KEY_ESC;
+        case ACT_ESC_DISPATCH: key = esc_dispatch(c); break;
+        case ACT_PARAM:
+            if (p->nparams == 0) {
+                p->nparams = 1;
+                p->params[0] = 0, p->subparams[0] = -1;
+            }
+            if (p->nparams <= BTUI_MAX_PARAMS) {
+                int *n = p->in_subparam ? &p->subparams[p->nparams - 1] : &p->params[p->nparams - 1];
+                if (*n < 100000000) *n = 10 * *n + (c - '0');
+            }
+            continue;
+        case ACT_SEPARATOR:
+            if (p->nparams == 0) {
+                p->nparams = 1;
+                p->params[0] = 0, p->subparams[0] = -1;
+            }
+            if (c == ':') {
+                if (p->nparams <= BTUI_MAX_PARAMS && !p->in_subparam) p->subparams[p->nparams - 1] = 0;
+                p->in_subparam = 1;
+            } else if (c == ';') {
+                p->nparams += 1;
+                if (p->nparams <= BTUI_MAX_PARAMS)
+                    p->params[p->nparams - 1] = 0, p->subparams[p->nparams - 1] = -1;
+                p->in_subparam = 0;
+            }
+            continue;
+        case ACT_MARKER:
+            if (p->nparams == 0 && !p->prefix && !p->intermediate) p->prefix = (char)c;
+            else p->state = PARSE_CSI_IGNORE;
+            continue;
+        case ACT_INTERMEDIATE: p->intermediate = (char)c; continue;
+        case ACT_CSI_DISPATCH:
+            if (p->nparams > BTUI_MAX_PARAMS) p->nparams = BTUI_MAX_PARAMS;
+            key = csi_dispatch(c, mouse_x, mouse_y);
+            break;
+        case ACT_SS3_DISPATCH: key = ss3_dispatch(c); break;
+        case ACT_STRING_PUT:
+            if (p->string_len < sizeof(p->string) - 1) p->string[p->string_len++] = (char)c;
+            continue;
+        case ACT_STRING_END_ESC:
+            p->string[p->string_len] = '\0';
+            string_dispatch();
+            if (c == '\\') continue;
+            if (c == '\x1b') {
+                p->state = PARSE_ESCAPE;
+                continue;
+            }
+            key = esc_dispatch(c);
+            break;
+        case ACT_STRING_END:
+            p->string[p->string_len] = '\0';
+            string_dispatch();
+            continue;
+        default: continue;
         }
-        if (key == MOUSE_LEFT_RELEASE || key == MOUSE_RIGHT_RELEASE
-            || key == MOUSE_MIDDLE_RELEASE) {
-            static int lastclick = -1;
-            static struct timespec lastclicktime = {0, 0};
-            struct timespec clicktime;
-            clock_gettime(CLOCK_MONOTONIC, &clicktime);
-            if (key == lastclick) {
-                double dt_ms = 1e3 * (double)(clicktime.tv_sec - lastclicktime.tv_sec)
-                               + 1e-6 * (double)(clicktime.tv_nsec - lastclicktime.tv_nsec);
-                if (dt_ms < BTUI_DOUBLECLICK_THRESHOLD) {
-                    switch (key) {
-                    case MOUSE_LEFT_RELEASE: key = MOUSE_LEFT_DOUBLE; break;
-                    case MOUSE_RIGHT_RELEASE: key = MOUSE_RIGHT_DOUBLE; break;
-                    case MOUSE_MIDDLE_RELEASE: key = MOUSE_MIDDLE_DOUBLE; break;
-                    default: break;
-                    }
-                }
+        if (key != -1) return key;
+    }
+    return PARSE_INCOMPLETE;
+}
+
+/*
+ * Give up on waiting for the rest of a sequence and return whatever key its
+ * beginning represents (e.g. a lone ESC is the escape key), or -1.
+ */
+static int parse_timeout(void) {
+    btui_parser_t *p = &bt.parser;
+    parse_state_t state = p->state;
+    p->state = PARSE_GROUND;
+    switch (state) {
+    case PARSE_ESCAPE: return KEY_ESC;
+    case PARSE_CSI: return (p->nparams == 0 && !p->prefix && !p->intermediate) ? MOD_ALT | '[' : -1;
+    case PARSE_SS3: return p->nparams == 0 ? MOD_ALT | 'O' : -1;
+    case PARSE_STRING: return p->string_len == 0 ? MOD_ALT | p->string_kind : -1;
+    default: return -1;
+    }
+}
+
+/*
+ * Decode one key of input from the given file descriptor. Input is read only
+ * when the parser runs out of buffered bytes, and the rest of a partly
+ * received sequence is only waited for up to BTUI_ESCAPE_TIMEOUT. Returns -1
+ * on failure. (Helper method for btui_getkey() and btui_getkey_ns())
+ */
+static int read_key(int fd, int *mouse_x, int *mouse_y) {
+    if (bt.num_queued_keys > 0) {
+        btui_queued_key_t queued = bt.queued_keys[0];
+        memmove(&bt.queued_keys[0], &bt.queued_keys[1],
+                (size_t)(--bt.num_queued_keys) * sizeof(btui_queued_key_t));
+        if (mouse_x) *mouse_x = queued.mouse_x;
+        if (mouse_y) *mouse_y = queued.mouse_y;
+        bt.key_count = queued.count;
+        bt.key_ns = queued.time_ns;
+        if (queued.key == PASTE_EVENT) {
+            free(bt.paste);
+            bt.paste = queued.paste;
+            bt.paste_len = bt.paste_cap = queued.paste ? queued.paste_len : 0;
+        }
+        return queued.key;
+    }
+    if (mouse_x) *mouse_x = -1;
+    if (mouse_y) *mouse_y = -1;
+    bt.key_count = 1;
+    for (;;) {
+        int key = parse_input(mouse_x, mouse_y);
+        if (key == PASTE_EVENT) read_paste(fd);
+        if (key != -1 && key != PARSE_INCOMPLETE)
+            __atomic_fetch_add(&bt.input_counts.events, (uint64_t)bt.key_count, __ATOMIC_RELAXED);
+        bt.key_ns = bt.input_ns;
+        if (key != PARSE_INCOMPLETE) return key;
+
+        if (bt.parser.state != PARSE_GROUND) {
+            if (wait_input(fd, (int64_t)BTUI_ESCAPE_TIMEOUT * 1000000, 0) <= 0 || fill_input(fd) <= 0)
+                return parse_timeout();
+        } else if (bt.poll_input && wait_input(fd, 0, 0) <= 0) {
+            // The caller already waited for input, and there's none left
+            return -1;
+        } else if (fill_input(fd) <= 0) {
+            // Resizes are only handled on the main thread:
+            if (!bt.input_threaded && check_resize()) {
+                bt.size_changed = 0;
+                return RESIZE_EVENT;
             }
-            lastclicktime = clicktime;
-            lastclick = key;
+            return -1;
         }
-        return modifiers | key;
     }
-    default:
-        if ('0' <= c && c <= '9') {
-            // Ps prefix
-            for (numcode = 0; '0' <= c && c <= '9'; c = nextchar(fd))
-                numcode = 10 * numcode + (c - '0');
-            if (c == ';') {
-                modifiers = nextnum(fd, &c);
-                modifiers = (modifiers >> 1) << MOD_BITSHIFT;
+}
+
+/*
+ * Decode terminal input and queue up the keys for the main thread, until
+ * told to stop or the input ends. (The body of the input thread started by
+ * btui_set_input_thread())
+ */
+static void *run_input_thread(void *arg) {
+    (void)arg;
+    int fd = fileno(bt.in);
+    for (;;) {
+        struct pollfd pfds[3] = {{.fd = fd, .events = POLLIN},
+                                 {.fd = bt.stop_pipe[0], .events = POLLIN},
+                                 {.fd = bt.room_pipe[0], .events = POLLIN}};
+        // While the queue is full, input waits in the kernel (or the input
+        // buffer) until the main thread takes a key:
+        size_t tail = bt.queue_tail, head = __atomic_load_n(&bt.queue_head, __ATOMIC_ACQUIRE);
+        size_t free_slots = BTUI_INPUT_QUEUE_SIZE - (tail - head);
+        int full = free_slots == 0;
+        int buffered = bt.input_start != bt.input_end;
+        if (poll(full ? &pfds[1] : pfds, 2, (full || !buffered) ? -1 : 0) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (pfds[1].revents) break;
+        if (full) {
+            char drain[64];
+            while (read(bt.room_pipe[0], drain, sizeof(drain)) > 0)
+                continue;
+            continue;
+        }
+        if (!buffered && !pfds[0].revents) continue;
+        if (!buffered && !(pfds[0].revents & POLLIN)) break; // The terminal hung up
+
+        pthread_mutex_lock(&bt.input_lock);
+        size_t added = 0;
+        while (added < free_slots) {
+            btui_input_event_t event = {.mouse_x = -1, .mouse_y = -1};
+            bt.poll_input = 1;
+            event.key = read_key(fd, &event.mouse_x, &event.mouse_y);
+            bt.poll_input = 0;
+            if (event.key == -1) {
+                // Stop at the end of the input (but not at a non-key like a query reply):
+                if (bt.input_start == bt.input_end) break;
+                continue;
             }
-            goto CSI_start;
+            event.count = bt.key_count;
+            event.time_ns = bt.key_ns;
+            if (event.key == PASTE_EVENT && (event.paste = copy_paste()))
+                event.paste_len = bt.paste_len;
+            bt.input_queue[(tail + added) & (BTUI_INPUT_QUEUE_SIZE - 1)] = event;
+            added += 1;
+        }
+        pthread_cond_broadcast(&bt.input_decoded);
+        pthread_mutex_unlock(&bt.input_lock);
+        if (added > 0) {
+            __atomic_store_n(&bt.queue_tail, tail + added, __ATOMIC_RELEASE);
+            (void)!write(bt.wake_pipe[1], "", 1);
         }
     }
-    return -1;
+    __atomic_store_n(&bt.input_ended, 1, __ATOMIC_RELEASE);
+    (void)!write(bt.wake_pipe[1], "", 1);
+    return NULL;
+}
+
+/*
+ * Turn capabilities on or off based on the terminal's replies to queries
+ * since this was last called. (Helper method for take_key(),
+ * btui_getkey() and btui_query())
+ */
+static void apply_replies(void) {
+    if (!__atomic_load_n(&bt.unapplied_replies, __ATOMIC_ACQUIRE)) return;
+    if (bt.input_threaded) pthread_mutex_lock(&bt.input_lock);
+    int replies = __atomic_exchange_n(&bt.unapplied_replies, 0, __ATOMIC_ACQ_REL);
+    if (replies & BTUI_QUERY_SYNC_OUTPUT) {
+        if (bt.term.sync_output == 1 || bt.term.sync_output == 2) bt.caps |= BTUI_CAP_SYNC_OUTPUT;
+        else bt.caps &= ~BTUI_CAP_SYNC_OUTPUT;
+    }
+    if (replies & BTUI_QUERY_TRUECOLOR) {
+        if (bt.term.truecolor) bt.caps |= BTUI_CAP_TRUECOLOR | BTUI_CAP_256COLOR;
+        else bt.caps &= ~BTUI_CAP_TRUECOLOR;
+    }
+    if (bt.input_threaded) pthread_mutex_unlock(&bt.input_lock);
+}
+
+/*
+ * Take the next key from the input thread's queue, or decode it from the
+ * input buffer when there is no input thread. Returns -1 if there's no key
+ * waiting. (Helper method for btui_getkey_ns() and btui_wait_event())
+ */
+static int take_key(int *mouse_x, int *mouse_y) {
+    if (bt.input_threaded) {
+        char drain[64];
+        while (read(bt.wake_pipe[0], drain, sizeof(drain)) > 0)
+            continue;
+        size_t head = bt.queue_head;
+        if (head != __atomic_load_n(&bt.queue_tail, __ATOMIC_ACQUIRE)) {
+            btui_input_event_t *event = &bt.input_queue[head & (BTUI_INPUT_QUEUE_SIZE - 1)];
+            free(bt.taken.paste);
+            bt.taken = *event;
+            event->paste = NULL;
+            int was_full = __atomic_load_n(&bt.queue_tail, __ATOMIC_ACQUIRE) - head
+                           == BTUI_INPUT_QUEUE_SIZE;
+            __atomic_store_n(&bt.queue_head, head + 1, __ATOMIC_RELEASE);
+            // The input thread waits for room when the queue is full:
+            if (was_full) (void)!write(bt.room_pipe[1], "", 1);
+            apply_replies();
+            if (mouse_x) *mouse_x = bt.taken.mouse_x;
+            if (mouse_y) *mouse_y = bt.taken.mouse_y;
+            return bt.taken.key;
+        }
+        apply_replies();
+        if (thread_owns_input()) return -1;
+    }
+    bt.poll_input = 1;
+    int key = read_key(fileno(bt.in), mouse_x, mouse_y);
+    bt.poll_input = 0;
+    apply_replies();
+    return key;
+}
+
+/*
+ * Free a matcher made with btui_new_matcher(). Returns 0 on success or -1 if
+ * there is no such matcher.
+ */
+int btui_free_matcher(int id) {
+    btui_matcher_t *m = find_matcher(id);
+    if (!m) return -1;
+    while (m->num_levels > 0)
+        pop_match_level(m);
+    free(m->levels);
+    free(m->best);
+    free(m->offsets);
+    free(m->bytes);
+    free(m->partial);
+    free(m);
+    matchers[id - 1] = NULL;
+    return 0;
+}
+
+/*
+ * Free a surface made with btui_new_surface(). What it covered is repainted
+ * from the layers below it on the next flush. Returns 0 on success or -1 if
+ * there is no such surface.
+ */
+int btui_free_surface(int id) {
+    btui_surface_t *surface = find_surface(id);
+    if (!surface) return -1;
+    if (bt.target == id) btui_set_target(0);
+    if (surface->visible) add_damage(surface->x, surface->y, surface->width, surface->height);
+    free(surface->cells);
+    int i = (int)(surface - bt.surfaces);
+    memmove(&bt.surfaces[i], &bt.surfaces[i + 1],
+            sizeof(btui_surface_t) * (size_t)(bt.num_surfaces - i - 1));
+    if (--bt.num_surfaces == 0) free_surfaces();
+    return 0;
+}
+
+/*
+ * Return the text of the last bracketed paste (reported as a PASTE_EVENT key
+ * or a BTUI_EVENT_PASTE event) and set *len to its length. The text is not
+ * null-terminated and is only valid until the next key is read.
+ */
+const char *btui_get_paste(size_t *len) {
+    if (bt.input_threaded) {
+        if (len) *len = bt.taken.paste_len;
+        return bt.taken.paste;
+    }
+    if (len) *len = bt.paste_len;
+    return bt.paste;
+}
+
+/*
+ * Get one key of input from the given file. Returns -1 on failure.
+ * If mouse_x or mouse_y are non-null and a mouse event occurs, they will be
+ * set to the position of the mouse (0-indexed). `timeout` is in tenths of a
+ * second (or negative to wait forever) and is implemented with the termios
+ * VMIN/VTIME settings.
+ */
+int btui_getkey(int timeout, int *mouse_x, int *mouse_y) {
+    if (bt.input_threaded)
+        return btui_getkey_ns(timeout < 0 ? -1 : (int64_t)timeout * 100000000, mouse_x, mouse_y);
+    int new_vmin = timeout < 0 ? 1 : 0, new_vtime = timeout < 0 ? 0 : timeout;
+    if (new_vmin != tui_termios.c_cc[VMIN] || new_vtime != tui_termios.c_cc[VTIME]) {
+        tui_termios.c_cc[VMIN] = new_vmin;
+        tui_termios.c_cc[VTIME] = new_vtime;
+        if (set_termios(&tui_termios) == -1) return -1;
+    }
+    // Pipes don't have VMIN/VTIME, so headless input always waits with poll():
+    if (bt.headless == BTUI_HEADLESS_MEMORY)
+        return btui_getkey_ns(timeout < 0 ? -1 : (int64_t)timeout * 100000000, mouse_x, mouse_y);
+    // Wait with poll() when blocking, so a resize can interrupt the wait:
+    if (timeout < 0 && !has_input()
+        && wait_input(fileno(bt.in), -1, 1) <= 0 && check_resize()) {
+        bt.size_changed = 0;
+        if (mouse_x) *mouse_x = -1;
+        if (mouse_y) *mouse_y = -1;
+        return RESIZE_EVENT;
+    }
+    int key = read_key(fileno(bt.in), mouse_x, mouse_y);
+    apply_replies();
+    return key;
+}
+
+/*
+ * Like btui_getkey(), but with a timeout in nanoseconds (or negative to wait
+ * forever). The terminal is left in VMIN=1/VTIME=0 mode and the waiting is
+ * done with poll(), so switching between timeouts doesn't need any syscalls
+ * to change the terminal settings.
+ */
+int btui_getkey_ns(int64_t timeout_ns, int *mouse_x, int *mouse_y) {
+    if (use_poll_termios() == -1) return -1;
+    if (mouse_x) *mouse_x = -1;
+    if (mouse_y) *mouse_y = -1;
+    int64_t deadline = timeout_ns < 0 ? -1 : now_ns() + timeout_ns;
+    for (;;) {
+        if (!has_input()) {
+            // Once the deadline has passed, still check for input that's already waiting:
+            int64_t remaining = deadline < 0 ? -1 : deadline - now_ns();
+            if (deadline >= 0 && remaining < 0) remaining = 0;
+            if (wait_input(key_fd(), remaining, 1) <= 0) {
+                if (check_resize()) {
+                    bt.size_changed = 0;
+                    return RESIZE_EVENT;
+                }
+                return -1;
+            }
+        }
+        int key = take_key(mouse_x, mouse_y);
+        // Keep waiting if the input so far wasn't a key (e.g. a reply to a query)
+        if (key != -1) return key;
+    }
+}
+
+/*
+ * Return how many input events were merged into the last key read (more than
+ * 1 only for coalesced mouse drags and wheel turns, where it's the number of
+ * reports or wheel steps).
+ */
+int btui_key_count(void) { return bt.input_threaded ? bt.taken.count : bt.key_count; }
 
-DCS:
-    return -1;
+/*
+ * Return when the input for the last key read arrived, in nanoseconds on the
+ * monotonic clock. With an input thread, this can be well before the key was
+ * read.
+ */
+int64_t btui_key_time(void) { return bt.input_threaded ? bt.taken.time_ns : bt.key_ns; }
 
-SS3:
-    switch (nextchar(fd)) {
-    case 'P': return KEY_F1;
-    case 'Q': return KEY_F2;
-    case 'R': return KEY_F3;
-    case 'S': return KEY_F4;
-    default: break;
+/*
+ * Hash a key name for the keys_by_name[] table (FNV-1a).
+ */
+static inline uint32_t hash_key_name(const char *name) {
+    uint32_t h = 2166136261u;
+    for (; *name; name++)
+        h = (h ^ (uint8_t)*name) * 16777619u;
+    return h;
+}
+
+/*
+ * Fill in names_by_key[] and keys_by_name[] from key_names[], if that hasn't
+ * been done yet. (Helper method for btui_keyname() and btui_keynamed())
+ */
+static void build_key_tables(void) {
+    static int built = 0;
+    if (built) return;
+    for (size_t i = 0; i < sizeof(key_names) / sizeof(key_names[0]); i++) {
+        const keyname_t *entry = &key_names[i];
+        if (!names_by_key[entry->key]) names_by_key[entry->key] = entry->name;
+        uint32_t h = hash_key_name(entry->name);
+        while (keys_by_name[h % KEY_NAME_SLOTS])
+            h++;
+        keys_by_name[h % KEY_NAME_SLOTS] = entry;
     }
-    return -1;
+    built = 1;
 }
 
 /*
@@ -764,12 +4190,9 @@ char *btui_keyname(int key, char *buf) {
     if (key & MOD_CTRL) buf = stpcpy(buf, "Ctrl-");
     if (key & MOD_ALT) buf = stpcpy(buf, "Alt-");
     if (key & MOD_SHIFT) buf = stpcpy(buf, "Shift-");
-    key &= ~(MOD_META | MOD_CTRL | MOD_ALT | MOD_SHIFT);
-    for (size_t i = 0; i < sizeof(key_names) / sizeof(key_names[0]); i++) {
-        if (key_names[i].key == key) {
-            return stpcpy(buf, key_names[i].name);
-        }
-    }
+    key &= ~MOD_MASK;
+    build_key_tables();
+    if (0 <= key && key <= PASTE_EVENT && names_by_key[key]) return stpcpy(buf, names_by_key[key]);
     if (' ' < key && key <= '~') return buf + sprintf(buf, "%c", key);
     else return buf + sprintf(buf, "\\x%02X", (unsigned int)key);
 }
@@ -786,9 +4209,12 @@ int btui_keynamed(const char *name) {
         int modifier;
     } modnames[] = {
         {"Super-", MOD_META}, {"Ctrl-", MOD_CTRL}, {"Alt-", MOD_ALT}, {"Shift-", MOD_SHIFT}};
+    build_key_tables();
 check_names:
-    for (size_t i = 0; i < sizeof(key_names) / sizeof(key_names[0]); i++) {
-        if (strcmp(key_names[i].name, name) == 0) return modifiers | key_names[i].key;
+    for (uint32_t h = hash_key_name(name);; h++) {
+        const keyname_t *entry = keys_by_name[h % KEY_NAME_SLOTS];
+        if (!entry) break;
+        if (strcmp(entry->name, name) == 0) return modifiers | entry->key;
     }
     for (size_t i = 0; i < sizeof(modnames) / sizeof(modnames[0]); i++) {
         if (strncmp(name, modnames[i].prefix, strlen(modnames[i].prefix)) == 0) {
@@ -797,37 +4223,450 @@ check_names:
             goto check_names;
         }
     }
-    return strlen(name) == 1 ? name[0] : -1;
+    return strlen(name) == 1 ? modifiers | name[0] : -1;
+}
+
+/*
+ * Search a matcher's candidates for ones that contain `query` (or, with the
+ * BTUI_MATCH_FUZZY flag, contain its bytes in order, ranked best first with
+ * only the best `limit` kept if `limit` isn't 0). The matches for earlier
+ * queries that this one extends are kept, so typing more of a query only
+ * checks what matched before, and going back to an earlier query (or asking
+ * again after adding candidates) only checks candidates added since. Large
+ * searches are split across threads. Returns the number of results that can
+ * be fetched with btui_match_result(), or -1 on failure.
+ */
+int64_t btui_match(int id, const char *query, int flags, size_t limit) {
+    btui_matcher_t *m = find_matcher(id);
+    if (!m) return -1;
+    int fuzzy = (flags & BTUI_MATCH_FUZZY) != 0;
+    if (fuzzy != m->fuzzy) {
+        while (m->num_levels > 0)
+            pop_match_level(m);
+        m->fuzzy = fuzzy;
+    }
+    // Forget the matches for queries that this one doesn't extend:
+    size_t query_len = strlen(query);
+    while (m->num_levels > 0) {
+        btui_match_level_t *top = &m->levels[m->num_levels - 1];
+        if (top->query_len <= query_len && memcmp(top->query, query, top->query_len) == 0) break;
+        pop_match_level(m);
+    }
+    btui_match_level_t *prev = m->num_levels > 0 ? &m->levels[m->num_levels - 1] : NULL;
+    if (prev && prev->query_len == query_len) {
+        if (match_candidates(m, prev, NULL, prev->scanned, m->count) < 0) return -1;
+        prev->scanned = m->count;
+    } else {
+        if (m->num_levels >= m->levels_cap) {
+            int cap = m->levels_cap ? 2 * m->levels_cap : 8;
+            btui_match_level_t *levels = realloc(m->levels, sizeof(btui_match_level_t) * (size_t)cap);
+            if (!levels) return -1;
+            m->levels = levels;
+            m->levels_cap = cap;
+            prev = m->num_levels > 0 ? &m->levels[m->num_levels - 1] : NULL;
+        }
+        btui_match_level_t *level = &m->levels[m->num_levels];
+        *level = (btui_match_level_t){.query = strdup(query), .query_len = query_len};
+        if (!level->query) return -1;
+        m->num_levels++;
+        // Anything that matches this query also matches the one before, so
+        // only its matches (and candidates added since) need checking:
+        int status = prev ? match_candidates(m, level, prev->indices, 0, prev->count)
+                       : match_candidates(m, level, NULL, 0, m->count);
+        if (status == 0 && prev) status = match_candidates(m, level, NULL, prev->scanned, m->count);
+        if (status < 0) {
+            pop_match_level(m);
+            return -1;
+        }
+        level->scanned = m->count;
+    }
+    btui_match_level_t *level = &m->levels[m->num_levels - 1];
+    if (!fuzzy) return (int64_t)level->count;
+    if (rank_matches(m, level, limit) < 0) return -1;
+    return (int64_t)m->num_best;
+}
+
+/*
+ * Return the text of the `n`th result (counting from 0) of the last
+ * btui_match() call on a matcher and set *len (if it isn't NULL) to its
+ * length, or return NULL if there is no such result. The text is not
+ * NUL-terminated.
+ */
+const char *btui_match_result(int id, size_t n, size_t *len) {
+    btui_matcher_t *m = find_matcher(id);
+    if (!m || m->num_levels == 0) return NULL;
+    const btui_match_level_t *level = &m->levels[m->num_levels - 1];
+    if (n >= (m->fuzzy ? m->num_best : level->count)) return NULL;
+    return btui_matcher_get(id, m->fuzzy ? m->best[n] : level->indices[n], len);
+}
+
+/*
+ * Return the total number of candidates that matched the last btui_match()
+ * call on a matcher (including fuzzy matches that weren't among the best).
+ */
+size_t btui_match_total(int id) {
+    btui_matcher_t *m = find_matcher(id);
+    return (m && m->num_levels > 0) ? m->levels[m->num_levels - 1].count : 0;
+}
+
+/*
+ * Add a candidate to a matcher. Returns 0 on success or -1 on failure.
+ */
+int btui_matcher_add(int id, const char *text, size_t len) {
+    btui_matcher_t *m = find_matcher(id);
+    if (!m || m->count >= UINT32_MAX - 1) return -1;
+    // The arena is allocated even for an empty first line, so it's never NULL:
+    if (!m->bytes || m->bytes_len + len > m->bytes_cap) {
+        size_t cap = m->bytes_cap ? m->bytes_cap : 65536;
+        while (cap < m->bytes_len + len)
+            cap *= 2;
+        char *bytes = realloc(m->bytes, cap);
+        if (!bytes) return -1;
+        m->bytes = bytes;
+        m->bytes_cap = cap;
+    }
+    if (m->count + 2 > m->offsets_cap) {
+        size_t cap = m->offsets_cap ? 2 * m->offsets_cap : 4096;
+        size_t *offsets = realloc(m->offsets, sizeof(size_t) * cap);
+        if (!offsets) return -1;
+        m->offsets = offsets;
+        m->offsets_cap = cap;
+    }
+    memcpy(m->bytes + m->bytes_len, text, len);
+    m->offsets[m->count] = m->bytes_len;
+    m->bytes_len += len;
+    m->offsets[++m->count] = m->bytes_len;
+    return 0;
+}
+
+/*
+ * Return the number of candidates in a matcher.
+ */
+size_t btui_matcher_count(int id) {
+    btui_matcher_t *m = find_matcher(id);
+    return m ? m->count : 0;
+}
+
+/*
+ * Return the text of a matcher's candidate (counting from 0) and set *len
+ * (if it isn't NULL) to its length, or return NULL if there is no such
+ * candidate. The text is not NUL-terminated.
+ */
+const char *btui_matcher_get(int id, size_t index, size_t *len) {
+    btui_matcher_t *m = find_matcher(id);
+    if (!m || index >= m->count) return NULL;
+    if (len) *len = m->offsets[index + 1] - m->offsets[index];
+    return m->bytes + m->offsets[index];
+}
+
+/*
+ * Read whatever input is available from `fd` (with a single read()) and add
+ * each line of it to a matcher, skipping empty lines. A line that hasn't
+ * ended yet is held back until the rest of it is read, or until the end of
+ * the input. This is meant to be called whenever the file descriptor is
+ * readable (e.g. with btui_watch_fd()), so candidates can stream in while the
+ * user is typing. Returns the number of bytes read: 0 at the end of the input
+ * or -1 on failure (with errno set, e.g. to EAGAIN if `fd` is non-blocking
+ * and there's nothing to read yet).
+ */
+int64_t btui_matcher_read(int id, int fd) {
+    btui_matcher_t *m = find_matcher(id);
+    if (!m) {
+        errno = EINVAL;
+        return -1;
+    }
+    char buf[65536];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n < 0) return -1;
+    if (n == 0) { // The last line doesn't need a newline
+        if (m->partial_len > 0 && btui_matcher_add(id, m->partial, m->partial_len) < 0) return -1;
+        m->partial_len = 0;
+        return 0;
+    }
+    const char *line = buf, *end = buf + n;
+    for (const char *nl; (nl = memchr(line, '\n', (size_t)(end - line))); line = nl + 1) {
+        if (m->partial_len > 0) {
+            // Finish the line that was started by an earlier read:
+            if (m->partial_len + (size_t)(nl - line) > m->partial_cap) {
+                size_t cap = 2 * (m->partial_len + (size_t)(nl - line));
+                char *partial = realloc(m->partial, cap);
+                if (!partial) return -1;
+                m->partial = partial;
+                m->partial_cap = cap;
+            }
+            memcpy(m->partial + m->partial_len, line, (size_t)(nl - line));
+            int status = btui_matcher_add(id, m->partial, m->partial_len + (size_t)(nl - line));
+            m->partial_len = 0;
+            if (status < 0) return -1;
+        } else if (nl > line && btui_matcher_add(id, line, (size_t)(nl - line)) < 0) {
+            return -1;
+        }
+    }
+    if (line < end) {
+        if (m->partial_len + (size_t)(end - line) > m->partial_cap) {
+            size_t cap = 2 * (m->partial_len + (size_t)(end - line));
+            char *partial = realloc(m->partial, cap);
+            if (!partial) return -1;
+            m->partial = partial;
+            m->partial_cap = cap;
+        }
+        memcpy(m->partial + m->partial_len, line, (size_t)(end - line));
+        m->partial_len += (size_t)(end - line);
+    }
+    return (int64_t)n;
 }
 
 /*
  * Move the terminal's cursor to the given x,y coordinates.
  */
-int btui_move_cursor(int x, int y) { return fprintf(bt.out, "\033[%d;%dH", y + 1, x + 1); }
+int btui_move_cursor(int x, int y) {
+    if (bt.buffered) {
+        bt.cursor_x = x, bt.cursor_y = y;
+        return 0;
+    }
+    return output_commit(put_move(output_reserve(32), x, y));
+}
 
 /*
  * Move the terminal's cursor relative to its current position.
  */
 int btui_move_cursor_relative(int x, int y) {
-    int n = 0;
-    if (x > 0) n += fprintf(bt.out, "\033[%d A", x);
-    else if (x < 0) n += fprintf(bt.out, "\033[%d @", -x);
-    if (y > 0) n += fprintf(bt.out, "\033[%dB", y);
-    else if (y < 0) n += fprintf(bt.out, "\033[%dA", -y);
-    return n;
+    if (bt.buffered) {
+        bt.cursor_x += x, bt.cursor_y += y;
+        return 0;
+    }
+    if (bt.screen_x >= 0 && bt.screen_y >= 0)
+        return output_commit(put_move(output_reserve(32), bt.screen_x + x, bt.screen_y + y));
+    if (x != 0 || y != 0) bt.stats.escapes[BTUI_ESCAPE_CURSOR] += 1;
+    char *buf = output_reserve(64), *end = buf;
+    if (x > 0) end = put_csi(end, x, 'C');
+    else if (x < 0) end = put_csi(end, -x, 'D');
+    if (y > 0) end = put_csi(end, y, 'B');
+    else if (y < 0) end = put_csi(end, -y, 'A');
+    return output_commit(end);
 }
 
 /*
  * Hide the terminal cursor.
  */
-int btui_hide_cursor(void) { return fputs(T_OFF(T_SHOW_CURSOR), bt.out); }
+int btui_hide_cursor(void) { return output_control(T_OFF(T_SHOW_CURSOR)); }
+
+/*
+ * Return how many bytes of output the terminal hasn't taken yet (what is in
+ * the kernel's tty output queue, which backs up when the terminal or the
+ * connection to it is slow), or -1 if that can't be measured.
+ */
+int btui_output_queued(void) {
+#ifdef TIOCOUTQ
+    int queued;
+    if (bt.out && ioctl(fileno(bt.out), TIOCOUTQ, &queued) == 0) return queued;
+#endif
+    return -1;
+}
+
+/*
+ * Move a surface so that its top left corner is at x,y on the screen.
+ * Returns 0 on success or -1 if there is no such surface.
+ */
+int btui_move_surface(int id, int x, int y) {
+    btui_surface_t *surface = find_surface(id);
+    if (!surface) return -1;
+    if (surface->visible) {
+        add_damage(surface->x, surface->y, surface->width, surface->height);
+        add_damage(x, y, surface->width, surface->height);
+    }
+    surface->x = x, surface->y = y;
+    return 0;
+}
+
+/*
+ * Make a new matcher: a set of candidate lines to search with btui_match().
+ * Matchers don't need the terminal to be set up. Returns the matcher's ID,
+ * or -1 on failure.
+ */
+int btui_new_matcher(void) {
+    for (int i = 0; i < BTUI_MAX_MATCHERS; i++) {
+        if (matchers[i]) continue;
+        matchers[i] = calloc(1, sizeof(btui_matcher_t));
+        return matchers[i] ? i + 1 : -1;
+    }
+    return -1;
+}
+
+/*
+ * Make an offscreen surface of w by h cells with its top left corner at x,y
+ * on the screen, stacked above the screen's own contents and any surfaces
+ * with a lower z. Drawing goes into it after btui_set_target(), and in
+ * buffered mode, flushes composite the visible surfaces over the screen's
+ * contents. Only the areas that changed are composited again, so showing,
+ * hiding or moving a surface only costs the area it covers. New surfaces are
+ * transparent (BTUI_TRANSPARENT) until drawn into. Returns the surface's ID,
+ * or -1 on failure (including when not in buffered mode).
+ */
+int btui_new_surface(int x, int y, int w, int h, int z) {
+    if (!bt.buffered || w <= 0 || h <= 0 || bt.num_surfaces >= BTUI_MAX_SURFACES) return -1;
+    btui_cell_t *cells = malloc(sizeof(btui_cell_t) * (size_t)(w * h));
+    if (!cells) return -1;
+    for (int i = 0; i < w * h; i++)
+        cells[i] = (btui_cell_t){.style = blank_cell.style, .ch = BTUI_TRANSPARENT};
+    if (bt.num_surfaces == 0) {
+        bt.composed = malloc(sizeof(btui_cell_t) * (size_t)(bt.buf_width * bt.buf_height));
+        if (!bt.composed) {
+            free(cells);
+            return -1;
+        }
+    }
+    int id = ++bt.next_surface_id;
+    insert_surface((btui_surface_t){.id = id, .x = x, .y = y, .width = w, .height = h, .z = z,
+                                    .visible = 1, .cells = cells, .pen = blank_cell.style});
+    if (bt.num_surfaces == 1) add_damage(0, 0, bt.buf_width, bt.buf_height);
+    return id;
+}
 
 /*
  * Output a string to the terminal.
  */
 int btui_puts(const char *s) {
-    int ret = fputs(s, bt.out);
-    return ret;
+    if (bt.buffered) {
+        buffer_puts(s);
+        return 0;
+    }
+    // Raw escape sequences might change the text style:
+    if (strchr(s, '\033')) bt.style_known = 0;
+    track_text(s);
+    return output_puts(s);
+}
+
+/*
+ * Output a string to the terminal like btui_puts(), but without copying it:
+ * long text is sent straight from `s` when the output is flushed, so `s` must
+ * not be changed or freed until then (the end of the frame, or the next
+ * btui_flush()). Short text, and text in buffered mode, is copied as usual.
+ */
+int btui_puts_span(const char *s) {
+    size_t len = strlen(s);
+    if (bt.buffered || len < BTUI_MIN_SPAN || bt.num_spans == BTUI_MAX_SPANS) return btui_puts(s);
+    if (strchr(s, '\033')) bt.style_known = 0;
+    track_text(s);
+    bt.spans[bt.num_spans++] = (btui_span_t){.offset = bt.output_len, .text = s, .len = len};
+    bt.spans_len += len;
+    if (bt.frame_depth == 0 && bt.output_len + bt.spans_len >= output_bufsize()) output_flush();
+    return (int)len;
+}
+
+/*
+ * Send queries (like btui_send_queries()) and wait until the terminal has
+ * replied to them, or until `timeout_ns` nanoseconds have passed (negative to
+ * wait forever). Keys that arrive in the meantime are kept for later calls to
+ * btui_getkey() and btui_wait_event(). Returns which of the `queries` have
+ * answers in btui_term_info(), or -1 on failure.
+ */
+int btui_query(int queries, int64_t timeout_ns) {
+    if (btui_send_queries(queries) == -1 || use_poll_termios() == -1) return -1;
+    if (thread_owns_input()) {
+        // Wait for the input thread to decode the replies:
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        int64_t ns = until.tv_nsec + (timeout_ns < 0 ? 0 : timeout_ns);
+        until.tv_sec += (time_t)(ns / 1000000000), until.tv_nsec = (long)(ns % 1000000000);
+        pthread_mutex_lock(&bt.input_lock);
+        while ((bt.term.pending & queries) && !__atomic_load_n(&bt.input_ended, __ATOMIC_ACQUIRE)) {
+            if (timeout_ns < 0) pthread_cond_wait(&bt.input_decoded, &bt.input_lock);
+            else if (pthread_cond_timedwait(&bt.input_decoded, &bt.input_lock, &until) != 0) break;
+        }
+        int answered = bt.term.answered & queries;
+        pthread_mutex_unlock(&bt.input_lock);
+        apply_replies();
+        return answered;
+    }
+    int64_t deadline = timeout_ns < 0 ? -1 : now_ns() + timeout_ns;
+    int fd = fileno(bt.in);
+    while ((bt.term.pending & queries) && bt.num_queued_keys < BTUI_MAX_QUEUED_KEYS) {
+        int mouse_x = -1, mouse_y = -1;
+        bt.key_count = 1;
+        int key = parse_input(&mouse_x, &mouse_y);
+        if (key == PARSE_INCOMPLETE) {
+            int64_t remaining = deadline < 0 ? -1 : deadline - now_ns();
+            if ((deadline >= 0 && remaining <= 0) || wait_input(fd, remaining, 0) <= 0
+                || fill_input(fd) <= 0)
+                break;
+            continue;
+        }
+        if (key == PASTE_EVENT) read_paste(fd);
+        if (key != -1) {
+            __atomic_fetch_add(&bt.input_counts.events, (uint64_t)bt.key_count, __ATOMIC_RELAXED);
+            btui_queued_key_t queued = {.key = key, .mouse_x = mouse_x, .mouse_y = mouse_y,
+                                        .count = bt.key_count, .time_ns = bt.input_ns};
+            if (key == PASTE_EVENT && (queued.paste = copy_paste())) queued.paste_len = bt.paste_len;
+            bt.queued_keys[bt.num_queued_keys++] = queued;
+        }
+    }
+    apply_replies();
+    return bt.term.answered & queries;
+}
+
+/*
+ * Return how many nanoseconds to wait before drawing the next frame (0 to
+ * draw now). This is the longest of:
+ *  - the frame rate limit set by btui_set_max_fps()
+ *  - as long again as the last frame spent blocked writing to the terminal
+ *  - the time for the terminal's output queue to drain to
+ *    BTUI_OUTPUT_BACKLOG bytes, estimated from how fast it has been draining
+ * Frames that are skipped aren't lost: in buffered mode, the next flush sends
+ * all the changes at once.
+ */
+int64_t btui_render_delay_ns(void) {
+    int64_t now = now_ns(), delay = 0;
+    if (bt.frame_interval_ns > 0) delay = bt.last_frame_ns + bt.frame_interval_ns - now;
+    if (bt.last_frame_ns + bt.write_ns - now > delay) delay = bt.last_frame_ns + bt.write_ns - now;
+    int queued = btui_output_queued();
+    if (queued > BTUI_OUTPUT_BACKLOG) {
+        int64_t elapsed = now - bt.last_frame_ns;
+        int64_t drain_ns = 10000000; // Check again in 10ms if nothing has drained yet
+        if (bt.last_frame_queued > queued && elapsed > 0)
+            drain_ns = (int64_t)((double)(queued - BTUI_OUTPUT_BACKLOG) * (double)elapsed
+                                 / (double)(bt.last_frame_queued - queued));
+        if (drain_ns > delay) delay = drain_ns;
+    }
+    return delay > 0 ? delay : 0;
+}
+
+/*
+ * Throw away the output captured by a headless backend so far.
+ */
+void btui_reset_captured_output(void) {
+    output_flush();
+    if (bt.headless == BTUI_HEADLESS_PTY) capture_pty_output(5);
+    bt.capture_len = 0;
+}
+
+/*
+ * Reset all of the counters in btui_stats() to zero.
+ */
+void btui_reset_stats(void) {
+    memset(&bt.stats, 0, sizeof(bt.stats));
+    __atomic_store_n(&bt.input_counts.events, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&bt.input_counts.bytes_read, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&bt.input_counts.read_calls, 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Change the size of a headless backend's terminal, which is reported like a
+ * real resize (a RESIZE_EVENT or BTUI_EVENT_RESIZE). Returns 0 on success or
+ * -1 on failure.
+ */
+int btui_resize_headless(int width, int height) {
+    if (!bt.headless || width <= 0 || height <= 0) return -1;
+    if (bt.headless == BTUI_HEADLESS_PTY) {
+        struct winsize winsize = {.ws_row = (unsigned short)height, .ws_col = (unsigned short)width};
+        if (ioctl(bt.inject_fd, TIOCSWINSZ, &winsize) != 0) return -1;
+    } else if (width != bt.width || height != bt.height) {
+        bt.width = width;
+        bt.height = height;
+        bt.size_changed = 1;
+    }
+    notify_resize(SIGWINCH);
+    return 0;
 }
 
 /*
@@ -835,81 +4674,404 @@ int btui_puts(const char *s) {
  * redrawing many lines.
  */
 int btui_scroll(int firstline, int lastline, int scroll_amount) {
-    if (scroll_amount > 0) {
-        return fprintf(bt.out, "\033[%d;%dr\033[%dS\033[r", firstline + 1, lastline + 1,
-                       scroll_amount);
-    } else if (scroll_amount < 0) {
-        return fprintf(bt.out, "\033[%d;%dr\033[%dT\033[r", firstline + 1, lastline + 1,
-                       -scroll_amount);
+    if (bt.buffered) {
+        if (firstline < 0) firstline = 0;
+        if (lastline >= bt.canvas_height) lastline = bt.canvas_height - 1;
+        int w = bt.canvas_width, n = lastline - firstline + 1;
+        int shift = scroll_amount < 0 ? -scroll_amount : scroll_amount;
+        if (n <= 0 || shift == 0) return 0;
+        if (shift > n) shift = n;
+        add_canvas_damage(0, firstline, w, n);
+        btui_cell_t *region = &bt.canvas[firstline * w];
+        btui_cell_t blank = {.style = {0, BTUI_COLOR_DEFAULT, bt.pen.bg}, .ch = ' '};
+        if (scroll_amount > 0) {
+            memmove(region, region + shift * w, sizeof(btui_cell_t) * (size_t)((n - shift) * w));
+            buffer_fill(0, lastline - shift + 1, w, shift, blank);
+        } else {
+            memmove(region + shift * w, region, sizeof(btui_cell_t) * (size_t)((n - shift) * w));
+            buffer_fill(0, firstline, w, shift, blank);
+        }
+        return 0;
     }
-    return 0;
+    if (scroll_amount == 0) return 0;
+    return output_commit(put_scroll(output_reserve(64), firstline, lastline, scroll_amount));
+}
+
+/*
+ * Ask the terminal about the things in `queries` (BTUI_QUERY_* flags) without
+ * waiting for its replies. The replies are picked out of the input whenever
+ * it's read, and stored in btui_term_info(). Anything already answered (except
+ * the cursor position, which changes) isn't asked again. A DA1 query is always
+ * sent last, since every terminal answers it: once it's answered, the rest of
+ * the queries are known to be unsupported. Returns 0 on success or -1 on
+ * failure (including when BTUI isn't in normal or TUI mode).
+ */
+int btui_send_queries(int queries) {
+    if (bt.mode != BTUI_MODE_NORMAL && bt.mode != BTUI_MODE_TUI) return -1;
+    // The input thread updates the query state as it decodes the replies:
+    if (bt.input_threaded) pthread_mutex_lock(&bt.input_lock);
+    queries &= ~(bt.term.pending
+                 | ((bt.term.answered | bt.term.unsupported) & ~BTUI_QUERY_CURSOR));
+    if (!queries) {
+        if (bt.input_threaded) pthread_mutex_unlock(&bt.input_lock);
+        return 0;
+    }
+    if (queries & BTUI_QUERY_FG) output_control("\033]10;?\033\\");
+    if (queries & BTUI_QUERY_BG) output_control("\033]11;?\033\\");
+    if (queries & BTUI_QUERY_SYNC_OUTPUT) output_control("\033[?" T_SYNC_OUTPUT "$p");
+    if (queries & BTUI_QUERY_CURSOR) output_control("\033[6n");
+    if (queries & BTUI_QUERY_TRUECOLOR) {
+        // Set an unusual RGB color and ask for the current SGR (DECRQSS):
+        output_control("\033[38;2;1;2;3m\033P$qm\033\\\033[0m");
+        bt.style_known = 0;
+    }
+    output_control("\033[c");
+    bt.term.sentinels += 1;
+    bt.term.pending |= queries;
+    bt.term.answered &= ~queries;
+    if (bt.input_threaded) pthread_mutex_unlock(&bt.input_lock);
+    return output_flush() == 0 ? 0 : -1;
 }
 
 /*
  * Set the given text attributes on the terminal output.
  */
 int btui_set_attributes(attr_t attrs) {
-    int printed = fputs("\033[", bt.out);
-    for (int i = 63; i >= 0; i--) {
-        if (attrs & (1ul << i)) {
-            attrs ^= (1ul << i);
-            if (attrs) printed += fprintf(bt.out, "%d;", i);
-            else printed += fprintf(bt.out, "%d", i);
-        }
+    if (bt.buffered) {
+        style_apply(&bt.pen, attrs);
+        return 0;
     }
-    printed += fputs("m", bt.out);
-    return printed;
+    btui_style_t style = bt.term_style;
+    style_apply(&style, attrs);
+    // BTUI_NORMAL is sent last, so it leaves the terminal in a known state:
+    if (bt.style_known || (attrs & BTUI_NORMAL)) return set_term_style(style);
+    char params[256];
+    bt.term_style = style;
+    return put_sgr(params, sgr_attrs(params, attrs));
 }
 
 /*
  * Set the terminal text background color to the given RGB value.
  */
 int btui_set_bg(unsigned char r, unsigned char g, unsigned char b) {
-    return fprintf(bt.out, "\033[48;2;%d;%d;%dm", r, g, b);
+    return btui_set_style(BTUI_COLOR_UNCHANGED, BTUI_COLOR_RGB(r, g, b), 0);
 }
 
 /*
  * Set the terminal text background color to the given RGB value.
  */
-int btui_set_bg256(unsigned char n) { return fprintf(bt.out, "\033[48;5;%dm", n); }
+int btui_set_bg256(unsigned char n) {
+    return btui_set_style(BTUI_COLOR_UNCHANGED, BTUI_COLOR_256(n), 0);
+}
 
 /*
  * Set the terminal text background color to the given hexidecimal value.
  */
 int btui_set_bg_hex(uint32_t hex) {
-    return fprintf(bt.out, "\033[48;2;%d;%d;%dm", (hex >> 16) & 0xFF, (hex >> 8) & 0xFF,
-                   hex & 0xFF);
+    return btui_set_style(BTUI_COLOR_UNCHANGED,
+                          BTUI_COLOR_RGB((hex >> 16) & 0xFF, (hex >> 8) & 0xFF, hex & 0xFF), 0);
+}
+
+/*
+ * Turn retained (buffered) drawing mode on or off. In buffered mode, drawing
+ * functions update an in-memory grid of cells instead of writing to the
+ * terminal, and btui_flush() sends only the cells that changed since the last
+ * flush. Returns 0 on success or -1 if the buffers couldn't be allocated.
+ */
+int btui_set_buffered(int buffered) {
+    if (!buffered) {
+        if (bt.buffered) buffer_flush();
+        free_surfaces();
+        free(bt.front);
+        free(bt.back);
+        free(bt.row_hashes);
+        bt.front = bt.back = bt.canvas = NULL;
+        bt.row_hashes = NULL;
+        bt.buf_width = bt.buf_height = 0;
+        bt.buffered = 0;
+        return 0;
+    }
+    if (bt.buffered) return 0;
+    if (resize_buffers()) return -1;
+    bt.cursor_x = bt.cursor_y = 0;
+    bt.pen = blank_cell.style;
+    bt.buffered = 1;
+    return 0;
+}
+
+/*
+ * Return which optional terminal features BTUI uses (a combination of
+ * BTUI_CAP_* flags, see btui_set_capabilities()).
+ */
+int btui_capabilities(void) {
+    apply_replies();
+    return bt.caps;
+}
+
+/*
+ * Set which optional terminal features BTUI may use (a combination of
+ * BTUI_CAP_* flags) and return the previous set. btui_init() picks defaults
+ * based on $TERM and $COLORTERM, and assumes all colors are available until a
+ * query reply says otherwise. Without BTUI_CAP_TRUECOLOR or BTUI_CAP_256COLOR,
+ * colors are downsampled (see btui_set_style()).
+ */
+int btui_set_capabilities(int caps) {
+    int prev = bt.caps;
+    bt.caps = caps;
+    return prev;
 }
 
 /*
  * Set the cursor shape.
  */
-int btui_set_cursor(cursor_t cur) { return fprintf(bt.out, "\033[%u q", cur); }
+int btui_set_cursor(cursor_t cur) {
+    bt.stats.escapes[BTUI_ESCAPE_OTHER] += 1;
+    char *buf = put_csi(output_reserve(32), (int)cur, ' ');
+    *(buf++) = 'q';
+    return output_commit(buf);
+}
 
 /*
  * Set the terminal text foreground color to the given RGB value.
  */
 int btui_set_fg(unsigned char r, unsigned char g, unsigned char b) {
-    return fprintf(bt.out, "\033[38;2;%d;%d;%dm", r, g, b);
+    return btui_set_style(BTUI_COLOR_RGB(r, g, b), BTUI_COLOR_UNCHANGED, 0);
 }
 
 /*
  * Set the terminal text background color to the given RGB value.
  */
-int btui_set_fg256(unsigned char n) { return fprintf(bt.out, "\033[38;5;%dm", n); }
+int btui_set_fg256(unsigned char n) {
+    return btui_set_style(BTUI_COLOR_256(n), BTUI_COLOR_UNCHANGED, 0);
+}
 
 /*
  * Set the terminal text foreground color to the given hexidecimal value.
  */
 int btui_set_fg_hex(uint32_t hex) {
-    return fprintf(bt.out, "\033[38;2;%d;%d;%dm", (hex >> 16) & 0xFF, (hex >> 8) & 0xFF,
-                   hex & 0xFF);
+    return btui_set_style(BTUI_COLOR_RGB((hex >> 16) & 0xFF, (hex >> 8) & 0xFF, hex & 0xFF),
+                          BTUI_COLOR_UNCHANGED, 0);
+}
+
+/*
+ * Turn the input thread on or off and return the previous setting (or -1 if
+ * the thread couldn't be started). The input thread reads and decodes
+ * terminal input as soon as it arrives, even while the main thread is busy
+ * drawing, and timestamps each key (see btui_key_time()), which also makes
+ * double clicks timed by when they happened. btui_getkey(), btui_getkey_ns()
+ * and btui_wait_event() take keys from its queue without reading the
+ * terminal themselves. Keys that were decoded but not read yet are kept when
+ * the thread is turned off.
+ */
+int btui_set_input_thread(int enabled) {
+    int prev = bt.input_threaded;
+    if (!enabled) {
+        stop_input_thread(1);
+        return prev;
+    }
+    if (prev) return prev;
+    if (!bt.in) btui_init();
+    if (use_poll_termios() == -1) return -1;
+    if (pipe(bt.wake_pipe) != 0) return -1;
+    if (pipe(bt.stop_pipe) != 0) {
+        close(bt.wake_pipe[0]), close(bt.wake_pipe[1]);
+        return -1;
+    }
+    if (pipe(bt.room_pipe) != 0) {
+        close(bt.wake_pipe[0]), close(bt.wake_pipe[1]);
+        close(bt.stop_pipe[0]), close(bt.stop_pipe[1]);
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        fcntl(bt.wake_pipe[i], F_SETFL, fcntl(bt.wake_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(bt.wake_pipe[i], F_SETFD, FD_CLOEXEC);
+        fcntl(bt.stop_pipe[i], F_SETFD, FD_CLOEXEC);
+        fcntl(bt.room_pipe[i], F_SETFL, fcntl(bt.room_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(bt.room_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    pthread_mutex_init(&bt.input_lock, NULL);
+    pthread_cond_init(&bt.input_decoded, NULL);
+    bt.queue_head = bt.queue_tail = 0;
+    bt.input_ended = 0;
+    // Keys that were already decoded (or buffered) are passed along in order:
+    bt.input_threaded = 1;
+    while (bt.num_queued_keys > 0) {
+        btui_input_event_t event = {0};
+        event.key = read_key(fileno(bt.in), &event.mouse_x, &event.mouse_y);
+        event.count = bt.key_count;
+        event.time_ns = bt.key_ns;
+        if (event.key == PASTE_EVENT && (event.paste = copy_paste())) event.paste_len = bt.paste_len;
+        bt.input_queue[bt.queue_tail++] = event;
+    }
+    // Signals are handled by the main thread:
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int failed = pthread_create(&bt.input_thread, NULL, run_input_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (failed) {
+        __atomic_store_n(&bt.input_ended, 1, __ATOMIC_RELEASE);
+        stop_input_thread(0);
+        return -1;
+    }
+    return prev;
+}
+
+/*
+ * Limit how often btui_should_render() allows a frame, in frames per second
+ * (0 for no limit). Returns 0.
+ */
+int btui_set_max_fps(double fps) {
+    bt.frame_interval_ns = fps > 0 ? (int64_t)(1e9 / fps) : 0;
+    return 0;
+}
+
+/*
+ * Turn mouse coalescing on or off and return the previous setting. When it's
+ * on, a run of mouse drag reports (or wheel turns in the same direction) that
+ * are already waiting in the input buffer is returned as a single key with
+ * the newest mouse position, and btui_key_count() says how many were merged.
+ * Presses and releases are never merged or dropped.
+ */
+int btui_set_mouse_coalescing(int enabled) {
+    // The input thread may be decoding mouse reports:
+    int prev = __atomic_exchange_n(&bt.coalesce_mouse, enabled, __ATOMIC_RELAXED);
+    return prev;
+}
+
+/*
+ * Set how many bytes of output are held back outside of a frame before they
+ * are written to the terminal (0 for the default, BTUI_OUTPUT_BUFSIZE), and
+ * make room for that much output up front. A size that fits a whole screen
+ * (e.g. a few dozen bytes per cell) lets large frames be encoded without
+ * growing the buffer. Returns the previous size.
+ */
+size_t btui_set_output_bufsize(size_t size) {
+    size_t prev = output_bufsize();
+    bt.output_bufsize = size;
+    if (output_bufsize() > bt.output_len) output_reserve(output_bufsize() - bt.output_len);
+    return prev;
+}
+
+/*
+ * Set the text style: the foreground and background colors (either of which
+ * may be BTUI_COLOR_UNCHANGED) and attributes, in a single escape sequence. If
+ * `attrs` includes BTUI_NORMAL, the style is reset before anything else is
+ * applied. Nothing is sent if the terminal already has the requested style.
+ * Colors that the terminal doesn't have (see btui_set_capabilities()) are
+ * replaced with the nearest ones that it does.
+ */
+int btui_set_style(btui_color_t fg, btui_color_t bg, attr_t attrs) {
+    fg = downsample_color(fg), bg = downsample_color(bg);
+    btui_style_t *current = bt.buffered ? &bt.pen : &bt.term_style;
+    btui_style_t style = (attrs & BTUI_NORMAL) ? blank_cell.style : *current;
+    style_apply(&style, attrs & ~BTUI_NORMAL);
+    if (fg != BTUI_COLOR_UNCHANGED) style.fg = fg;
+    if (bg != BTUI_COLOR_UNCHANGED) style.bg = bg;
+    if (bt.buffered) {
+        bt.pen = style;
+        return 0;
+    }
+    if (bt.style_known || (attrs & BTUI_NORMAL)) return set_term_style(style);
+
+    // If the terminal's style is unknown, send exactly what was requested:
+    char params[256], *end = sgr_attrs(params, attrs);
+    if (fg != BTUI_COLOR_UNCHANGED) end = sgr_color(end, fg, 30);
+    if (bg != BTUI_COLOR_UNCHANGED) end = sgr_color(end, bg, 40);
+    bt.term_style = style;
+    return put_sgr(params, end);
+}
+
+/*
+ * Show or hide a surface. Returns 0 on success or -1 if there is no such
+ * surface.
+ */
+int btui_set_surface_visible(int id, int visible) {
+    btui_surface_t *surface = find_surface(id);
+    if (!surface) return -1;
+    if (!surface->visible != !visible) {
+        surface->visible = visible;
+        add_damage(surface->x, surface->y, surface->width, surface->height);
+    }
+    return 0;
+}
+
+/*
+ * Change a surface's stacking order. Returns 0 on success or -1 if there is no
+ * such surface.
+ */
+int btui_set_surface_z(int id, int z) {
+    btui_surface_t *surface = find_surface(id);
+    if (!surface) return -1;
+    btui_surface_t moved = *surface;
+    int i = (int)(surface - bt.surfaces);
+    memmove(&bt.surfaces[i], &bt.surfaces[i + 1],
+            sizeof(btui_surface_t) * (size_t)(bt.num_surfaces - i - 1));
+    bt.num_surfaces -= 1;
+    moved.z = z;
+    insert_surface(moved);
+    if (moved.visible) add_damage(moved.x, moved.y, moved.width, moved.height);
+    return 0;
+}
+
+/*
+ * Send buffered drawing (text, boxes, clearing, etc.) into a surface, or back
+ * to the screen if `id` is 0. Each target has its own drawing cursor (relative
+ * to the target's top left corner) and style. Returns the previous target, or
+ * -1 on failure.
+ */
+int btui_set_target(int id) {
+    btui_surface_t *surface = id ? find_surface(id) : NULL;
+    if (!bt.buffered || (id && !surface)) return -1;
+    int prev = bt.target;
+    if (id == prev) return prev;
+    btui_surface_t *prev_surface = prev ? find_surface(prev) : NULL;
+    if (prev_surface) {
+        prev_surface->cursor_x = bt.cursor_x, prev_surface->cursor_y = bt.cursor_y;
+        prev_surface->pen = bt.pen;
+    } else {
+        bt.saved_cursor_x = bt.cursor_x, bt.saved_cursor_y = bt.cursor_y;
+        bt.saved_pen = bt.pen;
+    }
+    if (surface) {
+        bt.canvas = surface->cells;
+        bt.canvas_width = surface->width, bt.canvas_height = surface->height;
+        bt.cursor_x = surface->cursor_x, bt.cursor_y = surface->cursor_y;
+        bt.pen = surface->pen;
+    } else {
+        bt.canvas = bt.back, bt.canvas_width = bt.buf_width, bt.canvas_height = bt.buf_height;
+        bt.cursor_x = bt.saved_cursor_x, bt.cursor_y = bt.saved_cursor_y;
+        bt.pen = bt.saved_pen;
+    }
+    bt.target = id;
+    return prev;
 }
 
+/*
+ * Return whether it's a good time to draw a frame: whether the frame rate
+ * limit and the terminal's backlog of output allow it (see
+ * btui_render_delay_ns()).
+ */
+int btui_should_render(void) { return btui_render_delay_ns() == 0; }
+
 /*
  * Show the terminal cursor.
  */
-int btui_show_cursor(void) { return fputs(T_ON(T_SHOW_CURSOR), bt.out); }
+int btui_show_cursor(void) { return output_control(T_ON(T_SHOW_CURSOR)); }
+
+/*
+ * Return counters of the work BTUI has done since it started (or since
+ * btui_reset_stats()): output bytes, write() calls and flushes, escape
+ * sequences by kind, frames, decoded input events, input reads, and how long
+ * the last frame took to render and to write. Counting is cheap enough to
+ * always be on. The counters are brought up to date by each call.
+ */
+const btui_stats_t *btui_stats(void) {
+    bt.stats.events += __atomic_exchange_n(&bt.input_counts.events, 0, __ATOMIC_RELAXED);
+    bt.stats.bytes_read += __atomic_exchange_n(&bt.input_counts.bytes_read, 0, __ATOMIC_RELAXED);
+    bt.stats.read_calls += __atomic_exchange_n(&bt.input_counts.read_calls, 0, __ATOMIC_RELAXED);
+    return &bt.stats;
+}
 
 /*
  * Suspend the current application. This will leave TUI mode and typically drop
@@ -918,5 +5080,175 @@ int btui_show_cursor(void) { return fputs(T_ON(T_SHOW_CURSOR), bt.out); }
  */
 int btui_suspend(void) { return kill(getpid(), SIGTSTP); }
 
+/*
+ * Return what the terminal has said in reply to queries (see btui_query()).
+ * Fields are only meaningful if their BTUI_QUERY_* flag is in `answered`.
+ */
+const btui_term_info_t *btui_term_info(void) { return &bt.term; }
+
+/*
+ * Return the file descriptor that BTUI reads terminal input from.
+ */
+int btui_tty_fd(void) { return bt.in ? fileno(bt.in) : -1; }
+
+/*
+ * Stop watching a file descriptor in btui_wait_event(). Returns 0 on success
+ * or -1 if the file descriptor wasn't being watched.
+ */
+int btui_unwatch_fd(int fd) {
+    for (int i = 0; i < bt.num_watches; i++) {
+        if (bt.watches[i].fd == fd) {
+            memmove(&bt.watches[i], &bt.watches[i + 1],
+                    sizeof(btui_watch_t) * (size_t)(bt.num_watches - i - 1));
+            bt.num_watches -= 1;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Return the number of terminal cells that some text takes up, the same way
+ * it's laid out in the back buffer (escape sequences aren't handled). ASCII
+ * is measured directly, and the widths of text that isn't are cached.
+ */
+int btui_text_width(const char *s) {
+    int width = 0;
+    for (; (unsigned char)*s < 0x80; s++) {
+        if (!*s) return width;
+        if ((unsigned char)s[1] >= 0x80) break; // Might be followed by a combining mark
+        if (*s >= ' ' && *s != 0x7F) width++;
+    }
+    size_t len = strlen(s);
+    uint64_t hash = hash_bytes(s, len);
+    btui_width_entry_t *entry = &bt.width_cache[hash & (BTUI_WIDTH_CACHE_SIZE - 1)];
+    if (entry->hash == hash && entry->len == len) return width + entry->width;
+    int rest = 0;
+    while (*s) {
+        uint32_t cp;
+        int n, w = next_grapheme(&s, &cp, &n);
+        if (cp >= ' ' && cp != 0x7F) rest += w;
+    }
+    *entry = (btui_width_entry_t){.hash = hash, .len = len, .width = rest};
+    return width + rest;
+}
+
+/*
+ * Wait for the next event: a key (or mouse) input, a terminal resize, a
+ * watched file descriptor becoming ready, or a timer firing. `timeout_ns` is
+ * the maximum time to wait in nanoseconds (negative to wait forever). Returns
+ * the event type (BTUI_EVENT_TIMEOUT if nothing happened in time) and stores
+ * the details in `*event`, or returns -1 on failure.
+ */
+int btui_wait_event(int64_t timeout_ns, btui_event_t *event) {
+    if (use_poll_termios() == -1) return -1;
+    *event = (btui_event_t){.key = -1, .mouse_x = -1, .mouse_y = -1, .fd = -1, .timer = -1,
+                            .width = -1, .height = -1};
+    int64_t deadline = timeout_ns < 0 ? -1 : now_ns() + timeout_ns;
+    for (;;) {
+        if (has_input()) {
+            int key = take_key(&event->mouse_x, &event->mouse_y);
+            if (key == PASTE_EVENT) {
+                return (event->type = BTUI_EVENT_PASTE);
+            } else if (key != -1) {
+                event->key = key;
+                event->count = btui_key_count();
+                return (event->type = BTUI_EVENT_KEY);
+            }
+        }
+
+        if (bt.size_changed) {
+            bt.size_changed = 0;
+            event->width = bt.width, event->height = bt.height;
+            return (event->type = BTUI_EVENT_RESIZE);
+        }
+
+        // Fire the timer that is furthest past its deadline:
+        int64_t now = now_ns(), next_deadline = deadline;
+        btui_timer_t *due = NULL;
+        for (int i = 0; i < bt.num_timers; i++) {
+            if (bt.timers[i].deadline <= now && (!due || bt.timers[i].deadline < due->deadline))
+                due = &bt.timers[i];
+            else if (next_deadline < 0 || bt.timers[i].deadline < next_deadline)
+                next_deadline = bt.timers[i].deadline;
+        }
+        if (due) {
+            event->timer = due->id;
+            if (due->interval > 0) {
+                while (due->deadline <= now)
+                    due->deadline += due->interval;
+            } else {
+                btui_cancel_timer(due->id);
+            }
+            return (event->type = BTUI_EVENT_TIMER);
+        }
+
+        // Report ready file descriptors from the last poll() in round-robin order:
+        for (int n = 0; n < bt.num_watches; n++) {
+            btui_watch_t *w = &bt.watches[(bt.next_watch + n) % bt.num_watches];
+            if (w->ready) {
+                event->fd = w->fd;
+                event->ready = w->ready;
+                w->ready = 0;
+                bt.next_watch = (bt.next_watch + n + 1) % bt.num_watches;
+                return (event->type = BTUI_EVENT_FD);
+            }
+        }
+
+        if (deadline >= 0 && now >= deadline) return (event->type = BTUI_EVENT_TIMEOUT);
+
+        struct pollfd pfds[2 + BTUI_MAX_WATCHES];
+        int tty = key_fd();
+        pfds[0] = (struct pollfd){.fd = tty, .events = POLLIN};
+        pfds[1] = (struct pollfd){.fd = resize_pipe[0], .events = POLLIN};
+        for (int i = 0; i < bt.num_watches; i++) {
+            pfds[2 + i] = (struct pollfd){
+                .fd = bt.watches[i].fd,
+                .events = (short)(((bt.watches[i].events & BTUI_READABLE) ? POLLIN : 0)
+                                  | ((bt.watches[i].events & BTUI_WRITABLE) ? POLLOUT : 0))};
+        }
+        int timeout_ms = -1;
+        if (next_deadline >= 0)
+            timeout_ms = next_deadline <= now ? 0 : (int)((next_deadline - now + 999999) / 1000000);
+        int ready = poll(pfds, (nfds_t)(2 + bt.num_watches), timeout_ms);
+        if (ready < 0) {
+            if (errno != EINTR) return -1;
+            check_resize();
+            continue;
+        }
+        if (pfds[1].revents & POLLIN) check_resize();
+        for (int i = 0; i < bt.num_watches; i++) {
+            short revents = pfds[2 + i].revents;
+            int readable = revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL);
+            bt.watches[i].ready = (readable ? BTUI_READABLE : 0)
+                                  | ((revents & POLLOUT) ? BTUI_WRITABLE : 0);
+            bt.watches[i].ready &= bt.watches[i].events | BTUI_READABLE;
+        }
+        // (The input thread's keys are taken at the top of the loop)
+        if ((pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) && tty == fileno(bt.in)) {
+            if (fill_input(tty) <= 0 && !(pfds[0].revents & POLLIN)) return -1;
+        }
+    }
+}
+
+/*
+ * Watch a file descriptor in btui_wait_event(), which will report a
+ * BTUI_EVENT_FD event when it is ready. `events` is a combination of
+ * BTUI_READABLE and BTUI_WRITABLE. Watching an already-watched file descriptor
+ * updates its events. Returns 0 on success or -1 if too many file descriptors
+ * are being watched.
+ */
+int btui_watch_fd(int fd, int events) {
+    for (int i = 0; i < bt.num_watches; i++) {
+        if (bt.watches[i].fd == fd) {
+            bt.watches[i].events = events;
+            return 0;
+        }
+    }
+    if (bt.num_watches >= BTUI_MAX_WATCHES) return -1;
+    bt.watches[bt.num_watches++] = (btui_watch_t){.fd = fd, .events = events};
+    return 0;
+}
+
 #endif
 // vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1
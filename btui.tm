@@ -43,6 +43,11 @@ func set_mode(mode:BTUIMode)
 func disable()
     C_code `btui_disable();`
 
+# In buffered mode, drawing goes into an in-memory grid of cells and
+# `flush()` sends only the cells that changed since the last flush.
+func set_buffered(buffered:Bool)
+    C_code `btui_set_buffered(@buffered);`
+
 func force_close()
     C_code `btui_force_close();`
 
@@ -61,16 +66,25 @@ func clear(mode:ClearMode=Screen, pos:ScreenVec2?=none)
 
 enum TextAlign(Left, Center, Right)
 
+# The number of cells that text takes up on the screen (cached, and measured
+# the same way as text drawn into the screen buffer)
+func text_width(text:Text -> Int)
+    return Int(C_code:Int32`btui_text_width(@(text.as_c_string()))`)
+
 func write(text:Text, pos:ScreenVec2?=none, align:TextAlign=Left)
     if pos
         when align is Left then pass
-        is Center then pos -= ScreenVec2(text.width()/2, 0)
-        is Right then pos -= ScreenVec2(text.width(), 0)
+        is Center then pos -= ScreenVec2(text_width(text)/2, 0)
+        is Right then pos -= ScreenVec2(text_width(text), 0)
         move_cursor(pos)
 
+    # Long text is sent without copying it. Inside a frame, that's done after
+    # this function returns, so the C string is kept alive until then by the
+    # reference to it in BTUI's (statically allocated, and so scanned by the
+    # garbage collector) list of spans.
     C_code `
-        btui_puts(@(text.as_c_string()));
-        btui_flush();
+        btui_puts_span(@(text.as_c_string()));
+        if (!bt.buffered) btui_flush();
     `
 
 enum CursorMode(Default, BlinkingBlock, SteadyBlock, BlinkingUnderline, SteadyUnderline, BlinkingBar, SteadyBar)
@@ -102,24 +116,424 @@ func get_size(->ScreenVec2)
         Int(C_code:Int32`bt.height`),
     )
 
-func get_key(mouse_pos:&ScreenVec2?=none, timeout:Int?=none -> Text)
+# `timeout` is in tenths of a second, `timeout_ms` is in milliseconds (with
+# sub-millisecond precision) and doesn't need to change terminal settings.
+func get_key(mouse_pos:&ScreenVec2?=none, timeout:Int?=none, timeout_ms:Num?=none -> Text)
     timeout_i32 := if timeout then Int32(timeout) else Int32(-1)
+    timeout_ns := if timeout_ms then Int64(timeout_ms * 1e6, truncate=yes) else Int64(-1)
+    use_ns := if timeout_ms then yes else no
     mouse_x : Int32
     mouse_y : Int32
-    key := C_code:Text `
-        int key = btui_getkey(@timeout_i32, &@mouse_x, &@mouse_y);
-        char buf[256];
-        char *end = btui_keyname(key, buf);
-        Text$from_strn(buf, (int64_t)(end - buf));
+    key := C_code:Int32 `
+        @use_ns ? btui_getkey_ns(@timeout_ns, &@mouse_x, &@mouse_y)
+            : btui_getkey(@timeout_i32, &@mouse_x, &@mouse_y)
     `
     if mouse_pos
         mouse_pos[] = ScreenVec2(Int(mouse_x), Int(mouse_y))
 
-    return key
+    return key_name(key)
+
+func key_name(key:Int32 -> Text)
+    return C_code:Text `
+        char buf[256];
+        char *end = btui_keyname(@key, buf);
+        Text$from_strn(buf, (int64_t)(end - buf));
+    `
+
+# A key or mouse event as plain numbers, which is much cheaper to handle than
+# the key names from `get_key()`. `code` is the key without modifiers: a
+# character's codepoint, a control character, or one of the constants below.
+# `mouse_pos` is only set for mouse events, and `count` is how many mouse
+# events were merged into this one (see `set_mouse_coalescing()`).
+struct KeyEvent(code:Int32, modifiers:Int32=Int32(0), mouse_pos:ScreenVec2?=none, count:Int32=Int32(1))
+    SPACE := C_code:Int32`KEY_SPACE`
+    BACKSPACE := C_code:Int32`KEY_BACKSPACE2`
+    TAB := C_code:Int32`KEY_TAB`
+    ENTER := C_code:Int32`KEY_ENTER`
+    ESC := C_code:Int32`KEY_ESC`
+    F1 := C_code:Int32`KEY_F1`
+    F2 := C_code:Int32`KEY_F2`
+    F3 := C_code:Int32`KEY_F3`
+    F4 := C_code:Int32`KEY_F4`
+    F5 := C_code:Int32`KEY_F5`
+    F6 := C_code:Int32`KEY_F6`
+    F7 := C_code:Int32`KEY_F7`
+    F8 := C_code:Int32`KEY_F8`
+    F9 := C_code:Int32`KEY_F9`
+    F10 := C_code:Int32`KEY_F10`
+    F11 := C_code:Int32`KEY_F11`
+    F12 := C_code:Int32`KEY_F12`
+    INSERT := C_code:Int32`KEY_INSERT`
+    DELETE := C_code:Int32`KEY_DELETE`
+    HOME := C_code:Int32`KEY_HOME`
+    END := C_code:Int32`KEY_END`
+    PGUP := C_code:Int32`KEY_PGUP`
+    PGDN := C_code:Int32`KEY_PGDN`
+    UP := C_code:Int32`KEY_ARROW_UP`
+    DOWN := C_code:Int32`KEY_ARROW_DOWN`
+    LEFT := C_code:Int32`KEY_ARROW_LEFT`
+    RIGHT := C_code:Int32`KEY_ARROW_RIGHT`
+    MOUSE_LEFT_PRESS := C_code:Int32`MOUSE_LEFT_PRESS`
+    MOUSE_LEFT_DRAG := C_code:Int32`MOUSE_LEFT_DRAG`
+    MOUSE_LEFT_RELEASE := C_code:Int32`MOUSE_LEFT_RELEASE`
+    MOUSE_LEFT_DOUBLE := C_code:Int32`MOUSE_LEFT_DOUBLE`
+    MOUSE_RIGHT_PRESS := C_code:Int32`MOUSE_RIGHT_PRESS`
+    MOUSE_RIGHT_DRAG := C_code:Int32`MOUSE_RIGHT_DRAG`
+    MOUSE_RIGHT_RELEASE := C_code:Int32`MOUSE_RIGHT_RELEASE`
+    MOUSE_RIGHT_DOUBLE := C_code:Int32`MOUSE_RIGHT_DOUBLE`
+    MOUSE_MIDDLE_PRESS := C_code:Int32`MOUSE_MIDDLE_PRESS`
+    MOUSE_MIDDLE_DRAG := C_code:Int32`MOUSE_MIDDLE_DRAG`
+    MOUSE_MIDDLE_RELEASE := C_code:Int32`MOUSE_MIDDLE_RELEASE`
+    MOUSE_MIDDLE_DOUBLE := C_code:Int32`MOUSE_MIDDLE_DOUBLE`
+    WHEEL_UP := C_code:Int32`MOUSE_WHEEL_RELEASE`
+    WHEEL_DOWN := C_code:Int32`MOUSE_WHEEL_PRESS`
+    RESIZE := C_code:Int32`RESIZE_EVENT`
+    PASTE := C_code:Int32`PASTE_EVENT`
+
+    META := C_code:Int32`MOD_META`
+    CTRL := C_code:Int32`MOD_CTRL`
+    ALT := C_code:Int32`MOD_ALT`
+    SHIFT := C_code:Int32`MOD_SHIFT`
+
+    func from_key(key:Int32, mouse_x:Int32, mouse_y:Int32, count:Int32=Int32(1) -> KeyEvent)
+        code := C_code:Int32`@key & ~MOD_MASK`
+        modifiers := C_code:Int32`@key & MOD_MASK`
+        if mouse_x >= 0 and mouse_y >= 0
+            return KeyEvent(code, modifiers, ScreenVec2(Int(mouse_x), Int(mouse_y)), count)
+        return KeyEvent(code, modifiers, count=count)
+
+    func has(e:KeyEvent, modifier:Int32 -> Bool)
+        return C_code:Bool`(@(e.modifiers) & @modifier) != 0`
+
+    func name(e:KeyEvent -> Text)
+        return key_name(C_code:Int32`@(e.code) | @(e.modifiers)`)
+
+# Like `get_key()`, but returns a `KeyEvent` (or `none` on timeout) instead of
+# the key's name.
+func get_key_event(timeout_ms:Num?=none -> KeyEvent?)
+    timeout_ns := if timeout_ms then Int64(timeout_ms * 1e6, truncate=yes) else Int64(-1)
+    mouse_x : Int32
+    mouse_y : Int32
+    key := C_code:Int32 `btui_getkey_ns(@timeout_ns, &@mouse_x, &@mouse_y)`
+    if key == -1
+        return none
+    return KeyEvent.from_key(key, mouse_x, mouse_y, C_code:Int32`btui_key_count()`)
+
+# Merge runs of mouse drags (or wheel turns in the same direction) that arrive
+# faster than they're handled into one event with the newest mouse position.
+# Presses and releases are never dropped.
+func set_mouse_coalescing(enabled:Bool)
+    C_code `btui_set_mouse_coalescing(@enabled);`
+
+# Read and decode input on a background thread, so keys are picked up (and
+# timestamped, which is what double clicks are timed by) as soon as they
+# arrive, even while a long frame is being drawn. `get_key()` and
+# `get_event()` then take keys from the thread's queue. Returns whether the
+# thread is running.
+func set_input_thread(enabled:Bool -> Bool)
+    if C_code:Int32 `btui_set_input_thread(@enabled)` < 0
+        return no
+    return enabled
+
+# How many milliseconds ago the input for the last key arrived
+func last_key_age_ms(-> Num)
+    return C_code:Num `(double)(now_ns() - btui_key_time()) / 1e6`
+
+# The text of the last paste (when `get_key()` returns "Paste")
+func get_paste(-> Text)
+    return C_code:Text `
+        size_t len;
+        const char *paste = btui_get_paste(&len);
+        Text$from_strn(paste ? paste : "", (int64_t)len);
+    `
+
+enum Event(
+    Timeout,
+    Key(key:Text, mouse_pos:ScreenVec2),
+    KeyCode(event:KeyEvent),
+    Resize(size:ScreenVec2),
+    Paste(text:Text),
+    FDReady(fd:Int32, readable:Bool, writable:Bool),
+    Timer(id:Int32),
+)
+
+# The file descriptor for terminal input (e.g. to use with your own event loop)
+func tty_fd(-> Int32)
+    return C_code:Int32 `btui_tty_fd()`
+
+# Run without a real terminal (for tests and benchmarks), instead of on
+# /dev/tty. Output is captured (see `captured_output()`), and input comes from
+# `inject_input()`. With `pty=yes`, a pseudo-terminal is used instead of
+# memory and a pipe. Returns whether it worked.
+func init_headless(size=ScreenVec2(80, 24), pty=no -> Bool)
+    backend := if pty then C_code:Int32`BTUI_HEADLESS_PTY` else C_code:Int32`BTUI_HEADLESS_MEMORY`
+    return C_code:Int32 `btui_init_headless(@(Int32(size.x)), @(Int32(size.y)), @backend)` == 0
+
+# Feed input to a headless terminal, as if it were typed
+func inject_input(text:Text)
+    C_code `
+        const char *str = @(text.as_c_string());
+        btui_inject_input(str, strlen(str));
+    `
+
+# Everything written to a headless terminal since it started (or since
+# `reset_captured_output()`)
+func captured_output(-> Text)
+    return C_code:Text `
+        size_t len = 0;
+        const char *output = btui_captured_output(&len);
+        Text$from_strn(output ? output : "", (int64_t)len);
+    `
+
+# The number of bytes of `captured_output()`
+func captured_bytes(-> Int)
+    return Int(C_code:Int64 `
+        size_t len = 0;
+        btui_captured_output(&len);
+        (int64_t)len;
+    `)
+
+func reset_captured_output()
+    C_code `btui_reset_captured_output();`
+
+# Change the size of a headless terminal (reported like a real resize)
+func resize_headless(size:ScreenVec2)
+    C_code `btui_resize_headless(@(Int32(size.x)), @(Int32(size.y)));`
+
+# Make `get_event()` report `FDReady` events for a file descriptor
+func watch_fd(fd:Int32, readable=yes, writable=no)
+    C_code `btui_watch_fd(@fd, (@readable ? BTUI_READABLE : 0) | (@writable ? BTUI_WRITABLE : 0));`
+
+func unwatch_fd(fd:Int32)
+    C_code `btui_unwatch_fd(@fd);`
+
+# Make `get_event()` report a `Timer` event after a delay (and then every
+# `interval_ms` milliseconds, if given). Returns the timer's ID.
+func add_timer(delay_ms:Num, interval_ms:Num?=none -> Int32)
+    delay_ns := Int64(delay_ms * 1e6, truncate=yes)
+    interval_ns := if interval_ms then Int64(interval_ms * 1e6, truncate=yes) else Int64(0)
+    return C_code:Int32 `btui_add_timer(@delay_ns, @interval_ns)`
+
+func cancel_timer(id:Int32)
+    C_code `btui_cancel_timer(@id);`
+
+# Wait for input, a resize, a watched file descriptor, or a timer, whichever
+# comes first. `timeout_ms` is the longest time to wait (forever by default).
+# With `key_codes=yes`, keys are reported as `KeyCode` events instead of `Key`.
+func get_event(timeout_ms:Num?=none, key_codes=no -> Event)
+    timeout_ns := if timeout_ms then Int64(timeout_ms * 1e6, truncate=yes) else Int64(-1)
+    event_type : Int32
+    key : Int32
+    mouse_x : Int32
+    mouse_y : Int32
+    fd : Int32
+    ready : Int32
+    timer : Int32
+    count : Int32
+    C_code `
+        btui_event_t ev;
+        @event_type = btui_wait_event(@timeout_ns, &ev);
+        @key = ev.key;
+        @mouse_x = ev.mouse_x;
+        @mouse_y = ev.mouse_y;
+        @fd = ev.fd;
+        @ready = ev.ready;
+        @timer = ev.timer;
+        @count = ev.count;
+    `
+    if event_type == C_code:Int32`BTUI_EVENT_KEY`
+        if key_codes
+            return Event.KeyCode(KeyEvent.from_key(key, mouse_x, mouse_y, count))
+        return Event.Key(key_name(key), ScreenVec2(Int(mouse_x), Int(mouse_y)))
+    else if event_type == C_code:Int32`BTUI_EVENT_RESIZE`
+        return Event.Resize(get_size())
+    else if event_type == C_code:Int32`BTUI_EVENT_PASTE`
+        return Event.Paste(get_paste())
+    else if event_type == C_code:Int32`BTUI_EVENT_FD`
+        readable := C_code:Bool`(@ready & BTUI_READABLE) != 0`
+        writable := C_code:Bool`(@ready & BTUI_WRITABLE) != 0`
+        return Event.FDReady(fd, readable, writable)
+    else if event_type == C_code:Int32`BTUI_EVENT_TIMER`
+        return Event.Timer(timer)
+    else
+        return Event.Timeout
 
 func flush()
     C_code `btui_flush();`
 
+# Hold back output until end_frame(), then send it all at once (using
+# synchronized output, so the terminal never shows a half-drawn frame).
+# Frames can be nested, and flush() does nothing inside a frame.
+func begin_frame()
+    C_code `btui_begin_frame();`
+
+func end_frame()
+    C_code `btui_end_frame();`
+
+func with_frame(draw:func())
+    begin_frame()
+    draw()
+    end_frame()
+
+# Hold back up to `bytes` of output outside of a frame before writing it to
+# the terminal (`none` for the default, 64KiB), with room for that much set
+# aside up front, so that big frames are encoded without growing the buffer
+func set_output_buffer_size(bytes:Int?=none)
+    size := if bytes then Int64(bytes) else Int64(0)
+    C_code `btui_set_output_bufsize((size_t)@size);`
+
+# An offscreen layer (for popups, menus, etc.) that is composited over the
+# screen in buffered mode. Showing, hiding or moving a surface only repaints
+# the area it covers.
+struct Surface(id:Int32)
+    # Draw into the surface: drawing functions called by `draw_fn` use the
+    # surface's own cursor (relative to its top left corner) and style.
+    func draw(s:Surface, draw_fn:func())
+        prev := C_code:Int32 `btui_set_target(@(s.id))`
+        draw_fn()
+        if prev >= 0
+            C_code `btui_set_target(@prev);`
+
+    func move(s:Surface, pos:ScreenVec2)
+        C_code `btui_move_surface(@(s.id), @(Int32(pos.x)), @(Int32(pos.y)));`
+
+    func show(s:Surface)
+        C_code `btui_set_surface_visible(@(s.id), 1);`
+
+    func hide(s:Surface)
+        C_code `btui_set_surface_visible(@(s.id), 0);`
+
+    func set_z(s:Surface, z:Int)
+        C_code `btui_set_surface_z(@(s.id), @(Int32(z)));`
+
+    func destroy(s:Surface)
+        C_code `btui_free_surface(@(s.id));`
+
+# Make a new surface (transparent until drawn into) above the screen and any
+# surfaces with a lower `z`. Returns `none` if not in buffered mode.
+func new_surface(pos:ScreenVec2, size:ScreenVec2, z=1 -> Surface?)
+    id := C_code:Int32 `btui_new_surface(@(Int32(pos.x)), @(Int32(pos.y)), @(Int32(size.x)), @(Int32(size.y)), @(Int32(z)))`
+    if id < 0
+        return none
+    return Surface(id)
+
+# Whether to draw a frame now, or skip it because of the frame rate limit or
+# because the terminal (e.g. over a slow SSH link) is still catching up on
+# earlier output. In buffered mode, skipped frames collapse into the next one.
+func should_render(-> Bool)
+    return C_code:Bool `btui_should_render()`
+
+# How long until `should_render()` will be true, for use as a timeout
+func render_delay_ms(-> Num)
+    return C_code:Num `(double)btui_render_delay_ns() / 1e6`
+
+# Limit frames to at most `fps` per second (`none` for no limit)
+func set_max_fps(fps:Num?=none)
+    fps_num := fps or 0.0
+    C_code `btui_set_max_fps(@fps_num);`
+
+# Counters of the work BTUI has done since it started or since
+# `reset_stats()`, for showing a performance HUD or logging regressions. The
+# times are for the last frame: drawing it (up to sending it), and writing it.
+struct Stats(
+    bytes_written, write_calls, flushes:Int,
+    cursor_moves, style_changes, erases, repeats, scrolls, other_escapes:Int,
+    frames, events, bytes_read, read_calls:Int,
+    render_ms, flush_ms:Num,
+)
+
+func get_stats(-> Stats)
+    return Stats(
+        Int(C_code:Int64 `(int64_t)btui_stats()->bytes_written`),
+        Int(C_code:Int64 `(int64_t)btui_stats()->write_calls`),
+        Int(C_code:Int64 `(int64_t)btui_stats()->flushes`),
+        Int(C_code:Int64 `(int64_t)btui_stats()->escapes[BTUI_ESCAPE_CURSOR]`),
+        Int(C_code:Int64 `(int64_t)btui_stats()->escapes[BTUI_ESCAPE_STYLE]`),
+        Int(C_code:Int64 `(int64_t)btui_stats()->escapes[BTUI_ESCAPE_ERASE]`),
+        Int(C_code:Int64 `(int64_t)btui_stats()->escapes[BTUI_ESCAPE_REPEAT]`),
+        Int(C_code:Int64 `(int64_t)btui_stats()->escapes[BTUI_ESCAPE_SCROLL]`),
+        Int(C_code:Int64 `(int64_t)btui_stats()->escapes[BTUI_ESCAPE_OTHER]`),
+        Int(C_code:Int64 `(int64_t)btui_stats()->frames`),
+        Int(C_code:Int64 `(int64_t)btui_stats()->events`),
+        Int(C_code:Int64 `(int64_t)btui_stats()->bytes_read`),
+        Int(C_code:Int64 `(int64_t)btui_stats()->read_calls`),
+        C_code:Num `(double)btui_stats()->render_ns / 1e6`,
+        C_code:Num `(double)btui_stats()->flush_ns / 1e6`,
+    )
+
+func reset_stats()
+    C_code `btui_reset_stats();`
+
+# A set of lines to search (kept in C as one block of text). Searches are
+# split across threads, and matches for a query are kept to narrow down as
+# the query gets longer.
+struct Matcher(id:Int32)
+    func add(m:Matcher, line:Text)
+        C_code `
+            const char *str = @(line.as_c_string());
+            btui_matcher_add(@(m.id), str, strlen(str));
+        `
+
+    func count(m:Matcher -> Int)
+        return Int(C_code:Int64 `(int64_t)btui_matcher_count(@(m.id))`)
+
+    # Find the lines that contain `query` or, if `fuzzy`, that contain its
+    # characters in order (best matches first, keeping the best `limit` if it
+    # isn't 0). Returns the number of results.
+    func search(m:Matcher, query:Text, fuzzy=no, limit=0 -> Int)
+        flags := if fuzzy then Int32(1) else Int32(0)
+        limit_i64 := Int64(limit)
+        return Int(C_code:Int64 `btui_match(@(m.id), @(query.as_c_string()), @flags, (size_t)@limit_i64)`)
+
+    # The `n`th result of the last search (counting from 1)
+    func result(m:Matcher, n:Int -> Text?)
+        index := Int64(n - 1)
+        if index < 0 or not C_code:Bool `btui_match_result(@(m.id), (size_t)@index, NULL) != NULL`
+            return none
+        return C_code:Text `
+            size_t len;
+            const char *str = btui_match_result(@(m.id), (size_t)@index, &len);
+            Text$from_strn(str, (int64_t)len);
+        `
+
+    # Read whatever input is ready on a file descriptor (see `open_input()`)
+    # and add its lines, skipping empty ones. Returns the number of bytes
+    # read (0 at the end of the input), or `none` if nothing could be read.
+    func read(m:Matcher, fd:Int32 -> Int?)
+        bytes := C_code:Int64 `btui_matcher_read(@(m.id), @fd)`
+        if bytes < 0
+            return none
+        return Int(bytes)
+
+    # How many lines matched the last search (including fuzzy matches that
+    # weren't among the best `limit`)
+    func total_matches(m:Matcher -> Int)
+        return Int(C_code:Int64 `(int64_t)btui_match_total(@(m.id))`)
+
+    func destroy(m:Matcher)
+        C_code `btui_free_matcher(@(m.id));`
+
+func new_matcher(-> Matcher?)
+    id := C_code:Int32 `btui_new_matcher()`
+    if id < 0
+        return none
+    return Matcher(id)
+
+# Open a file to read without blocking, so it can be watched with `watch_fd()`
+# and read a bit at a time (e.g. with `Matcher.read()`)
+func open_input(path:Path -> Int32?)
+    fd := C_code:Int32 `open(@(path.as_c_string()), O_RDONLY | O_NONBLOCK | O_CLOEXEC)`
+    if fd < 0
+        return none
+    return fd
+
+# Stop watching and close a file opened with `open_input()`
+func close_input(fd:Int32)
+    C_code `
+        btui_unwatch_fd(@fd);
+        close(@fd);
+    `
+
 func draw_linebox(pos:ScreenVec2, size:ScreenVec2)
     C_code `btui_draw_linebox(@(Int32(pos.x)), @(Int32(pos.y)), @(Int32(size.x)), @(Int32(size.y)));`
 
@@ -141,31 +555,32 @@ func style(
     fraktur:Bool?=none, double_underline:Bool?=none, framed:Bool?=none,
     encircled:Bool?=none, overlined:Bool?=none,
 )
+    C_code `btui_color_t fg_color = BTUI_COLOR_UNCHANGED, bg_color = BTUI_COLOR_UNCHANGED;`
     if fg
-        when fg is RGB(r,g,b) then C_code `btui_set_fg(@r, @g, @b);`
-        is Color256(n) then C_code `btui_set_fg256(@n);`
-        is Normal then C_code `btui_set_attributes(BTUI_FG_NORMAL);`
-        is Black then C_code `btui_set_attributes(BTUI_FG_BLACK);`
-        is Red then C_code `btui_set_attributes(BTUI_FG_RED);`
-        is Green then C_code `btui_set_attributes(BTUI_FG_GREEN);`
-        is Yellow then C_code `btui_set_attributes(BTUI_FG_YELLOW);`
-        is Blue then C_code `btui_set_attributes(BTUI_FG_BLUE);`
-        is Magenta then C_code `btui_set_attributes(BTUI_FG_MAGENTA);`
-        is Cyan then C_code `btui_set_attributes(BTUI_FG_CYAN);`
-        is White then C_code `btui_set_attributes(BTUI_FG_WHITE);`
+        when fg is RGB(r,g,b) then C_code `fg_color = BTUI_COLOR_RGB(@r, @g, @b);`
+        is Color256(n) then C_code `fg_color = BTUI_COLOR_256(@n);`
+        is Normal then C_code `fg_color = BTUI_COLOR_DEFAULT;`
+        is Black then C_code `fg_color = BTUI_COLOR_BASIC(0);`
+        is Red then C_code `fg_color = BTUI_COLOR_BASIC(1);`
+        is Green then C_code `fg_color = BTUI_COLOR_BASIC(2);`
+        is Yellow then C_code `fg_color = BTUI_COLOR_BASIC(3);`
+        is Blue then C_code `fg_color = BTUI_COLOR_BASIC(4);`
+        is Magenta then C_code `fg_color = BTUI_COLOR_BASIC(5);`
+        is Cyan then C_code `fg_color = BTUI_COLOR_BASIC(6);`
+        is White then C_code `fg_color = BTUI_COLOR_BASIC(7);`
 
     if bg
-        when bg is RGB(r,g,b) then C_code `btui_set_bg(@r, @g, @b);`
-        is Color256(n) then C_code `btui_set_bg256(@n);`
-        is Normal then C_code `btui_set_attributes(BTUI_BG_NORMAL);`
-        is Black then C_code `btui_set_attributes(BTUI_BG_BLACK);`
-        is Red then C_code `btui_set_attributes(BTUI_BG_RED);`
-        is Green then C_code `btui_set_attributes(BTUI_BG_GREEN);`
-        is Yellow then C_code `btui_set_attributes(BTUI_BG_YELLOW);`
-        is Blue then C_code `btui_set_attributes(BTUI_BG_BLUE);`
-        is Magenta then C_code `btui_set_attributes(BTUI_BG_MAGENTA);`
-        is Cyan then C_code `btui_set_attributes(BTUI_BG_CYAN);`
-        is White then C_code `btui_set_attributes(BTUI_BG_WHITE);`
+        when bg is RGB(r,g,b) then C_code `bg_color = BTUI_COLOR_RGB(@r, @g, @b);`
+        is Color256(n) then C_code `bg_color = BTUI_COLOR_256(@n);`
+        is Normal then C_code `bg_color = BTUI_COLOR_DEFAULT;`
+        is Black then C_code `bg_color = BTUI_COLOR_BASIC(0);`
+        is Red then C_code `bg_color = BTUI_COLOR_BASIC(1);`
+        is Green then C_code `bg_color = BTUI_COLOR_BASIC(2);`
+        is Yellow then C_code `bg_color = BTUI_COLOR_BASIC(3);`
+        is Blue then C_code `bg_color = BTUI_COLOR_BASIC(4);`
+        is Magenta then C_code `bg_color = BTUI_COLOR_BASIC(5);`
+        is Cyan then C_code `bg_color = BTUI_COLOR_BASIC(6);`
+        is White then C_code `bg_color = BTUI_COLOR_BASIC(7);`
 
     C_code `uint64_t attr = 0;`
 
@@ -197,48 +612,87 @@ func style(
     if encircled == yes then C_code `attr |= BTUI_ENCIRCLED;`
     if overlined == yes then C_code `attr |= BTUI_OVERLINED;`
 
-    C_code `if (attr) btui_set_attributes(attr);`
-
-func get_bg(->Color?)
-    no_color : Color? = none
-    response := C_code:Text`
-        const char *query_bg = "\\x1b]11;?\\x07";
-        write(fileno(bt.out), query_bg, strlen(query_bg));
-
-        char buf[256] = {};
-        ssize_t n = read(fileno(bt.in), buf, sizeof(buf)-1);
-        if (n < 0) {
-            return @(no_color);
-        }
-        const char *response_prefix = "\\x1b]11;";
-        size_t prefix_len = strlen(response_prefix);
-        if ((size_t)n < prefix_len || strncmp(buf, response_prefix, prefix_len) != 0) {
-            return @(no_color);
-        }
-
-        Text$from_strn(buf + prefix_len, n - prefix_len)
-    `
-    value : Text
-    if response.starts_with("rgb:", &value) or response.starts_with("rgba:", &value)
-        rgb := value.split("/")
-        r := Byte.parse("0x"++rgb[1]!.to(2)) or return none
-        g := Byte.parse("0x"++rgb[2]!.to(2)) or return none
-        b := Byte.parse("0x"++rgb[3]!.to(2)) or return none
-        return Color.RGB(r,g,b)
-    else if response.starts_with("#", &value)
-        r := Byte.parse("0x"++value.from(1).to(2)) or return none
-        g := Byte.parse("0x"++value.from(3).to(4)) or return none
-        b := Byte.parse("0x"++value.from(5).to(6)) or return none
-        return Color.RGB(r, g, b)
-    else if response.starts_with("rgb(", &value) or response.starts_with("rgba(", &value)
-        value = value.without_suffix(")")
-        rgb := value.split(",")
-        r := Byte.parse(rgb[1] or return none) or return none
-        g := Byte.parse(rgb[2] or return none) or return none
-        b := Byte.parse(rgb[3] or return none) or return none
-        return Color.RGB(r,g,b)
-    else
+    # Colors and attributes are sent in a single escape sequence, and only if
+    # they would change the terminal's current style:
+    C_code `btui_set_style(fg_color, bg_color, attr);`
+
+# Ask the terminal everything that BTUI can query (colors, cursor position,
+# device attributes, synchronized output and truecolor support) in a single
+# round trip, waiting up to `timeout_ms` for the replies. The answers are
+# cached, so later calls to `get_bg()` etc. don't need to wait.
+func query_terminal(timeout_ms=100.0)
+    timeout_ns := Int64(timeout_ms * 1e6, truncate=yes)
+    C_code `btui_query(BTUI_QUERY_ALL, @timeout_ns);`
+
+# The terminal's default background color, or `none` if the terminal doesn't
+# say within `timeout_ms`
+func get_bg(timeout_ms=100.0 -> Color?)
+    timeout_ns := Int64(timeout_ms * 1e6, truncate=yes)
+    if C_code:Int32`btui_query(BTUI_QUERY_BG, @timeout_ns)` <= 0
+        return none
+    return Color.RGB(
+        C_code:Byte`(uint8_t)(btui_term_info()->bg >> 16)`,
+        C_code:Byte`(uint8_t)(btui_term_info()->bg >> 8)`,
+        C_code:Byte`(uint8_t)btui_term_info()->bg`,
+    )
+
+# The terminal's default foreground color, or `none` if the terminal doesn't
+# say within `timeout_ms`
+func get_fg(timeout_ms=100.0 -> Color?)
+    timeout_ns := Int64(timeout_ms * 1e6, truncate=yes)
+    if C_code:Int32`btui_query(BTUI_QUERY_FG, @timeout_ns)` <= 0
         return none
+    return Color.RGB(
+        C_code:Byte`(uint8_t)(btui_term_info()->fg >> 16)`,
+        C_code:Byte`(uint8_t)(btui_term_info()->fg >> 8)`,
+        C_code:Byte`(uint8_t)btui_term_info()->fg`,
+    )
+
+# Where the terminal's cursor actually is (asked every time, since it moves)
+func get_cursor_pos(timeout_ms=100.0 -> ScreenVec2?)
+    timeout_ns := Int64(timeout_ms * 1e6, truncate=yes)
+    if C_code:Int32`btui_query(BTUI_QUERY_CURSOR, @timeout_ns)` <= 0
+        return none
+    return ScreenVec2(
+        Int(C_code:Int32`btui_term_info()->cursor_x`),
+        Int(C_code:Int32`btui_term_info()->cursor_y`),
+    )
+
+# Whether the terminal supports 24-bit colors (from $COLORTERM or a query)
+func has_truecolor(timeout_ms=100.0 -> Bool)
+    timeout_ns := Int64(timeout_ms * 1e6, truncate=yes)
+    if C_code:Int32`btui_query(BTUI_QUERY_TRUECOLOR, @timeout_ns)` <= 0
+        return no
+    return C_code:Bool`btui_term_info()->truecolor != 0`
+
+# Whether the terminal supports synchronized output (used by `with_frame()`)
+func has_sync_output(timeout_ms=100.0 -> Bool)
+    timeout_ns := Int64(timeout_ms * 1e6, truncate=yes)
+    if C_code:Int32`btui_query(BTUI_QUERY_SYNC_OUTPUT, @timeout_ns)` <= 0
+        return no
+    return C_code:Bool`(btui_term_info()->sync_output == 1 || btui_term_info()->sync_output == 2)`
+
+# How many colors the terminal can show: colors it can't show (e.g. `RGB` on
+# a 256-color terminal) are replaced by the nearest ones it can. This starts
+# out as `TrueColor` (colors are sent as they are), and `has_truecolor()` or
+# `query_terminal()` turn it down to `Palette256` for terminals that reply that
+# they don't support 24-bit color.
+enum ColorDepth(Basic, Palette256, TrueColor)
+
+func set_color_depth(depth:ColorDepth)
+    C_code `int caps = btui_capabilities() & ~(BTUI_CAP_TRUECOLOR | BTUI_CAP_256COLOR);`
+    when depth is TrueColor then C_code `caps |= BTUI_CAP_TRUECOLOR | BTUI_CAP_256COLOR;`
+    is Palette256 then C_code `caps |= BTUI_CAP_256COLOR;`
+    is Basic then pass
+    C_code `btui_set_capabilities(caps);`
+
+func get_color_depth(-> ColorDepth)
+    caps := C_code:Int32 `btui_capabilities()`
+    if C_code:Bool`(@caps & BTUI_CAP_TRUECOLOR) != 0`
+        return ColorDepth.TrueColor
+    else if C_code:Bool`(@caps & BTUI_CAP_256COLOR) != 0`
+        return ColorDepth.Palette256
+    return ColorDepth.Basic
 
 func suspend()
     C_code `btui_suspend();`
@@ -5,31 +5,171 @@ _HELP := "
     A simple picker program
 "
 
+# How many of the best fuzzy matches to keep
+_FUZZY_LIMIT := 1000
+
 struct Picker(
-    options:[Text],
+    matcher:Matcher,
     prompt=">",
     query="",
     offset:Int=0,
     max_height:Int?=20,
+    fuzzy=no,
+    # How many results the current query has:
+    num_results:Int=0,
+    # Where more options are coming from (until the end of the input):
+    input_fd:Int32?=none,
+    # The index (from 0) of the first result in view:
+    scroll:Int=0,
+    # The screen row of the prompt, if the terminal said where its cursor was,
+    # otherwise rows are found relative to the cursor's row:
+    top:Int?=none,
+    cursor_row:Int=0,
+    # What the rows below the prompt were last drawn with, to tell which of
+    # them need to be drawn again:
+    shown_rows:Int=0,
+    shown_scroll:Int=0,
+    shown_offset:Int=0,
+    results_changed=yes,
 )
-    func draw(self:Picker)
-        live_options := self.live_options()
-        if chosen := self.chosen()
-            write("\r\033[33;1m$(self.prompt)\033[m \033[2m$(chosen.replace(self.query, "\033[0;1m$(self.query)\033[0;2m"))\033[m\033[K")
+    # Make room below the prompt for the options (scrolling the terminal if
+    # the prompt is near the bottom) and find out which row the prompt is on
+    func reserve_space(self:&Picker)
+        rows := self.num_rows()
+        begin_frame()
+        write("\r")
+        clear(Below)
+        for i in rows
+            write("\n")
+        move_cursor(ScreenVec2(0, -rows), relative=yes)
+        end_frame()
+        self.cursor_row = 0
+        if pos := get_cursor_pos()
+            self.top = pos.y
         else
-            write("\r\033[33;1m$(self.prompt)\033[m \033[31m$(self.query)\033[m\033[K")
+            self.top = none
+        self.results_changed = yes
 
+    # How many rows of options are shown below the prompt
+    func num_rows(self:Picker -> Int)
         size := get_size()
-        height := (self.max_height or size.y) _min_ size.y
-        shown_options := live_options.to(height-1)
-        for opt in shown_options
-            write("\r\n\033[K$opt")
-        clear(Below)
-        move_cursor(ScreenVec2(0, -shown_options.length), relative=yes)
-        flush()
+        return ((self.max_height or size.y) _min_ size.y) - 1
+
+    func goto_row(self:&Picker, row:Int)
+        if top := self.top
+            move_cursor(ScreenVec2(0, top + row))
+        else
+            write("\r")
+            move_cursor(ScreenVec2(0, row - self.cursor_row), relative=yes)
+        self.cursor_row = row
+
+    # Keep the selected result in view
+    func fit_viewport(self:&Picker, rows:Int)
+        if self.offset < self.scroll
+            self.scroll = self.offset
+        else if self.offset >= self.scroll + rows
+            self.scroll = self.offset - rows + 1
+        self.scroll = (self.scroll _min_ (self.num_results - rows)) _max_ 0
+
+    func draw_prompt(self:&Picker)
+        self.goto_row(0)
+        loading := if self.input_fd then "+" else ""
+        count := "\033[2m  $(self.matcher.total_matches())/$(self.matcher.count())$loading\033[m"
+        if chosen := self.chosen()
+            write("\033[33;1m$(self.prompt)\033[m \033[2m$(chosen.replace(self.query, "\033[0;1m$(self.query)\033[0;2m"))\033[m$count\033[K")
+        else
+            write("\033[33;1m$(self.prompt)\033[m \033[31m$(self.query)\033[m$count\033[K")
+
+    # Draw the result in one row below the prompt (counting from 1)
+    func draw_row(self:&Picker, row:Int)
+        self.goto_row(row)
+        index := self.scroll + row - 1
+        option := self.matcher.result(index + 1) or ""
+        # Long options would wrap and push the rows below down:
+        width := get_size().x
+        option = option.to(width)
+        while text_width(option) > width
+            option = option.to(-2)
+        if index == self.offset
+            write("\033[7m$option\033[m\033[K")
+        else
+            write("$option\033[K")
+
+    # Draw the rows that have changed since the last time: everything after
+    # the results change, the rows that scrolled into view (moving the rest
+    # with a scroll region), or just the old and new selection.
+    func draw(self:&Picker)
+        rows := self.num_rows()
+        self.fit_viewport(rows)
+        begin_frame()
+        shift := self.scroll - self.shown_scroll
+        if self.results_changed or rows != self.shown_rows or (shift != 0 and (not self.top or shift <= -rows or shift >= rows))
+            for row in rows
+                self.draw_row(row)
+        else
+            if shift != 0
+                top := self.top!
+                scroll(top + 1, top + rows, shift)
+                if shift > 0
+                    for row in (rows - shift + 1).to(rows)
+                        self.draw_row(row)
+                else
+                    for row in (-shift)
+                        self.draw_row(row)
+            if self.offset != self.shown_offset or shift != 0
+                old_row := self.shown_offset - self.scroll + 1
+                if old_row >= 1 and old_row <= rows
+                    self.draw_row(old_row)
+                self.draw_row(self.offset - self.scroll + 1)
+        self.draw_prompt()
+        end_frame()
+        self.shown_rows = rows
+        self.shown_scroll = self.scroll
+        self.shown_offset = self.offset
+        self.results_changed = no
 
-    func update(self:&Picker)
-        key := get_key()
+    func run(self:&Picker)
+        needs_draw := yes
+        repeat
+            # Input can arrive much faster than the terminal can show it, so
+            # frames are only drawn when the terminal has caught up:
+            timeout : Num? = none
+            if needs_draw
+                if should_render()
+                    self.draw()
+                    needs_draw = no
+                else
+                    timeout = render_delay_ms()
+
+            when get_event(timeout_ms=timeout)
+            is Key(key, mouse_pos)
+                self.handle_key(key)
+                needs_draw = yes
+            is FDReady(fd, readable, writable)
+                self.read_input()
+                needs_draw = yes
+            is Resize(size)
+                self.reserve_space()
+                needs_draw = yes
+            else
+                pass
+
+    func read_input(self:&Picker)
+        fd := self.input_fd or return
+        bytes := self.matcher.read(fd) or return
+        if bytes == 0
+            close_input(fd)
+            self.input_fd = none
+        # Only the new options need to be checked against the query:
+        changed := self.results_changed
+        had_results := self.num_results
+        self.set_query(self.query)
+        # New substring matches go after the old ones (fuzzy matches get
+        # ranked among them), so a full view doesn't need drawing again:
+        if not self.fuzzy and had_results >= self.scroll + self.num_rows()
+            self.results_changed = changed
+
+    func handle_key(self:&Picker, key:Text)
         when key
         is "Ctrl-c"
             write("\r")
@@ -48,39 +188,48 @@ struct Picker(
             else
                 exit(code=1)
         is "Backspace"
-            self.query = self.query.to(-2)
+            self.set_query(self.query.to(-2))
         is "Space"
-            self.query ++= " "
+            self.set_query(self.query ++ " ")
         is "Up", "Shift-Tab"
-            self.offset -= 1
+            if self.num_results > 0
+                self.offset = (self.offset - 1) mod self.num_results
         is "Down", "Tab"
-            self.offset += 1
+            if self.num_results > 0
+                self.offset = (self.offset + 1) mod self.num_results
         else if key.length == 1
-            self.query ++= key
+            self.set_query(self.query ++ key)
 
-    func live_options(self:Picker -> [Text])
-        return [o for o in self.options if o.has(self.query)]
+    func set_query(self:&Picker, query:Text)
+        if query != self.query
+            self.offset = 0
+        self.query = query
+        # The matcher keeps the matches for shorter queries, so typing only
+        # checks what matched before and Backspace doesn't check anything:
+        limit := if self.fuzzy then _FUZZY_LIMIT else 0
+        self.num_results = self.matcher.search(query, fuzzy=self.fuzzy, limit=limit)
+        if self.offset >= self.num_results
+            self.offset = (self.num_results - 1) _max_ 0
+        self.results_changed = yes
 
     func chosen(self:Picker -> Text?)
-        live_options := self.live_options()
-        if live_options.length > 0
-            return live_options[(1 + self.offset) mod1 live_options.length]
-        else
-            return none
+        return self.matcher.result(self.offset + 1)
 
-func main(choices:Path=(/dev/stdin), prompt|p=">", query|q="", max_height|H:Int?=20)
-    lines := choices.lines() or fail("No such file: $choices")
-    lines = [line for line in lines if line.length > 0]
+func main(choices:Path=(/dev/stdin), prompt|p=">", query|q="", max_height|H:Int?=20, fuzzy|f=no)
+    # Options are read as they arrive, so the picker can be used right away:
+    input_fd := open_input(choices) or fail("No such file: $choices")
+    matcher := new_matcher() or fail("Couldn't make a matcher")
     picker := Picker(
-        options=lines,
+        matcher=matcher,
         prompt=prompt,
-        query=query,
         max_height=max_height,
+        fuzzy=fuzzy,
+        input_fd=input_fd,
     )
+    picker.set_query(query)
     set_mode(Normal)
     hide_cursor()
-    picker.draw()
-    repeat
-        picker.draw()
-        picker.update()
+    watch_fd(input_fd)
+    picker.reserve_space()
+    picker.run()
     disable()